@@ -0,0 +1,16 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <chrono>
+
+typedef std::chrono::steady_clock BenchClock;
+
+/**
+  Returns the seconds elapsed since a point in time.
+  @param start Point in time.
+*/
+static inline double SecondsSince(const BenchClock::time_point& start) {
+  return std::chrono::duration<double>(BenchClock::now() - start).count();
+}
+
+#endif
@@ -0,0 +1,120 @@
+#include <cstdio>
+#include <atomic>
+#include <boost/thread.hpp>
+#include <boost/bind.hpp>
+#include <boost/foreach.hpp>
+#include <boost/lexical_cast.hpp>
+#include "Common.h"
+#include "SSEConfig.h"
+#include "SSEEvent.h"
+#include "CacheAdapters/Ring.h"
+#include "Bench.h"
+
+#define BENCH_SECONDS 0.5
+#define BENCH_REPLAY_LENGTH 100
+#define BENCH_READERS 3
+
+using namespace std;
+
+int stop = 0;
+
+// Number of events the caches hold.
+static const size_t cacheLengths[] = { 500, 10000, 1000000 };
+
+/**
+  Returns a rendered event with a number as id.
+  Events are created while publishing, at the same cost for every adapter.
+  @param n Event number.
+*/
+static SSEBufferPtr MakeEvent(long n) {
+  const string id = boost::lexical_cast<string>(n);
+  return SSEBufferPtr(new SSEBuffer("id: " + id + "\ndata: " + id + "\n\n", id));
+}
+
+/**
+  Publish events with increasing ids for a while.
+  @param cache Cache to publish to.
+  @param next Number of the next event, shared with the readers.
+  @returns number of events published.
+*/
+static long Publish(CacheInterface* cache, std::atomic<long>* next) {
+  BenchClock::time_point start = BenchClock::now();
+  long n = 0;
+
+  do {
+    SSEEvent event(MakeEvent(*next));
+    cache->CacheEvent(event);
+    (*next)++;
+    n++;
+  } while (n % 64 != 0 || SecondsSince(start) < BENCH_SECONDS);
+
+  return n;
+}
+
+/**
+  Replay the newest BENCH_REPLAY_LENGTH events over and over for a while.
+  Replays finding their first event evicted meanwhile are not counted.
+  @param cache Cache to replay from.
+  @param next Number of the next event to be published.
+  @param total Incremented with the number of replays done.
+*/
+static void Replay(CacheInterface* cache, const std::atomic<long>* next, std::atomic<long>* total) {
+  BenchClock::time_point start = BenchClock::now();
+  long n = 0, replayed = 0;
+
+  do {
+    const string id = boost::lexical_cast<string>(*next - BENCH_REPLAY_LENGTH);
+    if (!cache->GetEventsSinceId(id).empty()) replayed++;
+    n++;
+  } while (n % 16 != 0 || SecondsSince(start) < BENCH_SECONDS);
+
+  *total += replayed;
+}
+
+/**
+  Measure publishing and replaying on their own, and BENCH_READERS
+  readers replaying while events are published.
+  @param name Name of the adapter, for reporting.
+  @param cache Cache to test.
+  @param length Number of events the cache holds.
+*/
+static void Run(const char* name, CacheInterface* cache, size_t length) {
+  std::atomic<long> next(0);
+  std::atomic<long> replays(0);
+  boost::thread_group readers;
+
+  for (; (size_t)next < length; next++) {
+    SSEEvent event(MakeEvent(next));
+    cache->CacheEvent(event);
+  }
+
+  double publishRate = Publish(cache, &next) / BENCH_SECONDS;
+
+  Replay(cache, &next, &replays);
+  double replayRate = replays / BENCH_SECONDS;
+
+  replays = 0;
+  for (int i = 0; i < BENCH_READERS; i++) {
+    readers.create_thread(boost::bind(&Replay, cache, &next, &replays));
+  }
+
+  double mixedPublishRate = Publish(cache, &next) / BENCH_SECONDS;
+  readers.join_all();
+  double mixedReplayRate = replays / BENCH_SECONDS;
+
+  printf("%-8s %7zu events   alone: %7.3f Mevents/s %8.0f replays/s   mixed: %7.3f Mevents/s %8.0f replays/s\n",
+    name, length, publishRate / 1e6, replayRate, mixedPublishRate / 1e6, mixedReplayRate);
+}
+
+int main(int argc, char **argv) {
+  BOOST_FOREACH(size_t length, cacheLengths) {
+    ChannelConfig conf = ChannelConfig();
+    conf.id = "bench";
+    conf.cacheLength = length;
+
+    Ring ring(conf);
+    Run("ring", &ring, length);
+  }
+
+  return 0;
+}
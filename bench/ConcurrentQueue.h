@@ -1,6 +1,12 @@
+#ifndef CONCURRENTQUEUE_H
+#define CONCURRENTQUEUE_H
+
 #include <queue>
 #include <boost/thread.hpp>
 
+/**
+  The queue the client handlers used before MPSCQueue, kept to compare against.
+*/
 template<typename Data>
 class ConcurrentQueue {
   private:
@@ -42,3 +48,5 @@ class ConcurrentQueue {
       _queue.pop();
     }
 };
+
+#endif
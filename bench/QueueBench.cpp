@@ -0,0 +1,96 @@
+#include <cstdio>
+#include <vector>
+#include <poll.h>
+#include <boost/thread.hpp>
+#include <boost/bind.hpp>
+#include "MPSCQueue.h"
+#include "SSEClientHandler.h"
+#include "ConcurrentQueue.h"
+#include "Bench.h"
+
+#define BENCH_MESSAGES 2000000
+
+using namespace std;
+
+/**
+  Push a share of the messages to a queue.
+  @param queue Queue to push to.
+  @param count Number of messages to push.
+*/
+template<typename Queue>
+static void Produce(Queue* queue, long count) {
+  for (long i = 0; i < count; i++) {
+    queue->Push(i);
+  }
+}
+
+/**
+  Drain the old queue one message at a time, like the handlers used to.
+  @param queue Queue to drain.
+  @param count Number of messages to wait for.
+*/
+static void Consume(ConcurrentQueue<long>* queue, long count) {
+  long msg;
+
+  for (long i = 0; i < count; i++) {
+    queue->WaitPop(msg);
+  }
+}
+
+/**
+  Drain the MPSC queue in batches, waiting on the eventfd like the handler
+  loop does when there is nothing to do.
+  @param queue Queue to drain.
+  @param count Number of messages to wait for.
+*/
+static void Consume(MPSCQueue<long>* queue, long count) {
+  vector<long> msgs;
+  struct pollfd pfd = { queue->GetEventFd(), POLLIN, 0 };
+
+  while (count > 0) {
+    msgs.clear();
+    size_t n = queue->PopAll(msgs);
+    count -= n;
+
+    if (n == 0) {
+      if (queue->PrepareWait()) poll(&pfd, 1, -1);
+      queue->FinishWait();
+    }
+  }
+}
+
+/**
+  Push BENCH_MESSAGES messages through a queue from a number of producers
+  to a single consumer.
+  @param name Name of the queue, for reporting.
+  @param queue Queue to test.
+  @param producers Number of producer threads.
+*/
+template<typename Queue>
+static void Run(const char* name, Queue* queue, int producers) {
+  boost::thread_group threads;
+  long count = BENCH_MESSAGES / producers;
+  BenchClock::time_point start = BenchClock::now();
+
+  for (int i = 0; i < producers; i++) {
+    threads.create_thread(boost::bind(&Produce<Queue>, queue, count));
+  }
+
+  Consume(queue, count * producers);
+  threads.join_all();
+
+  double seconds = SecondsSince(start);
+  printf("%-16s %d producers %8.2f Mmsg/s\n", name, producers, count * producers / seconds / 1e6);
+}
+
+int main(int argc, char **argv) {
+  for (int producers = 1; producers <= 64; producers *= 4) {
+    ConcurrentQueue<long> concurrentQueue;
+    MPSCQueue<long> mpscQueue(HANDLER_QUEUE_SIZE);
+
+    Run("ConcurrentQueue", &concurrentQueue, producers);
+    Run("MPSCQueue", &mpscQueue, producers);
+  }
+
+  return 0;
+}
@@ -0,0 +1,140 @@
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <unistd.h>
+#include <boost/foreach.hpp>
+#include <boost/lexical_cast.hpp>
+#include "Common.h"
+#include "SSEConfig.h"
+#include "SSEEvent.h"
+#include "CacheAdapters/Redis.h"
+#include "Bench.h"
+
+#define BENCH_SECONDS 0.5
+#define BENCH_EVENT_SIZE 200
+#define BENCH_REPLAY_LENGTH 50
+
+using namespace std;
+
+int stop = 0;
+
+// Number of events the caches hold.
+static const size_t cacheLengths[] = { 1000, 10000 };
+
+static const char* layouts[] = { "hash", "sorted" };
+
+/**
+  Returns an event with a number as id and BENCH_EVENT_SIZE bytes of data.
+  @param n Event number.
+*/
+static SSEBufferPtr MakeEvent(long n) {
+  const string id = boost::lexical_cast<string>(n);
+  return SSEBufferPtr(new SSEBuffer("id: " + id + "\ndata: " + string(BENCH_EVENT_SIZE, 'x') + "\n\n", id));
+}
+
+/**
+  Load a config using a redis layout, with redis.host and redis.port
+  taken from the environment when set.
+  @param config Config to load.
+  @param layout Redis layout.
+*/
+static bool LoadConfig(SSEConfig& config, const string& layout) {
+  char path[] = "/tmp/ssehub-bench-XXXXXX";
+  int fd = mkstemp(path);
+
+  if (fd == -1) {
+    perror(path);
+    return false;
+  }
+
+  close(fd);
+
+  {
+    ofstream file(path);
+    file << "{ \"redis\": { \"layout\": \"" << layout << "\"";
+    if (getenv("REDIS_HOST")) file << ", \"host\": \"" << getenv("REDIS_HOST") << "\"";
+    if (getenv("REDIS_PORT")) file << ", \"port\": " << getenv("REDIS_PORT");
+    file << " } }";
+  }
+
+  config.load(path);
+  unlink(path);
+
+  return true;
+}
+
+/**
+  Fill a cache, then measure publishing with trimming and replaying the
+  newest BENCH_REPLAY_LENGTH events from their id.
+  @param layout Name of the layout, for reporting.
+  @param conf Channel config, using the layout.
+*/
+static void Run(const char* layout, const ChannelConfig& conf) {
+  Redis cache(conf.id, conf);
+  long next = 0;
+
+  cache.Purge();
+
+  for (; (size_t)next < conf.cacheLength; next++) {
+    SSEEvent event(MakeEvent(next));
+    cache.CacheEvent(event);
+  }
+
+  BenchClock::time_point start = BenchClock::now();
+  long published = 0;
+
+  do {
+    SSEEvent event(MakeEvent(next++));
+    cache.CacheEvent(event);
+    published++;
+  } while (SecondsSince(start) < BENCH_SECONDS);
+
+  double publishRate = published / SecondsSince(start);
+  const string lastId = boost::lexical_cast<string>(next - BENCH_REPLAY_LENGTH);
+  long replays = 0;
+
+  start = BenchClock::now();
+
+  do {
+    // The hash layout replays in hash order, so only the sorted one returns exactly the newest events.
+    if (cache.GetEventsSinceId(lastId).empty()) {
+      fprintf(stderr, "%s: replay since %s returned no events\n", layout, lastId.c_str());
+      exit(1);
+    }
+
+    replays++;
+  } while (SecondsSince(start) < BENCH_SECONDS);
+
+  double replayRate = replays / SecondsSince(start);
+
+  printf("%-8s %6zu events   publish: %8.0f events/s   replay %d: %8.1f replays/s\n",
+    layout, conf.cacheLength, publishRate, BENCH_REPLAY_LENGTH, replayRate);
+
+  cache.Purge();
+}
+
+int main(int argc, char **argv) {
+  FLAGS_minloglevel = 1;
+
+  BOOST_FOREACH(const char* layout, layouts) {
+    SSEConfig config;
+    if (!LoadConfig(config, layout)) return 1;
+
+    RedisValue result;
+    if (!RedisPool::GetInstance(&config)->Command("PING", list<string>(), result) || !result.isOk()) {
+      fprintf(stderr, "No redis server on %s:%s\n",
+        config.GetValue("redis.host").c_str(), config.GetValue("redis.port").c_str());
+      return 1;
+    }
+
+    BOOST_FOREACH(size_t length, cacheLengths) {
+      ChannelConfig conf = config.GetDefaultChannelConfig();
+      conf.id = "bench-" + string(layout);
+      conf.cacheLength = length;
+
+      Run(layout, conf);
+    }
+  }
+
+  return 0;
+}
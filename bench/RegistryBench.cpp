@@ -0,0 +1,131 @@
+#include <cstdio>
+#include <cstdlib>
+#include <atomic>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <boost/thread.hpp>
+#include <boost/bind.hpp>
+#include <boost/function.hpp>
+#include <boost/lexical_cast.hpp>
+#include <boost/foreach.hpp>
+#include "Common.h"
+#include "SSEConfig.h"
+#include "SSEChannel.h"
+#include "SSEChannelRegistry.h"
+#include "SSEClientHandler.h"
+#include "Bench.h"
+
+#define BENCH_SECONDS 0.5
+
+// Number of channels to look up among.
+static const size_t channelCounts[] = { 1, 1000, 100000 };
+
+using namespace std;
+
+int stop = 0;
+
+typedef boost::function<SSEChannelPtr (const string&)> Lookup;
+
+/**
+  Look up a channel by scanning a list, like the server did before the registry.
+  @param list Channels to scan.
+  @param id Channel id.
+*/
+static SSEChannelPtr ScanList(const SSEChannelList* list, const string& id) {
+  for (SSEChannelList::const_iterator it = list->begin(); it != list->end(); it++) {
+    if ((*it)->GetId().compare(id) == 0) return *it;
+  }
+
+  return SSEChannelPtr();
+}
+
+/**
+  Look up random channels until BENCH_SECONDS have passed.
+  @param lookup Lookup to test.
+  @param ids Ids of the channels.
+  @param seed Seed for picking the channel.
+  @param total Incremented with the number of lookups done.
+*/
+static void LookupLoop(const Lookup& lookup, const vector<string>* ids, unsigned int seed, std::atomic<long>* total) {
+  BenchClock::time_point start = BenchClock::now();
+  long n = 0;
+
+  do {
+    for (int i = 0; i < 256; i++, n++) {
+      if (!lookup((*ids)[rand_r(&seed) % ids->size()])) abort();
+    }
+  } while (SecondsSince(start) < BENCH_SECONDS);
+
+  *total += n;
+}
+
+/**
+  Run a number of threads looking up channels.
+  @param name Name of the lookup, for reporting.
+  @param lookup Lookup to test.
+  @param ids Ids of the channels.
+  @param threads Number of lookup threads.
+*/
+static void Run(const char* name, const Lookup& lookup, const vector<string>& ids, int threads) {
+  boost::thread_group group;
+  std::atomic<long> total(0);
+
+  for (int i = 0; i < threads; i++) {
+    group.create_thread(boost::bind(&LookupLoop, boost::cref(lookup), &ids, i + 1, &total));
+  }
+
+  group.join_all();
+
+  printf("%-12s %6zu channels %d threads %8.2f Mlookups/s\n",
+    name, ids.size(), threads, total / BENCH_SECONDS / 1e6);
+}
+
+int main(int argc, char **argv) {
+  char configFile[] = "/tmp/ssehub-bench-XXXXXX";
+  SSEConfig config;
+
+  // Channels are created with the default config, without a cache.
+  int fd = mkstemp(configFile);
+  if (fd == -1 || write(fd, "{}", 2) != 2) {
+    perror(configFile);
+    return 1;
+  }
+
+  close(fd);
+  config.load(configFile);
+  unlink(configFile);
+
+  FLAGS_minloglevel = 1;
+
+  ChannelConfig conf = config.GetDefaultChannelConfig();
+  conf.cacheAdapter = "none";
+
+  int shutdownfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  ClientHandlerList handlers;
+  handlers.push_back(ClientHandlerPtr(new SSEClientHandler(0, &config, shutdownfd)));
+
+  BOOST_FOREACH(size_t channels, channelCounts) {
+    SSEChannelRegistry registry;
+    SSEChannelList list;
+    vector<string> ids;
+
+    for (size_t i = 0; i < channels; i++) {
+      const string id = "channel-" + boost::lexical_cast<string>(i);
+      list.push_back(registry.Create(id, conf, handlers));
+      ids.push_back(id);
+    }
+
+    for (int threads = 1; threads <= 4; threads *= 4) {
+      Run("list scan", boost::bind(&ScanList, &list, _1), ids, threads);
+      Run("registry", boost::bind(&SSEChannelRegistry::Get, &registry, _1), ids, threads);
+    }
+  }
+
+  // Let the handler exit so it can be joined.
+  uint64_t val = 1;
+  if (write(shutdownfd, &val, sizeof(val)) != sizeof(val)) return 1;
+  handlers.clear();
+  close(shutdownfd);
+
+  return 0;
+}
@@ -6,17 +6,113 @@
 #include <map>
 #include <boost/shared_ptr.hpp>
 #include "SSEConfig.h"
+#include "SSEBuffer.h"
+#include "SSEEvent.h"
 
 using namespace std;
 
-class SSEEvent;
+/**
+  Interface for channel event caches.
+  The channel calls CacheEvent from one thread at a time, while the Get
+  functions may run concurrently with it from any thread. Purge is never
+  called concurrently with anything else.
+  Adapters evict the oldest events while more than cacheLength events or,
+  if set, cacheBytes bytes of event data are cached, but always keep the
+  newest event. With cacheMaxAge set, events that arrived more than
+  cacheMaxAge seconds before the newest event are evicted as well.
 
+  Every cached event carries the arrival time of its position in the
+  cache: an update keeps the time of the event it replaces, and a time
+  earlier than that of the newest event is raised to it, so times never
+  decrease and replays by time can binary search them.
+*/
 class CacheInterface {
   public:
+    virtual ~CacheInterface() {};
     virtual void CacheEvent(SSEEvent& event)=0;
-    virtual deque<string> GetEventsSinceId(string lastId)=0;
-    virtual deque<string> GetAllEvents()=0;
+
+    /**
+      Add several events to the cache, in order.
+      Adapters that can store them in one write override this.
+      @param events Rendered events.
+    */
+    virtual void CacheEvents(const SSEBufferList& events) {
+      for (SSEBufferList::const_iterator it = events.begin(); it != events.end(); it++) {
+        SSEEvent event(*it);
+        CacheEvent(event);
+      }
+    }
+
+    virtual SSEBufferList GetEventsSinceId(string lastId)=0;
+    virtual SSEBufferList GetAllEvents()=0;
+
+    /**
+      Get the events that arrived at or after a point in time.
+      @param time Milliseconds since the epoch.
+    */
+    virtual SSEBufferList GetEventsSinceTime(uint64_t time)=0;
     virtual size_t GetSizeOfCachedEvents()=0;
+    virtual size_t GetCachedBytes()=0;
+    virtual void Purge()=0;
+
+    /**
+      Get cached events as file backed buffers, for adapters storing events
+      exactly as they are sent.
+      @param lastId Get events since this id.
+      @param all Get all events, ignoring lastId.
+      @param events Set to the events.
+      @returns false if the adapter can not serve events from files.
+    */
+    virtual bool GetFileEvents(const string& lastId, bool all, SSEBufferList& events) { return false; }
+
+    /**
+      Get the events that arrived at or after a point in time as file backed buffers.
+      @param time Milliseconds since the epoch.
+      @param events Set to the events.
+      @returns false if the adapter can not serve events from files.
+    */
+    virtual bool GetFileEventsSinceTime(uint64_t time, SSEBufferList& events) { return false; }
+
+    /**
+      Get the hit counters of an in-memory tier in front of the cache.
+      @param hits Set to number of reads served from memory.
+      @param misses Set to number of reads that went to the backend.
+      @returns false if the adapter has no such tier.
+    */
+    virtual bool GetTierStats(ulong& hits, ulong& misses) { return false; }
+
+    /**
+      Returns the size of the cached event data held in process memory.
+    */
+    virtual size_t GetMemoryBytes() { return 0; }
+
+    /**
+      Drop the events held in process memory to free it up. Events also
+      kept outside the process stay cached. Never called concurrently with
+      anything else, like Purge.
+    */
+    virtual void ReleaseMemory() {}
+
+    /**
+      Returns the buffer with its arrival time set, copying it if needed.
+      @param buf Rendered event.
+      @param time Milliseconds since the epoch.
+    */
+    static SSEBufferPtr WithTime(const SSEBufferPtr& buf, uint64_t time) {
+      if (buf->GetTime() == time) return buf;
+      if (buf->IsFile()) return SSEBufferPtr(new SSEBuffer(buf->GetFd(), buf->GetOffset(), buf->GetLength(), buf, buf->GetId(), time));
+      return SSEBufferPtr(new SSEBuffer(buf->GetData(), buf->GetId(), time));
+    }
+
+    /**
+      Returns true if an event is past cacheMaxAge.
+      @param time Arrival time of the event.
+      @param now Arrival time of the newest event.
+      @param maxAge cacheMaxAge in seconds, 0 for no limit.
+    */
+    static bool IsExpired(uint64_t time, uint64_t now, size_t maxAge) {
+      return maxAge > 0 && time + (uint64_t)maxAge * 1000 < now;
+    }
     ChannelConfig _config;
 };
 #endif
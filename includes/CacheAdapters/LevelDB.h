@@ -1,6 +1,7 @@
 #ifndef LevelDB_H
 #define LevelDB_H
 
+#include <atomic>
 #include "leveldb/c.h"
 #include "CacheInterface.h"
 
@@ -10,15 +11,33 @@ class LevelDB : public CacheInterface {
     ~LevelDB();
     void InitDB(const string& dbfile); 
     void CacheEvent(SSEEvent& event);
-    deque<string> GetEventsSinceId(string lastId);
-    deque<string> GetAllEvents();
+    SSEBufferList GetEventsSinceId(string lastId);
+    SSEBufferList GetAllEvents();
+    SSEBufferList GetEventsSinceTime(uint64_t time);
     size_t GetSizeOfCachedEvents();
+    size_t GetCachedBytes();
+    void Purge();
     const ChannelConfig& _config;
 
   private:
+    string _dbfile;
     leveldb_t* _db;
     leveldb_options_t* _options; 
     leveldb_writeoptions_t* _woptions;
     leveldb_readoptions_t* _roptions;
+    std::atomic<uint64_t> _first_seq;
+    std::atomic<uint64_t> _next_seq;
+    std::atomic<size_t> _bytes;
+    uint64_t _last_time;
+
+    void Open();
+    void CheckFormat();
+    void MigrateIdKeys();
+    void AddEventTimes();
+    void LoadSequence();
+    void Evict(leveldb_writebatch_t* batch, uint64_t seq, const string& id);
+    bool ReadEvent(const leveldb_readoptions_t* readopts, uint64_t seq, string& id, size_t& length, uint64_t& time);
+    bool LookupSeq(const leveldb_readoptions_t* readopts, const string& id, uint64_t& seq);
+    SSEBufferList ReadEvents(const leveldb_readoptions_t* readopts, uint64_t seq);
 };
 #endif
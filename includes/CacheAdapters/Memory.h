@@ -1,19 +1,15 @@
 #ifndef MEMORY_H
 #define MEMORY_H
 
-#include "CacheInterface.h"
+#include "Ring.h"
 
-class Memory : public CacheInterface {
+/**
+  In-memory cache adapter, kept as a name for the ring adapter so
+  channels configured with the memory adapter get its constant time
+  lookups and replays that do not block the publisher.
+*/
+class Memory : public Ring {
   public:
-    Memory(const ChannelConfig& config);
-    void CacheEvent(SSEEvent& event);
-    deque<string> GetEventsSinceId(string lastId);
-    deque<string> GetAllEvents();
-    size_t GetSizeOfCachedEvents();
-    const ChannelConfig& _config;
-
-  private:
-    deque<string> _cache_keys;
-    map<string, string> _cache_data;
+    Memory(const ChannelConfig& config) : Ring(config) {}
 };
 #endif
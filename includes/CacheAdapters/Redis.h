@@ -1,8 +1,10 @@
 #ifndef REDIS_H
 #define REDIS_H
 
+#include <atomic>
 #include "CacheInterface.h"
-#include <redisclient/redissyncclient.h>
+#include "RedisPool.h"
+#include "RedisWriter.h"
 
 using namespace std;
 
@@ -11,17 +13,28 @@ class Redis : public CacheInterface {
   public:
     Redis(const string key, const ChannelConfig& config);
     void CacheEvent(SSEEvent& event);
-    deque<string> GetEventsSinceId(string lastId);
-    deque<string> GetAllEvents();
+    void CacheEvents(const SSEBufferList& events);
+    SSEBufferList GetEventsSinceId(string lastId);
+    SSEBufferList GetAllEvents();
+    SSEBufferList GetEventsSinceTime(uint64_t time);
     size_t GetSizeOfCachedEvents();
+    size_t GetCachedBytes();
+    void Purge();
+    static RedisWriteStatus Write(RedisPool* pool, const vector<RedisWrite>& batch, vector<long>& lens, vector<long>& bytes);
+    static bool IsSortedLayout(SSEConfig* config);
     const ChannelConfig& _config;
 
   private:
+    RedisWrite MakeWrite(const SSEBufferPtr& buf);
     void Expire(int ttl);
-    bool InitClient(RedisSyncClient& client);
-    string Lookup(string hostname);
+    SSEBufferList ReadEvents(const string& since, uint64_t time);
+    SSEBufferList FetchEvents(const string& since, uint64_t time);
+    RedisPool* _pool;
+    RedisWriter* _writer;
+    bool _sorted;
+    RedisWriteWindowPtr _window;
     string _key;
-    string _host;
-    unsigned short _port;
+    std::atomic<long> _size;
+    std::atomic<long> _bytes;
 };
 #endif
@@ -0,0 +1,48 @@
+#ifndef REDISPOOL_H
+#define REDISPOOL_H
+
+#include <string>
+#include <list>
+#include <mutex>
+#include <boost/shared_ptr.hpp>
+#include <boost/asio/io_service.hpp>
+#include <redisclient/redissyncclient.h>
+
+using namespace std;
+
+class SSEConfig;
+
+/**
+  A connection to redis with its own io_service.
+*/
+struct RedisConnection {
+  RedisConnection() : client(ioService) {}
+  boost::asio::io_service ioService;
+  RedisSyncClient client;
+};
+
+typedef boost::shared_ptr<RedisConnection> RedisConnectionPtr;
+
+/**
+  Pool of persistent redis connections shared by all channels.
+  Connections are created on demand and dropped on errors, so the pool
+  reconnects on the next request after redis goes away.
+*/
+class RedisPool {
+  public:
+    static RedisPool* GetInstance(SSEConfig* config);
+    bool Command(const string& cmd, const list<string>& args, RedisValue& result);
+
+  private:
+    RedisPool(SSEConfig* config);
+    RedisConnectionPtr Acquire();
+    void Release(const RedisConnectionPtr& conn);
+    string Lookup(const string& hostname);
+
+    string _host;
+    unsigned short _port;
+    size_t _max_idle;
+    list<RedisConnectionPtr> _idle;
+    std::mutex _lock;
+};
+#endif
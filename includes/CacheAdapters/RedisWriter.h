@@ -0,0 +1,71 @@
+#ifndef REDISWRITER_H
+#define REDISWRITER_H
+
+#include <string>
+#include <vector>
+#include <mutex>
+#include <boost/shared_ptr.hpp>
+#include "SSEBuffer.h"
+#include "WriteBehind.h"
+
+using namespace std;
+
+class SSEConfig;
+class RedisPool;
+
+/**
+  Events of a channel that are queued for redis but not written yet.
+  Shared by the adapter, which serves replays from it, and the writer.
+*/
+struct RedisWriteWindow {
+  std::mutex lock;
+  SSEBufferList events;
+  size_t size;
+  size_t bytes;
+};
+
+typedef boost::shared_ptr<RedisWriteWindow> RedisWriteWindowPtr;
+
+/**
+  Outcome of a write to redis.
+  Writes that failed because redis could not be reached can be retried,
+  writes redis replied to with an error can not.
+*/
+enum RedisWriteStatus {
+  REDIS_WRITE_OK,
+  REDIS_WRITE_RETRY,
+  REDIS_WRITE_FAILED
+};
+
+/**
+  A queued write. A NULL buffer deletes the key.
+*/
+struct RedisWrite {
+  string key;
+  SSEBufferPtr buf;
+  size_t cacheLength;
+  size_t cacheBytes;
+  size_t cacheMaxAge;
+  RedisWriteWindowPtr window;
+};
+
+/**
+  Writes cached events to redis in the background for all channels.
+  Publishers only wait when the queue is full, for at most
+  REDIS_PUSH_TIMEOUT seconds, and queued events are written in batches
+  of up to REDIS_WRITE_BATCH with one round trip.
+*/
+class RedisWriter : public WriteBehind<RedisWrite> {
+  public:
+    static RedisWriter* GetInstance(SSEConfig* config);
+    bool Push(const RedisWrite& write);
+
+  private:
+    RedisWriter(SSEConfig* config);
+    void Write(const vector<RedisWrite>& batch);
+    void Send(const vector<RedisWrite>& batch);
+    RedisWriteStatus Flush(const vector<RedisWrite>& batch);
+
+    RedisPool* _pool;
+};
+#endif
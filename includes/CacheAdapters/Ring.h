@@ -0,0 +1,59 @@
+#ifndef RING_H
+#define RING_H
+
+#include <vector>
+#include <mutex>
+#include <atomic>
+#include "CacheInterface.h"
+
+/**
+  An event in the ring and its sequence number.
+  Slots are replaced, never modified, so readers can hold on to them.
+*/
+struct RingEntry {
+  RingEntry(uint64_t seq, const SSEBufferPtr& buf) : seq(seq), buf(buf) {}
+  const uint64_t seq;
+  const SSEBufferPtr buf;
+};
+
+typedef boost::shared_ptr<const RingEntry> RingEntryPtr;
+
+/**
+  In-memory cache adapter keeping the events in a fixed capacity ring
+  with an open addressing hash index from event id to sequence number.
+  Inserts, evictions and lookups are O(1), and readers only hold the index
+  lock for the lookup so a replay never blocks the publisher.
+  The cached events are the sequence numbers from head to tail, the head
+  is moved past the ring capacity and past the oldest events beyond cacheBytes
+  or cacheMaxAge.
+*/
+class Ring : public CacheInterface {
+  public:
+    Ring(const ChannelConfig& config);
+    void CacheEvent(SSEEvent& event);
+    SSEBufferList GetEventsSinceId(string lastId);
+    SSEBufferList GetAllEvents();
+    SSEBufferList GetEventsSinceTime(uint64_t time);
+    size_t GetSizeOfCachedEvents();
+    size_t GetCachedBytes();
+    void Purge();
+    size_t GetMemoryBytes();
+    void ReleaseMemory();
+    const ChannelConfig& _config;
+
+  private:
+    vector<RingEntryPtr> _ring;
+    vector<uint64_t> _index;
+    std::mutex _index_lock;
+    std::atomic<uint64_t> _head;
+    std::atomic<uint64_t> _tail;
+    std::atomic<size_t> _bytes;
+
+    SSEBufferList GetEventsFrom(uint64_t seq, bool restart);
+    RingEntryPtr GetEntry(uint64_t seq);
+    uint64_t GetNewestTime();
+    size_t FindBucket(const string& id);
+    void EraseIndex(const string& id);
+    void Evict();
+};
+#endif
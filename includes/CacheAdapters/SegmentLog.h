@@ -0,0 +1,107 @@
+#ifndef SEGMENTLOG_H
+#define SEGMENTLOG_H
+
+#include <vector>
+#include <deque>
+#include <atomic>
+#include <boost/unordered_map.hpp>
+#include <boost/thread/shared_mutex.hpp>
+#include "CacheInterface.h"
+
+#define SEGMENT_SPLIT 4
+
+struct SegmentEvent {
+  uint64_t offset;
+  uint32_t length;
+  string id;
+  uint64_t time;
+};
+
+/**
+  A segment file holding rendered frames back to back, exactly as they
+  are sent to clients. The file is mapped read-only and appended to with
+  write(), and a sealed segment gets an index file next to it so it does
+  not have to be scanned on restart. The arrival times of the events are
+  appended to a time file next to the segment.
+  Only the segment being appended to keeps the segment open for writing
+  and its time file open, and is mapped beyond its size. Sealed segments
+  keep a read-only descriptor and a mapping of their frames for replays.
+*/
+class LogSegment {
+  public:
+    LogSegment(const string& path, uint64_t firstSeq);
+    ~LogSegment();
+    bool Open(size_t capacity, bool writable);
+    bool Append(const SSEBufferPtr& buf, uint64_t time);
+    bool Recover();
+    bool LoadIndex();
+    void LoadTimes();
+    void Seal();
+    void Remove();
+    const char* GetPtr() const { return _map; }
+    int GetFd() const { return _fd; }
+    uint64_t GetFirstSeq() const { return _first_seq; }
+    uint64_t GetSize() const { return _size; }
+    size_t GetCapacity() const { return _capacity; }
+
+    vector<SegmentEvent> events;
+
+  private:
+    string _path;
+    int _fd;
+    int _write_fd;
+    int _time_fd;
+    char* _map;
+    size_t _mapped;
+    size_t _capacity;
+    uint64_t _size;
+    uint64_t _first_seq;
+
+    bool Truncate(uint64_t size);
+};
+
+typedef boost::shared_ptr<LogSegment> LogSegmentPtr;
+
+/**
+  Cache adapter storing events in per channel append-only segment files.
+  The oldest segment is deleted once all its events are evicted.
+  Replays are sent straight from the segment files.
+*/
+class SegmentLog : public CacheInterface {
+  public:
+    SegmentLog(const ChannelConfig& config);
+    void CacheEvent(SSEEvent& event);
+    SSEBufferList GetEventsSinceId(string lastId);
+    SSEBufferList GetAllEvents();
+    SSEBufferList GetEventsSinceTime(uint64_t time);
+    size_t GetSizeOfCachedEvents();
+    size_t GetCachedBytes();
+    void Purge();
+    bool GetFileEvents(const string& lastId, bool all, SSEBufferList& events);
+    bool GetFileEventsSinceTime(uint64_t time, SSEBufferList& events);
+    const ChannelConfig& _config;
+
+  private:
+    string _dir;
+    size_t _segment_size;
+    size_t _segment_events;
+    deque<LogSegmentPtr> _segments;
+    boost::unordered_map<string, uint64_t> _index;
+    uint64_t _first_seq;
+    std::atomic<uint64_t> _next_seq;
+    size_t _size;
+    std::atomic<size_t> _bytes;
+    uint64_t _last_time;
+    boost::shared_mutex _lock;
+
+    void Recover();
+    bool Rotate(size_t length);
+    void Evict();
+    void Trim();
+    const SegmentEvent* GetEvent(uint64_t seq);
+    bool IsCurrent(const SegmentEvent& event, uint64_t seq);
+    uint64_t FindTime(uint64_t time);
+    SSEBufferList ReadEvents(const string* lastId, uint64_t time, bool file);
+    string GetSegmentPath(uint64_t firstSeq);
+};
+#endif
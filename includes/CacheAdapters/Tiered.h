@@ -0,0 +1,83 @@
+#ifndef TIERED_H
+#define TIERED_H
+
+#include <deque>
+#include <atomic>
+#include <boost/unordered_map.hpp>
+#include <boost/function.hpp>
+#include <boost/thread/shared_mutex.hpp>
+#include "CacheInterface.h"
+#include "TieredWriter.h"
+
+/**
+  An event in the hot window and the number of its last write to the backend.
+*/
+struct TieredEntry {
+  TieredEntry(const SSEBufferPtr& buf, uint64_t write) : buf(buf), write(write) {}
+  SSEBufferPtr buf;
+  uint64_t write;
+};
+
+/**
+  Data length and arrival time of an event only kept in the backend.
+*/
+struct TieredCold {
+  size_t length;
+  uint64_t time;
+};
+
+/**
+  Cache adapter keeping the newest events in memory in front of a
+  persistent backend. Events are written through to the backend in the
+  background, and replays not covered by the hot window read the backend.
+  Events are kept in the hot window until they are written to the backend,
+  and only the ids, lengths and arrival times of the older events are kept
+  in memory.
+*/
+class Tiered : public CacheInterface {
+  public:
+    Tiered(const ChannelConfig& config, CacheInterface* backend);
+    ~Tiered();
+    void CacheEvent(SSEEvent& event);
+    SSEBufferList GetEventsSinceId(string lastId);
+    SSEBufferList GetAllEvents();
+    SSEBufferList GetEventsSinceTime(uint64_t time);
+    size_t GetSizeOfCachedEvents();
+    size_t GetCachedBytes();
+    void Purge();
+    bool GetTierStats(ulong& hits, ulong& misses);
+    size_t GetMemoryBytes();
+    void ReleaseMemory();
+    const ChannelConfig& _config;
+
+  private:
+    TieredBackendPtr _backend;
+    TieredWriter* _writer;
+    size_t _hot_length;
+    size_t _hot_max_bytes;
+    deque<TieredEntry> _hot;
+    boost::unordered_map<string, uint64_t> _index;
+    std::atomic<uint64_t> _first_seq;
+    size_t _hot_bytes;
+    deque<string> _cold;
+    boost::unordered_map<string, TieredCold> _cold_ids;
+    size_t _cold_bytes;
+    boost::unordered_map<string, TieredEntry> _cold_updates;
+    deque<pair<string, uint64_t> > _cold_update_order;
+    uint64_t _writes;
+    std::atomic<uint64_t> _dropped;
+    boost::shared_mutex _lock;
+    std::atomic<ulong> _hits;
+    std::atomic<ulong> _misses;
+
+    void Load();
+    void Add(const SSEBufferPtr& buf, uint64_t write);
+    void Evict();
+    void Cool(size_t length, size_t bytes);
+    void PopHot();
+    uint64_t GetNewestTime();
+    uint64_t GetOldestTime();
+    SSEBufferList ReadBackend(const boost::function<SSEBufferList ()>& read, bool since);
+    SSEBufferList Merge(const SSEBufferList& cold, bool since);
+};
+#endif
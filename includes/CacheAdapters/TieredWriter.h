@@ -0,0 +1,57 @@
+#ifndef TIEREDWRITER_H
+#define TIEREDWRITER_H
+
+#include <vector>
+#include <mutex>
+#include <atomic>
+#include <boost/shared_ptr.hpp>
+#include "CacheInterface.h"
+#include "WriteBehind.h"
+
+using namespace std;
+
+class SSEConfig;
+
+/**
+  Backend of a tiered cache. Shared by the adapter and the writer.
+  Writes are numbered, and written is the number of the last one applied.
+  The adapter is deleted, and set to NULL, when the tiered cache is.
+*/
+struct TieredBackend {
+  TieredBackend(CacheInterface* adapter) : adapter(adapter), generation(0), written(0) {}
+  ~TieredBackend() { delete adapter; }
+
+  CacheInterface* adapter;
+  std::mutex lock;
+  uint64_t generation;
+  std::atomic<uint64_t> written;
+};
+
+typedef boost::shared_ptr<TieredBackend> TieredBackendPtr;
+
+/**
+  A queued write. Writes queued before the backend was purged or released are skipped.
+*/
+struct TieredWrite {
+  TieredBackendPtr backend;
+  SSEBufferPtr buf;
+  uint64_t generation;
+  uint64_t number;
+};
+
+/**
+  Writes events of tiered caches to their backends in the background.
+  Publishers only wait when tiered.writeQueueSize writes are queued.
+  Queued writes are taken TIERED_WRITE_BATCH at a time, and the events
+  of each backend are passed to it together.
+*/
+class TieredWriter : public WriteBehind<TieredWrite> {
+  public:
+    static TieredWriter* GetInstance(SSEConfig* config);
+    void Push(const TieredWrite& write);
+
+  private:
+    TieredWriter(SSEConfig* config);
+    void Write(const vector<TieredWrite>& batch);
+};
+#endif
@@ -0,0 +1,109 @@
+#ifndef WRITEBEHIND_H
+#define WRITEBEHIND_H
+
+#include <deque>
+#include <vector>
+#include <mutex>
+#include <chrono>
+#include <condition_variable>
+#include <boost/thread.hpp>
+
+using namespace std;
+
+/**
+  Bounded queue of writes applied in batches by a background thread.
+  Publishers only wait when the queue is full. The writer takes up to
+  maxBatch queued writes at a time and passes them to Write, the writes
+  stay queued, and count against the limit, until Write returns.
+  Derived classes call Start once they are constructed.
+*/
+template<typename Item>
+class WriteBehind {
+  public:
+    virtual ~WriteBehind() {}
+
+  protected:
+    /**
+      Constructor.
+      @param maxQueued Number of writes queued before publishers wait.
+      @param maxBatch Number of writes passed to Write at a time.
+    */
+    WriteBehind(size_t maxQueued, size_t maxBatch) : _max_queued(maxQueued), _max_batch(maxBatch) {}
+
+    /**
+      Start the writer thread.
+    */
+    void Start() {
+      _writerthread = boost::thread(&WriteBehind::Run, this);
+    }
+
+    /**
+      Queue a write, waiting for room if the queue is full.
+      @param item Write to queue.
+      @param timeout Seconds to wait for room, 0 to wait as long as it takes.
+      @returns false if the queue stayed full for timeout seconds and the write was not queued.
+    */
+    bool Enqueue(const Item& item, int timeout) {
+      std::unique_lock<std::mutex> lock(_lock);
+      std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now() + std::chrono::seconds(timeout);
+
+      while (_queue.size() >= _max_queued) {
+        if (timeout == 0) {
+          _space_cond.wait(lock);
+        } else if (_space_cond.wait_until(lock, deadline) == std::cv_status::timeout && _queue.size() >= _max_queued) {
+          return false;
+        }
+      }
+
+      _queue.push_back(item);
+      _queue_cond.notify_one();
+      return true;
+    }
+
+    /**
+      Apply a batch of writes, in the order they were queued.
+      Called from the writer thread only.
+      @param batch Writes to apply.
+    */
+    virtual void Write(const vector<Item>& batch)=0;
+
+  private:
+    size_t _max_queued;
+    size_t _max_batch;
+    deque<Item> _queue;
+    std::mutex _lock;
+    std::condition_variable _queue_cond;
+    std::condition_variable _space_cond;
+    boost::thread _writerthread;
+
+    /**
+      Writer thread, applies the queued writes in batches.
+    */
+    void Run() {
+      vector<Item> batch;
+
+      for (;;) {
+        {
+          std::unique_lock<std::mutex> lock(_lock);
+
+          while (_queue.empty()) {
+            _queue_cond.wait(lock);
+          }
+
+          batch.assign(_queue.begin(), _queue.begin() + std::min<size_t>(_queue.size(), _max_batch));
+        }
+
+        Write(batch);
+
+        {
+          std::lock_guard<std::mutex> lock(_lock);
+          _queue.erase(_queue.begin(), _queue.begin() + batch.size());
+          _space_cond.notify_all();
+        }
+
+        // Release the buffers, they may be the last references.
+        batch.clear();
+      }
+    }
+};
+#endif
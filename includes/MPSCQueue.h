@@ -0,0 +1,174 @@
+#ifndef MPSCQUEUE_H
+#define MPSCQUEUE_H
+
+#include <vector>
+#include <atomic>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <boost/thread.hpp>
+
+/**
+  Bounded lock-free multi-producer single-consumer queue.
+  Producers claim slots in a ring using per-slot sequence numbers, the
+  consumer drains everything pending in one go. A consumer with nothing
+  to do waits on an eventfd, e.g. through epoll, which producers only
+  signal when the consumer is actually waiting.
+*/
+template<typename Data>
+class MPSCQueue {
+  private:
+    struct Cell {
+      std::atomic<size_t> seq;
+      Data data;
+    };
+
+    Cell* _buffer;
+    size_t _mask;
+    std::atomic<size_t> _enqueue_pos;
+    size_t _dequeue_pos;
+    std::atomic<bool> _sleeping;
+    int _efd;
+
+    void Wakeup() {
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+
+      if (_sleeping.load(std::memory_order_relaxed) && _sleeping.exchange(false)) {
+        uint64_t val = 1;
+        ssize_t ret = write(_efd, &val, sizeof(val));
+        (void)ret;
+      }
+    }
+
+  public:
+    /**
+      Constructor.
+      @param capacity Number of slots, rounded up to a power of two.
+    */
+    MPSCQueue(size_t capacity) {
+      size_t size = 2;
+      while (size < capacity) size <<= 1;
+
+      _buffer = new Cell[size];
+      _mask = size - 1;
+
+      for (size_t i = 0; i < size; i++) {
+        _buffer[i].seq.store(i, std::memory_order_relaxed);
+      }
+
+      _enqueue_pos.store(0, std::memory_order_relaxed);
+      _dequeue_pos = 0;
+      _sleeping.store(false);
+      _efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    }
+
+    ~MPSCQueue() {
+      close(_efd);
+      delete[] _buffer;
+    }
+
+    /**
+      Push a element if there is room for it.
+      @returns false if the queue is full.
+    */
+    bool TryPush(Data const& data) {
+      Cell* cell;
+      size_t pos = _enqueue_pos.load(std::memory_order_relaxed);
+
+      for (;;) {
+        cell = &_buffer[pos & _mask];
+        size_t seq = cell->seq.load(std::memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+
+        if (diff == 0) {
+          if (_enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+        } else if (diff < 0) {
+          return false;
+        } else {
+          pos = _enqueue_pos.load(std::memory_order_relaxed);
+        }
+      }
+
+      cell->data = data;
+      cell->seq.store(pos + 1, std::memory_order_release);
+
+      Wakeup();
+      return true;
+    }
+
+    /**
+      Push a element, yielding while the queue is full.
+    */
+    void Push(Data const& data) {
+      while (!TryPush(data)) {
+        boost::this_thread::yield();
+      }
+    }
+
+    /**
+      Pop all available elements. Must only be called by the consumer.
+      @param out Vector to append the elements to.
+      @returns number of elements popped.
+    */
+    size_t PopAll(std::vector<Data>& out) {
+      size_t n = 0;
+
+      for (;;) {
+        Cell* cell = &_buffer[_dequeue_pos & _mask];
+        size_t seq = cell->seq.load(std::memory_order_acquire);
+
+        if (seq != _dequeue_pos + 1) break;
+
+        out.push_back(cell->data);
+        cell->data = Data();
+        cell->seq.store(_dequeue_pos + _mask + 1, std::memory_order_release);
+        _dequeue_pos++;
+        n++;
+      }
+
+      return n;
+    }
+
+    /**
+      Announce that the consumer is about to wait on the eventfd.
+      Must only be called by the consumer.
+      @returns false if elements became available and the consumer should not wait.
+    */
+    bool PrepareWait() {
+      _sleeping.store(true);
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+
+      if (!Empty()) {
+        _sleeping.store(false);
+        return false;
+      }
+
+      return true;
+    }
+
+    /**
+      Called by the consumer when it is done waiting.
+    */
+    void FinishWait() {
+      uint64_t val;
+      _sleeping.store(false);
+      ssize_t ret = read(_efd, &val, sizeof(val));
+      (void)ret;
+    }
+
+    /**
+      Returns true if there is no element ready for the consumer.
+    */
+    bool Empty() const {
+      return _buffer[_dequeue_pos & _mask].seq.load(std::memory_order_acquire) != _dequeue_pos + 1;
+    }
+
+    /**
+      Returns the eventfd signalled when a waiting consumer should wake up.
+    */
+    int GetEventFd() const {
+      return _efd;
+    }
+};
+
+#endif
@@ -0,0 +1,65 @@
+#ifndef SSEBUFFER_H
+#define SSEBUFFER_H
+
+#include <string>
+#include <deque>
+#include <vector>
+#include <set>
+#include <stdint.h>
+#include <sys/types.h>
+#include <boost/shared_ptr.hpp>
+
+using namespace std;
+
+/**
+  Immutable, reference counted buffer holding a rendered SSE frame.
+  A frame is rendered once and the same buffer is shared by the channel,
+  the client handler queues, the client write path and the cache.
+
+  A buffer can also refer to a range of a cache file instead of holding
+  the frame, it is then sent with sendfile() and keeps the file open.
+
+  The time is when the event arrived, in milliseconds since the epoch.
+*/
+class SSEBuffer {
+  public:
+    SSEBuffer(const string& data, const string& id="", uint64_t time=0) :
+      _data(data), _id(id), _fd(-1), _offset(0), _length(data.length()), _time(time) {}
+    SSEBuffer(int fd, off_t offset, size_t length, const boost::shared_ptr<const void>& file, const string& id="", uint64_t time=0) :
+      _id(id), _fd(fd), _offset(offset), _length(length), _time(time), _file(file) {}
+    const string& GetData() const { return _data; }
+    const string& GetId() const { return _id; }
+    const char* GetPtr() const { return _data.data(); }
+    size_t GetLength() const { return _length; }
+    bool IsFile() const { return _fd != -1; }
+    int GetFd() const { return _fd; }
+    off_t GetOffset() const { return _offset; }
+    uint64_t GetTime() const { return _time; }
+
+  private:
+    const string _data;
+    const string _id;
+    const int _fd;
+    const off_t _offset;
+    const size_t _length;
+    const uint64_t _time;
+    const boost::shared_ptr<const void> _file;
+};
+
+typedef boost::shared_ptr<const SSEBuffer> SSEBufferPtr;
+typedef deque<SSEBufferPtr> SSEBufferList;
+
+/**
+  Cached events rendered for replay, concatenated into a few large chunks.
+  Shared by all clients replaying from the same point, until the next
+  event is cached or, with cacheMaxAge, the oldest event expires.
+*/
+struct SSEReplayBlob {
+  vector<SSEBufferPtr> chunks;
+  set<string> ids;
+  uint64_t expires;
+};
+
+typedef boost::shared_ptr<const SSEReplayBlob> SSEReplayBlobPtr;
+
+#endif
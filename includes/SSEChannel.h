@@ -4,8 +4,11 @@
 #include <vector>
 #include <deque>
 #include <map>
+#include <tuple>
 #include <string>
 #include <mutex>
+#include <future>
+#include <atomic>
 #include <glog/logging.h>
 #include <amqp_tcp_socket.h>
 #include <amqp.h>
@@ -13,11 +16,21 @@
 #include <pthread.h>
 #include <boost/shared_ptr.hpp>
 #include <boost/thread.hpp>
+#include <boost/enable_shared_from_this.hpp>
 #include "Common.h"
 #include "SSEConfig.h"
+#include "SSEBuffer.h"
+#include "SSEClientHandler.h"
+#include "SSEChannelRegistry.h"
 #include "CacheAdapters/Memory.h"
+#include "CacheAdapters/Ring.h"
 #include "CacheAdapters/Redis.h"
 #include "CacheAdapters/LevelDB.h"
+#include "CacheAdapters/SegmentLog.h"
+#include "CacheAdapters/Tiered.h"
+
+#define REPLAY_CHUNK_SIZE 32768
+#define REPLAY_CACHE_SIZE 64
 
 using namespace std;
 
@@ -28,55 +41,88 @@ class SSEClientHandler;
 class HTTPRequest;
 class HTTPResponse;
 
-typedef boost::shared_ptr<SSEClientHandler> ClientHandlerPtr;
-typedef vector<ClientHandlerPtr> ClientHandlerList;
-
 struct SSEChannelStats {
   ulong num_clients;
   uint  num_cached_events;
-  ulong num_broadcasted_events;
-  ulong num_errors;
-  ulong num_connects;
-  ulong num_disconnects;
+  std::atomic<ulong> num_broadcasted_events;
+  std::atomic<ulong> num_errors;
+  std::atomic<ulong> num_connects;
+  std::atomic<ulong> num_disconnects;
   uint  cache_size;
+  std::atomic<ulong> cache_bytes;
+  std::atomic<ulong> cache_memory_bytes;
+  ulong backlog_bytes;
+  ulong max_client_backlog_bytes;
+  std::atomic<ulong> num_backlog_evictions;
+  std::atomic<ulong> num_backlog_dropped_events;
+  std::atomic<ulong> num_replay_cache_hits;
+  std::atomic<ulong> num_replay_cache_misses;
+  ulong num_hot_cache_hits;
+  ulong num_hot_cache_misses;
 };
 
-class SSEChannel {
+typedef std::tuple<ReplayMode, string, uint64_t> SSEReplayKey;
+
+/**
+  A replay being read and rendered, clients asking for the same
+  events meanwhile wait for the result.
+*/
+struct SSEReplayFetch {
+  std::promise<SSEReplayBlobPtr> promise;
+  std::shared_future<SSEReplayBlobPtr> result;
+};
+
+typedef boost::shared_ptr<SSEReplayFetch> SSEReplayFetchPtr;
+
+class SSEChannel : public boost::enable_shared_from_this<SSEChannel> {
   public:
-    SSEChannel(ChannelConfig conf, string id);
+    SSEChannel(ChannelConfig conf, string id, const ClientHandlerList& handlers);
     ~SSEChannel();
     string GetId();
-    void Broadcast(const string& data);
-    void BroadcastEvent(SSEEvent& event);
+    void Broadcast(const SSEBufferPtr& data);
+    bool BroadcastEvent(SSEEvent& event);
     void CacheEvent(SSEEvent& event);
-    void SendEventsSince(SSEClient* client, string lastId);
-    void SendCache(SSEClient* client);
+    SSEReplayBlobPtr GetReplay(ReplayMode mode, const string& lastId, uint64_t since);
     const SSEChannelStats& GetStats();
-    void AddClient(SSEClient* client, HTTPRequest* req);
+    bool AddClient(SSEClient* client, HTTPRequest* req);
     ulong GetNumClients();
+    void ClientRemoved(int handlerId, SSEClient* client);
+    void CountDisconnect(bool error);
     const ChannelConfig& GetConfig();
+    bool CloseIfIdle(int timeout);
+    void PurgeCache();
+    void ReleaseCacheMemory();
+    ulong GetCacheMemoryBytes();
+    time_t GetLastActivity();
 
   private:
-    int _efd;
-    ClientHandlerList::iterator curthread;
+    const ClientHandlerList& _handlers;
+    std::atomic<size_t> _next_handler;
+    boost::shared_ptr<std::atomic<long>[]> _handler_clients;
+    std::atomic<long> _num_clients;
+    std::atomic<time_t> _last_activity;
+    boost::shared_mutex _state_lock;
+    bool _closed;
     ChannelConfig _config;
     SSEChannelStats _stats;
-    boost::thread _cleanupthread;
-    boost::thread _pingthread;
-    ClientHandlerList _clientpool;
     CacheInterface* _cache_adapter;
     std::mutex      _broadcast_mtx;
+    boost::shared_mutex _cache_lock;
+    std::mutex _cache_write_lock;
+    std::atomic<ulong> _cache_generation;
+    std::mutex _replay_cache_lock;
+    ulong _replay_cache_generation;
+    map<SSEReplayKey, SSEReplayBlobPtr> _replay_cache;
+    map<SSEReplayKey, SSEReplayFetchPtr> _replay_fetches;
     bool _allow_all_origins;
     char _evs_preamble_data[2052];
 
     void InitializeCache();
-    void InitializeThreads();
-    void CleanupMain();
-    void CleanupThreads();
-    void Ping();
+    CacheInterface* CreateCacheAdapter(const string& adapter);
     void SetCorsHeaders(HTTPRequest* req, HTTPResponse& res);
+    void FinishFetch(const SSEReplayKey& key, const SSEReplayFetchPtr& fetch);
+    SSEReplayBlobPtr ReadReplay(ReplayMode mode, const string& lastId, uint64_t since, uint64_t now, ulong& generation);
+    static SSEReplayBlobPtr RenderReplay(const SSEBufferList& events, uint64_t expires);
 };
 
-typedef boost::shared_ptr<SSEChannel> SSEChannelPtr;
-
 #endif
@@ -0,0 +1,48 @@
+#ifndef SSECHANNELREGISTRY_H
+#define SSECHANNELREGISTRY_H
+
+#include <string>
+#include <vector>
+#include <mutex>
+#include <unordered_map>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/shared_mutex.hpp>
+#include "SSEConfig.h"
+#include "SSEClientHandler.h"
+
+#define CHANNEL_REGISTRY_SHARDS 64
+
+using namespace std;
+
+typedef std::vector<SSEChannelPtr> SSEChannelList;
+typedef std::unordered_map<string, SSEChannelPtr> SSEChannelMap;
+
+/**
+  Hash indexed registry of channels.
+  Channels are spread over a number of shards, each a map guarded by a
+  reader/writer lock, so lookups only wait for inserts and removals in
+  their own shard. Channels are created outside the map lock, creation
+  only blocks other creations in the same shard.
+*/
+class SSEChannelRegistry {
+  public:
+    SSEChannelRegistry();
+    SSEChannelPtr Get(const string& id);
+    SSEChannelPtr Create(const string& id, const ChannelConfig& conf, const ClientHandlerList& handlers);
+    bool Remove(const SSEChannelPtr& ch);
+    SSEChannelList GetChannels();
+    size_t Size();
+
+  private:
+    struct Shard {
+      std::mutex create_lock;
+      boost::shared_mutex lock;
+      SSEChannelMap channels;
+    };
+
+    Shard _shards[CHANNEL_REGISTRY_SHARDS];
+
+    Shard& GetShard(const string& id);
+};
+
+#endif
@@ -3,6 +3,7 @@
 
 #include <string>
 #include <deque>
+#include <vector>
 #include <sys/epoll.h>
 #include <netinet/in.h>
 #include <stdint.h>
@@ -10,6 +11,8 @@
 #include <boost/shared_ptr.hpp>
 #include <boost/thread.hpp>
 #include "HTTPRequest.h"
+#include "SSEBuffer.h"
+#include "SSEWriteBuffer.h"
 
 #define IOVEC_SIZE 512
 #define SND_NO_FLUSH false
@@ -19,6 +22,12 @@ enum SubscriptionType {
   SUBSCRIPTION_EVENT_TYPE
 };
 
+enum BacklogPolicy {
+  BACKLOG_DISCONNECT,
+  BACKLOG_DROP_OLDEST,
+  BACKLOG_CONFLATE
+};
+
 typedef struct {
   string key;
   SubscriptionType type;
@@ -26,11 +35,16 @@ typedef struct {
 
 using namespace std;
 
+// Forward declarations.
+class SSEChannel;
+
 class SSEClient {
   public:
     SSEClient(int fd, struct sockaddr_in* csin);
     ~SSEClient();
     ssize_t Send(const string &data);
+    ssize_t Send(const SSEBufferPtr& buf);
+    ssize_t Send(const vector<SSEBufferPtr>& batch);
     size_t Read(char* buf, int len);
     int Getfd();
     HTTPRequest* GetHttpReq();
@@ -44,21 +58,36 @@ class SSEClient {
     void Subscribe(const string key, SubscriptionType type);
     bool isFilterAcceptable(const string& data);
     ssize_t Flush();
+    size_t GetBacklogSize();
+    void SetBacklogLimits(size_t maxBytes, size_t maxEvents, BacklogPolicy policy);
+    bool IsEvicted();
+    size_t GetNumDropped();
     int AddToEpoll(int epoll_fd, uint32_t events);
+    int RemoveFromEpoll();
+    void SetChannel(SSEChannel* channel);
+    SSEChannel* GetChannel();
 
    private:
     int _fd;
     int _epoll_fd;
     struct epoll_event _epoll_event;
     struct sockaddr_in _csin;
+    SSEChannel* _channel;
     bool _dead;
     bool _isEventFiltered;
     bool _isIdFiltered;
+    bool _evicted;
+    size_t _max_backlog_bytes;
+    size_t _max_backlog_events;
+    BacklogPolicy _backlog_policy;
+    size_t _num_dropped;
     vector<SubscriptionElement> _subscriptions;
     boost::shared_ptr<HTTPRequest> m_httpReq;
-    string _write_buffer;
+    SSEWriteBuffer _write_buffer;
     std::mutex _write_lock;
-    size_t _prune_write_buffer(size_t bytes);
+    ssize_t _flush_write_buffer();
+    void _enqueue(const SSEBufferPtr& buf);
+    void _enforce_backlog_limits();
     void _enable_epoll_out();
     void _disable_epoll_out();
     const string _get_sse_field(const string& data, const string& fieldName);
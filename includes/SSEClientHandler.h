@@ -4,35 +4,124 @@
 #include <string>
 #include <pthread.h>
 #include <list>
+#include <deque>
+#include <map>
+#include <set>
+#include <vector>
 #include <boost/shared_ptr.hpp>
 #include <boost/thread.hpp>
-#include "ConcurrentQueue.h"
+#include "Common.h"
+#include "MPSCQueue.h"
+#include "SSEBuffer.h"
+#include "SSETimer.h"
+
+#define HANDLER_QUEUE_SIZE 65536
+#define HANDLER_MAXEVENTS 1024
+#define BATCH_HIST_BUCKETS 5
+#define REPLAY_MAX_BACKLOG 65536
 
 using namespace std;
 
 // Forward declarations.
 class SSEClient;
+class SSEChannel;
+class SSEConfig;
 
 typedef boost::shared_ptr<SSEClient> SSEClientPtr;
 typedef list<SSEClientPtr> SSEClientPtrList;
+typedef map<SSEChannel*, SSEClientPtrList> SSEChannelClientMap;
+typedef boost::shared_ptr<SSEChannel> SSEChannelPtr;
+
+/**
+  Message queued for a client handler. Either a broadcast to the
+  clients of channel, or cached events fetched for a replay to client.
+*/
+struct SSEHandlerMsg {
+  SSEChannelPtr channel;
+  SSEBufferPtr buf;
+  SSEClientPtr client;
+  SSEReplayBlobPtr blob;
+};
+
+enum ReplayMode {
+  REPLAY_NONE,
+  REPLAY_SINCE_ID,
+  REPLAY_SINCE_TIME,
+  REPLAY_ALL
+};
 
+/**
+  Cached events being sent to a newly connected client.
+  The events are fetched by the replay fetcher thread, live events for
+  the client are held back until the replay is done.
+*/
+struct SSEReplay {
+  SSEClientPtr client;
+  SSEChannelPtr channel;
+  ReplayMode mode;
+  string lastId;
+  uint64_t since;
+  bool fetching;
+  SSEReplayBlobPtr blob;
+  size_t next_chunk;
+  vector<SSEBufferPtr> live;
+};
+
+typedef map<SSEClient*, SSEReplay> SSEReplayMap;
+
+/**
+  Reactor thread owning a share of the clients of all channels.
+  Handles socket events for its clients, fans out broadcasts queued
+  for the channels they are subscribed to and pings its clients.
+*/
 class SSEClientHandler {
   public:
-    SSEClientHandler(int);
+    SSEClientHandler(int tid, SSEConfig* config, int shutdownfd);
     ~SSEClientHandler();
-    void AddClient(SSEClient* client);
-    void Broadcast(const string msg);
+    int GetId();
+    bool AddClient(SSEChannel* channel, SSEClient* client, ReplayMode replay=REPLAY_NONE, const string& lastId="", uint64_t since=0);
+    void Broadcast(const SSEChannelPtr& channel, const SSEBufferPtr& msg);
+    void Ping(const SSEBufferPtr& msg);
     size_t GetNumClients();
+    void GetBacklogStats(SSEChannel* channel, size_t& total, size_t& max);
+    void GetBatchStats(ulong* hist);
+    static const char* GetBatchBucketName(int bucket);
 
   private:
     int _id;
+    int _efd;
+    int _shutdown_fd;
+    int _coalesce_window;
     size_t _connected_clients;
-    SSEClientPtrList _clientlist;
+    ulong _batch_hist[BATCH_HIST_BUCKETS];
+    SSEChannelClientMap _clients;
+    SSEReplayMap _replays;
+    vector<SSEReplay> _new_replays;
     boost::mutex _clientlist_lock;
     boost::thread _processorthread;
-    ConcurrentQueue<std::string> _msgqueue;
+    deque<SSEReplay> _fetch_queue;
+    boost::mutex _fetch_lock;
+    boost::condition_variable _fetch_cond;
+    bool _fetch_stop;
+    boost::thread _fetcherthread;
+    MPSCQueue<SSEHandlerMsg> _msgqueue;
+    SSETimer _ping_timer;
+    SSEBufferPtr _ping_msg;
 
+    void Run();
+    void RunFetcher();
+    void HandleClientEvent(SSEClient* client, uint32_t events);
+    void RemoveDeadClient(SSEClient* client, bool error);
     void ProcessQueue();
+    void ProcessReplays();
+    void StartReplays();
+    bool HasReplayWork();
+    void SendBatch(SSEChannel* channel, SSEClientPtrList& clients, const vector<SSEBufferPtr>& batch);
+    void RemoveClient(SSEChannel* channel, SSEClientPtrList& clients, SSEClientPtrList::iterator& it);
+    static int GetBatchBucket(size_t size);
 };
 
+typedef boost::shared_ptr<SSEClientHandler> ClientHandlerPtr;
+typedef vector<ClientHandlerPtr> ClientHandlerList;
+
 #endif
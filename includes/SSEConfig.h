@@ -20,6 +20,11 @@ struct ChannelConfig {
   std::vector<iprange_t> allowedPublishers;
   string                 cacheAdapter;
   size_t                 cacheLength;
+  size_t                 cacheBytes;
+  size_t                 cacheMaxAge;
+  size_t                 maxBacklogBytes;
+  size_t                 maxBacklogEvents;
+  BacklogPolicy          backlogPolicy;
 };
 
 typedef std::map<const std::string, std::string> ConfigMap_t;
@@ -31,6 +36,7 @@ class SSEConfig {
     SSEConfig();
     const string &GetValue(const string& key);
     int GetValueInt(const string& key);
+    size_t GetValueSize(const string& key);
     bool GetValueBool(const string& key);
     ChannelMap_t& GetChannels();
     ChannelConfig& GetDefaultChannelConfig();
@@ -40,6 +46,7 @@ class SSEConfig {
     void GetArray(vector<std::string>& target, boost::property_tree::ptree& pt);
     void LoadChannels(boost::property_tree::ptree& pt);
     void GetAllowedPublishers(ChannelConfig& conf, boost::property_tree::ptree& pt);
+    BacklogPolicy GetBacklogPolicy(const string& policy);
     ConfigMap_t ConfigMap;
     ChannelMap_t ChannelMap;
     ChannelConfig DefaultChannelConfig;
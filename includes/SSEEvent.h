@@ -7,17 +7,21 @@
 #include <boost/property_tree/ptree.hpp>
 #include <boost/property_tree/json_parser.hpp>
 #include <glog/logging.h>
+#include "SSEBuffer.h"
 
 using namespace std;
 
 class SSEEvent {
   public:
     SSEEvent(const string& jsonData);
+    SSEEvent(const SSEBufferPtr& buf);
     ~SSEEvent();
     bool  compile();
-    const string get();
+    const string& get();
+    const SSEBufferPtr& GetBuffer();
     const string getpath();
     const string getid();
+    uint64_t GetTime();
     void  setpath(const string path);
 
   private:
@@ -27,6 +31,8 @@ class SSEEvent {
     vector<string> _data;
     string _id;
     int _retry;
+    uint64_t _time;
+    SSEBufferPtr _buffer;
 };
 
 #endif
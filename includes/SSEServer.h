@@ -13,10 +13,14 @@
 #include <errno.h>
 #include <vector>
 #include <string>
+#include <atomic>
 #include <boost/thread.hpp>
 #include <boost/shared_ptr.hpp>
 #include "SSEEvent.h"
 #include "SSEStatsHandler.h"
+#include "SSEClientHandler.h"
+#include "SSEChannelRegistry.h"
+#include "SSETimer.h"
 #define MAXEVENTS 1024
 
 extern int stop;
@@ -28,36 +32,52 @@ class SSEInputSource;
 class HTTPRequest;
 class SSEClient;
 
-typedef std::vector<boost::shared_ptr<SSEChannel> > SSEChannelList;
-
 class SSEServer {
   public:
     SSEServer(SSEConfig* config);
     ~SSEServer();
 
     void Run();
-    const SSEChannelList& GetChannelList();
+    void Stop();
+    SSEChannelList GetChannelList();
+    const ClientHandlerList& GetClientHandlers();
     SSEConfig* GetConfig();
     bool IsAllowedToPublish(SSEClient* client, const struct ChannelConfig& chConf);
     bool Broadcast(SSEEvent& event);
+    ulong GetNumReapedChannels();
+    ulong GetNumCacheEvictions();
 
   private:
     SSEConfig *_config;
-    SSEChannelList _channels;
+    SSEChannelRegistry _channels;
     boost::shared_ptr<SSEInputSource> _datasource;
     SSEStatsHandler stats;
-    boost::thread _routerthread;
-    int _serversocket;
-    int _efd;
+    std::vector<boost::shared_ptr<boost::thread> > _routerthreads;
+    boost::thread _reaperthread;
+    std::atomic<ulong> _num_reaped_channels;
+    std::atomic<ulong> _num_cache_evictions;
+    std::vector<boost::shared_ptr<boost::thread> > _acceptthreads;
+    ClientHandlerList _clienthandlers;
+    std::vector<int> _serversockets;
+    int _shutdown_fd;
+    std::vector<int> _router_efds;
+    std::atomic<unsigned int> _next_router;
     struct sockaddr_in _sin;
 
     void InitSocket();
-    void AcceptLoop();
-    void ClientRouterLoop();
+    int CreateListenSocket(bool reusePort);
+    void AcceptLoop(int serversocket);
+    void AcceptConnections(int serversocket);
+    void WatchShutdown(int efd, void* ptr);
+    void InitRouters();
+    void ClientRouterLoop(int efd);
     void PostHandler(SSEClient* client, HTTPRequest* req);
+    void InitClientHandlers();
     void InitChannels();
+    void ReaperLoop();
+    void EnforceCacheBudget(size_t budget);
     void RemoveClient(SSEClient* client);
-    SSEChannel* GetChannel(const std::string id, bool create=false);
+    SSEChannelPtr GetChannel(const std::string& id, bool create=false);
 };
 
 #endif
@@ -2,6 +2,7 @@
 #define SSESTATSHANDLER_H
 
 #include <string>
+#include <atomic>
 #include <boost/thread.hpp>
 #include "Common.h"
 
@@ -14,11 +15,13 @@ class SSEClient;
 
 class SSEStatsHandler {
   public:
-    ulong invalid_events_rcv;
-    ulong router_read_errors;
-    ulong invalid_http_req;
-    ulong oversized_http_req;
+    std::atomic<ulong> invalid_events_rcv;
+    std::atomic<ulong> router_read_errors;
+    std::atomic<ulong> invalid_http_req;
+    std::atomic<ulong> oversized_http_req;
     ulong totalClients;
+    std::atomic<ulong> accepted_connections;
+    std::atomic<ulong> accept_errors;
 
     SSEStatsHandler();
     ~SSEStatsHandler();
@@ -28,11 +31,17 @@ class SSEStatsHandler {
 
   private:
     std::string _jsonData;
+    boost::mutex _update_lock;
     SSEConfig* _config;
     SSEServer* _server;
     int _startTime;
+    ulong _last_accepted;
+    time_t _last_accept_sample;
+    double _accept_rate;
 
     void Update();
+    double GetAcceptRate();
+    static double GetHitRatio(ulong hits, ulong misses);
 };
 
 #endif
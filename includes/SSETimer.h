@@ -0,0 +1,24 @@
+#ifndef SSETIMER_H
+#define SSETIMER_H
+
+#include <stdint.h>
+
+/**
+  Periodic timer backed by a timerfd.
+  The file descriptor becomes readable when the timer expires, so timers
+  can be waited for in an epoll loop together with sockets and eventfds.
+*/
+class SSETimer {
+  public:
+    SSETimer();
+    ~SSETimer();
+    void SetInterval(int msec);
+    int GetFd();
+    uint64_t Read();
+    static uint64_t Now();
+
+  private:
+    int _fd;
+};
+
+#endif
@@ -0,0 +1,42 @@
+#ifndef SSEWRITEBUFFER_H
+#define SSEWRITEBUFFER_H
+
+#include <sys/uio.h>
+#include <atomic>
+#include "SSEBuffer.h"
+
+using namespace std;
+
+/**
+  Per-client queue of pending output.
+  Holds references to shared buffers and a cursor into the first one, so
+  partial writes only advance the cursor. Pending bytes are accounted per
+  buffer and globally. Segments that are not yet started and not pinned
+  can be dropped to enforce backlog limits.
+*/
+class SSEWriteBuffer {
+  public:
+    SSEWriteBuffer();
+    ~SSEWriteBuffer();
+    void Append(const SSEBufferPtr& buf);
+    size_t FillIovec(struct iovec* iov, size_t iovmax, size_t& len);
+    bool GetFileRange(int& fd, off_t& offset, size_t& len);
+    void Consume(size_t bytes);
+    void Clear();
+    void Pin();
+    size_t DropOldest(size_t maxBytes, size_t maxSegments);
+    size_t Conflate(const string& id);
+    bool Empty();
+    size_t GetSize();
+    size_t GetNumSegments();
+    static size_t GetGlobalSize();
+
+  private:
+    SSEBufferList _segments;
+    size_t _offset;
+    size_t _pinned;
+    std::atomic<size_t> _size;
+    static std::atomic<size_t> _global_size;
+};
+
+#endif
@@ -2,9 +2,63 @@
 #include "CacheAdapters/LevelDB.h"
 #include "SSEConfig.h"
 #include "SSEEvent.h"
+#include "SSETimer.h"
+#include <cstring>
+
+#define LEVELDB_FORMAT_VERSION "2"
 
 using namespace std;
 
+/*
+  Events are stored under a sequence number in arrival order, with an
+  index from event id to sequence number. Event ids can not contain
+  newlines, so the newline prefixes never collide with old style keys.
+  Event values are the arrival time, the event id, a newline and the data.
+*/
+static const string EVENT_PREFIX = "\ne";
+static const string INDEX_PREFIX = "\ni";
+static const string VERSION_KEY  = "\nv";
+
+static string EncodeSeq(uint64_t seq) {
+  string buf(8, '\0');
+
+  // Big endian, so keys sort in sequence order.
+  for (int i = 7; i >= 0; i--) {
+    buf[i] = seq & 0xff;
+    seq >>= 8;
+  }
+
+  return buf;
+}
+
+static uint64_t DecodeSeq(const char* buf) {
+  uint64_t seq = 0;
+
+  for (int i = 0; i < 8; i++) {
+    seq = (seq << 8) | (unsigned char)buf[i];
+  }
+
+  return seq;
+}
+
+/*
+  Returns the event data in a stored event value, or NULL if it is malformed.
+*/
+static const char* FindData(const char* val, size_t vlen) {
+  if (vlen < 8) return NULL;
+
+  const char* sep = (const char*)memchr(val + 8, '\n', vlen - 8);
+  return sep ? sep + 1 : NULL;
+}
+
+static string EventKey(uint64_t seq) {
+  return EVENT_PREFIX + EncodeSeq(seq);
+}
+
+static string IndexKey(const string& id) {
+  return INDEX_PREFIX + id;
+}
+
 /**
   Constructor.
   @param config SSEChannelConfig.
@@ -22,20 +76,32 @@ LevelDB::~LevelDB() {
   leveldb_options_destroy(_options);
   leveldb_writeoptions_destroy(_woptions);
   leveldb_readoptions_destroy(_roptions);
-  leveldb_close(_db);
+  if (_db) leveldb_close(_db);
 }
 
 /**
  @param dbfile Path where we should create or load the database.
 **/
 void LevelDB::InitDB(const string& dbfile) {
-  char* err = NULL;
-
+  _dbfile = dbfile;
   _options = leveldb_options_create();
   _roptions = leveldb_readoptions_create();
   _woptions = leveldb_writeoptions_create();
   leveldb_options_set_create_if_missing(_options, 1);
-  _db = leveldb_open(_options, dbfile.c_str(), &err);
+  leveldb_options_set_compression(_options, _config.server->GetValueBool("leveldb.compression") ?
+      leveldb_snappy_compression : leveldb_no_compression);
+  Open();
+
+  LOG(INFO) << "LevelDB::InitDB finished for " << _config.id;
+}
+
+/**
+ Open the storage file, creating it if missing, and load the cache state.
+**/
+void LevelDB::Open() {
+  char* err = NULL;
+
+  _db = leveldb_open(_options, _dbfile.c_str(), &err);
 
   if (err != NULL) {
     LOG(FATAL) << "Failed to open leveldb storage file: " << err;
@@ -43,70 +109,369 @@ void LevelDB::InitDB(const string& dbfile) {
     err = NULL;
   }
 
-  LOG(INFO) << "LevelDB::InitDB finished for " << _config.id;
+  CheckFormat();
+  LoadSequence();
+}
+
+/**
+ Upgrade a cache written in the old format, keyed by event id only, or
+ written without arrival times.
+**/
+void LevelDB::CheckFormat() {
+  char* err = NULL;
+  size_t vlen;
+  char* version = leveldb_get(_db, _roptions, VERSION_KEY.data(), VERSION_KEY.length(), &vlen, &err);
+
+  if (err != NULL) {
+    LOG(ERROR) << "Failed to read leveldb format version: " << err;
+    leveldb_free(err);
+    return;
+  }
+
+  if (version != NULL) {
+    const string current(version, vlen);
+    leveldb_free(version);
+
+    if (current == "1") AddEventTimes();
+    return;
+  }
+
+  MigrateIdKeys();
+}
+
+/**
+ Move the events of a cache keyed by event id to sequence numbers.
+ Old versions replayed and evicted the events in key order, so they are
+ numbered in that order and given the current time. The keys and values
+ were stored with a terminating NUL, records without an id or data are
+ dropped. The format version is written in the same batch.
+**/
+void LevelDB::MigrateIdKeys() {
+  char* err = NULL;
+  const string time = EncodeSeq(SSETimer::Now());
+  leveldb_writebatch_t* batch = leveldb_writebatch_create();
+  leveldb_iterator_t* it = leveldb_create_iterator(_db, _roptions);
+  uint64_t seq = 0;
+  size_t numKeys = 0;
+
+  for (leveldb_iter_seek_to_first(it); leveldb_iter_valid(it); leveldb_iter_next(it)) {
+    size_t klen, vlen;
+    const char* key = leveldb_iter_key(it, &klen);
+    const char* val = leveldb_iter_value(it, &vlen);
+    const string id(key, strnlen(key, klen));
+    const string data(val, strnlen(val, vlen));
+
+    leveldb_writebatch_delete(batch, key, klen);
+    numKeys++;
+
+    if (id.empty() || data.empty() || id.find('\n') != string::npos) continue;
+
+    const string eventKey = EventKey(seq);
+    const string value = time + id + "\n" + data;
+    const string indexKey = IndexKey(id);
+    const string indexValue = EncodeSeq(seq);
+
+    leveldb_writebatch_put(batch, eventKey.data(), eventKey.length(), value.data(), value.length());
+    leveldb_writebatch_put(batch, indexKey.data(), indexKey.length(), indexValue.data(), indexValue.length());
+    seq++;
+  }
+
+  leveldb_iter_destroy(it);
+
+  leveldb_writebatch_put(batch, VERSION_KEY.data(), VERSION_KEY.length(),
+      LEVELDB_FORMAT_VERSION, strlen(LEVELDB_FORMAT_VERSION));
+  leveldb_write(_db, _woptions, batch, &err);
+  leveldb_writebatch_destroy(batch);
+
+  if (err != NULL) {
+    LOG(ERROR) << "Failed to migrate leveldb storage file " << _dbfile << ": " << err;
+    leveldb_free(err);
+    return;
+  }
+
+  if (numKeys > 0) {
+    LOG(INFO) << "Migrated " << seq << " of " << numKeys << " events cached in the old format in " << _dbfile;
+  }
+}
+
+/**
+ Upgrade a cache written before arrival times were stored.
+ The cached events are given the current time.
+**/
+void LevelDB::AddEventTimes() {
+  char* err = NULL;
+  const string time = EncodeSeq(SSETimer::Now());
+  leveldb_writebatch_t* batch = leveldb_writebatch_create();
+  leveldb_iterator_t* it = leveldb_create_iterator(_db, _roptions);
+  size_t numEvents = 0;
+
+  for (leveldb_iter_seek(it, EVENT_PREFIX.data(), EVENT_PREFIX.length());
+      leveldb_iter_valid(it); leveldb_iter_next(it)) {
+    size_t klen, vlen;
+    const char* key = leveldb_iter_key(it, &klen);
+    const char* val = leveldb_iter_value(it, &vlen);
+
+    if (EVENT_PREFIX.compare(0, string::npos, key, std::min(klen, EVENT_PREFIX.length())) != 0) break;
+
+    const string value = time + string(val, vlen);
+    leveldb_writebatch_put(batch, key, klen, value.data(), value.length());
+    numEvents++;
+  }
+
+  leveldb_iter_destroy(it);
+
+  leveldb_writebatch_put(batch, VERSION_KEY.data(), VERSION_KEY.length(),
+      LEVELDB_FORMAT_VERSION, strlen(LEVELDB_FORMAT_VERSION));
+  leveldb_write(_db, _woptions, batch, &err);
+  leveldb_writebatch_destroy(batch);
+
+  if (err != NULL) {
+    LOG(ERROR) << "Failed to upgrade leveldb storage file " << _dbfile << ": " << err;
+    leveldb_free(err);
+    return;
+  }
+
+  LOG(INFO) << "Added arrival times to " << numEvents << " cached events in " << _dbfile;
+}
+
+/**
+ Find the sequence numbers of the oldest and newest cached events, the
+ size of the cached event data and the arrival time of the newest event.
+**/
+void LevelDB::LoadSequence() {
+  leveldb_iterator_t* it = leveldb_create_iterator(_db, _roptions);
+  bool first = true;
+
+  _first_seq = 0;
+  _next_seq = 0;
+  _bytes = 0;
+  _last_time = 0;
+
+  for (leveldb_iter_seek(it, EVENT_PREFIX.data(), EVENT_PREFIX.length());
+      leveldb_iter_valid(it); leveldb_iter_next(it)) {
+    size_t klen, vlen;
+    const char* key = leveldb_iter_key(it, &klen);
+    const char* val = leveldb_iter_value(it, &vlen);
+
+    if (klen != EVENT_PREFIX.length() + 8 || EVENT_PREFIX.compare(0, string::npos, key, EVENT_PREFIX.length()) != 0) break;
+
+    if (first) {
+      _first_seq = DecodeSeq(key + EVENT_PREFIX.length());
+      first = false;
+    }
+
+    _next_seq = DecodeSeq(key + EVENT_PREFIX.length()) + 1;
+
+    const char* data = FindData(val, vlen);
+    if (!data) continue;
+
+    _bytes += val + vlen - data;
+    _last_time = DecodeSeq(val);
+  }
+
+  leveldb_iter_destroy(it);
 }
 
 /**
  Add event to cache.
- @patam event Pointer to SSEEvent to cache.
+ An update to a cached event keeps its place and arrival time, otherwise
+ the oldest events are evicted in the same write batch.
+ @param event Pointer to SSEEvent to cache.
 **/
 void LevelDB::CacheEvent(SSEEvent& event) {
   char* err = NULL;
+  const SSEBufferPtr& buf = event.GetBuffer();
+  uint64_t first = _first_seq;
+  uint64_t next = _next_seq;
+  uint64_t updated = next;
+  uint64_t last = _last_time;
+  uint64_t time = std::max(buf->GetTime(), last);
+  size_t bytes = _bytes + buf->GetLength();
+  uint64_t seq;
+
+  if (_config.cacheLength == 0) return;
+
+  leveldb_writebatch_t* batch = leveldb_writebatch_create();
+
+  if (LookupSeq(_roptions, buf->GetId(), seq)) {
+    const string key = EventKey(seq);
+    string id;
+    size_t length;
+
+    if (ReadEvent(_roptions, seq, id, length, time)) bytes -= length;
+    updated = seq;
+
+    const string value = EncodeSeq(time) + buf->GetId() + "\n" + buf->GetData();
+    leveldb_writebatch_put(batch, key.data(), key.length(), value.data(), value.length());
+  } else {
+    const string key = EventKey(next);
+    const string value = EncodeSeq(time) + buf->GetId() + "\n" + buf->GetData();
+    const string indexKey = IndexKey(buf->GetId());
+    const string indexValue = EncodeSeq(next);
+
+    leveldb_writebatch_put(batch, key.data(), key.length(), value.data(), value.length());
+    leveldb_writebatch_put(batch, indexKey.data(), indexKey.length(), indexValue.data(), indexValue.length());
+    last = time;
+    next++;
+  }
+
+  // The newest event is never evicted, and the updated one is not stored yet.
+  while (next - first > 1) {
+    bool full = next - first > _config.cacheLength || (_config.cacheBytes > 0 && bytes > _config.cacheBytes);
+    string id;
+    size_t length = 0;
+    uint64_t eventTime = 0;
+    bool found = (full || _config.cacheMaxAge > 0) && ReadEvent(_roptions, first, id, length, eventTime);
+
+    if (!full && !(found && IsExpired(eventTime, last, _config.cacheMaxAge))) break;
 
-  leveldb_put(_db, _woptions, event.getid().c_str(), event.getid().length()+1,
-      event.get().c_str(), event.get().length()+1, &err);
+    Evict(batch, first, id);
+    bytes -= (first == updated) ? buf->GetLength() : length;
+    first++;
+  }
+
+  leveldb_write(_db, _woptions, batch, &err);
+  leveldb_writebatch_destroy(batch);
 
   if (err != NULL) {
-    LOG(ERROR) << "Failed to cache event with id " << event.getid() << ": " << err;
+    LOG(ERROR) << "Failed to cache event with id " << buf->GetId() << ": " << err;
     leveldb_free(err);
     return;
   }
 
-  if (GetSizeOfCachedEvents() > _config.cacheLength) {
-    size_t klen;
-    char *err = NULL;
-    leveldb_iterator_t* it = leveldb_create_iterator(_db, _roptions);
+  _first_seq = first;
+  _next_seq = next;
+  _bytes = bytes;
+  _last_time = last;
+}
 
-    leveldb_iter_seek_to_first(it);
-    const string key = leveldb_iter_key(it, &klen);
+/**
+ Add the deletion of a cached event and its index entry to a batch.
+ @param batch Write batch.
+ @param seq Sequence number of the event.
+ @param id Event id, empty if the event could not be read.
+**/
+void LevelDB::Evict(leveldb_writebatch_t* batch, uint64_t seq, const string& id) {
+  const string key = EventKey(seq);
 
-    leveldb_delete(_db, _woptions, key.c_str(), klen, &err);
+  if (!id.empty()) {
+    const string indexKey = IndexKey(id);
+    leveldb_writebatch_delete(batch, indexKey.data(), indexKey.length());
+  }
 
-    if (err != NULL) {
-      LOG(ERROR) << "Failed to delete key " << key << ": " << err;
-      leveldb_free(err);
-    } else {
-      DLOG(INFO) << "Deleted key " << key;
-    }
+  leveldb_writebatch_delete(batch, key.data(), key.length());
+}
+
+/**
+ Read the id, data length and arrival time of a stored event.
+ @param readopts Read options.
+ @param seq Sequence number of the event.
+ @param id Set to the event id.
+ @param length Set to the length of the event data.
+ @param time Set to the arrival time of the event.
+ @returns false if the event could not be read.
+**/
+bool LevelDB::ReadEvent(const leveldb_readoptions_t* readopts, uint64_t seq, string& id, size_t& length, uint64_t& time) {
+  char* err = NULL;
+  size_t vlen;
+  const string key = EventKey(seq);
+  char* value = leveldb_get(_db, readopts, key.data(), key.length(), &vlen, &err);
+
+  if (err != NULL) {
+    LOG(ERROR) << "Failed to read cached event: " << err;
+    leveldb_free(err);
+    return false;
+  }
+
+  if (value == NULL) return false;
+
+  const char* data = FindData(value, vlen);
+
+  if (data) {
+    time = DecodeSeq(value);
+    id.assign(value + 8, data - 1 - value - 8);
+    length = value + vlen - data;
+  }
+
+  leveldb_free(value);
+
+  return data != NULL;
+}
+
+/**
+ Look up the sequence number of an event id.
+ @param readopts Read options.
+ @param id Event id.
+ @param seq Set to the sequence number if found.
+**/
+bool LevelDB::LookupSeq(const leveldb_readoptions_t* readopts, const string& id, uint64_t& seq) {
+  char* err = NULL;
+  size_t vlen;
+  const string key = IndexKey(id);
+  char* value = leveldb_get(_db, readopts, key.data(), key.length(), &vlen, &err);
+
+  if (err != NULL) {
+    LOG(ERROR) << "Failed to look up event with id " << id << ": " << err;
+    leveldb_free(err);
+    return false;
+  }
+
+  if (value == NULL) return false;
+
+  bool found = (vlen == 8);
+  if (found) seq = DecodeSeq(value);
+  leveldb_free(value);
+
+  return found;
+}
+
+/**
+ Read cached events from a sequence number to the newest one.
+ @param readopts Read options.
+ @param seq Sequence number of the first event.
+**/
+SSEBufferList LevelDB::ReadEvents(const leveldb_readoptions_t* readopts, uint64_t seq) {
+  SSEBufferList events;
+  const string start = EventKey(seq);
+  leveldb_iterator_t* it = leveldb_create_iterator(_db, readopts);
 
-    leveldb_iter_destroy(it);
+  for (leveldb_iter_seek(it, start.data(), start.length());
+      leveldb_iter_valid(it); leveldb_iter_next(it)) {
+    size_t klen, vlen;
+    const char* key = leveldb_iter_key(it, &klen);
+    const char* val = leveldb_iter_value(it, &vlen);
+
+    if (EVENT_PREFIX.compare(0, string::npos, key, std::min(klen, EVENT_PREFIX.length())) != 0) break;
+
+    const char* data = FindData(val, vlen);
+    if (!data) continue;
+
+    events.push_back(SSEBufferPtr(new SSEBuffer(string(data, val + vlen - data), string(val + 8, data - 1 - val - 8), DecodeSeq(val))));
   }
+
+  leveldb_iter_destroy(it);
+
+  return events;
 }
 
 /**
  Get a list of all events since a givend ID.
  @param lastId ID of first event.
 **/
-deque<string> LevelDB::GetEventsSinceId(string lastId) {
-  deque<string> events;
-  leveldb_iterator_t* it;
+SSEBufferList LevelDB::GetEventsSinceId(string lastId) {
+  SSEBufferList events;
   leveldb_readoptions_t* readopts;
   const leveldb_snapshot_t* snapshot;
+  uint64_t seq;
 
   snapshot = leveldb_create_snapshot(_db);
   readopts = leveldb_readoptions_create();
-  leveldb_readoptions_set_snapshot(readopts, snapshot); 
-
-  it = leveldb_create_iterator(_db, readopts);
+  leveldb_readoptions_set_snapshot(readopts, snapshot);
 
-  for (leveldb_iter_seek(it, lastId.c_str(), lastId.length()); 
-      leveldb_iter_valid(it); leveldb_iter_next(it)) {
-    size_t vlen;
-    const char* val = leveldb_iter_value(it, &vlen);
-    events.push_back(val);
+  if (LookupSeq(readopts, lastId, seq)) {
+    events = ReadEvents(readopts, seq);
   }
 
-  leveldb_iter_destroy(it);
   leveldb_release_snapshot(_db, snapshot);
   leveldb_readoptions_destroy(readopts);
   return events;
@@ -115,25 +480,17 @@ deque<string> LevelDB::GetEventsSinceId(string lastId) {
 /**
  Get a list of all events stored in the cache.
 **/
-deque<string> LevelDB::GetAllEvents() {
-  deque<string> events;
-  leveldb_iterator_t* it;
+SSEBufferList LevelDB::GetAllEvents() {
+  SSEBufferList events;
   leveldb_readoptions_t* readopts;
   const leveldb_snapshot_t* snapshot;
 
   snapshot = leveldb_create_snapshot(_db);
   readopts = leveldb_readoptions_create();
-  leveldb_readoptions_set_snapshot(readopts, snapshot); 
+  leveldb_readoptions_set_snapshot(readopts, snapshot);
 
-  it = leveldb_create_iterator(_db, readopts);
-  
-  for (leveldb_iter_seek_to_first(it); leveldb_iter_valid(it); leveldb_iter_next(it)) {
-    size_t vlen;
-    const char* val = leveldb_iter_value(it, &vlen);
-    events.push_back(val);
-  }
+  events = ReadEvents(readopts, 0);
 
-  leveldb_iter_destroy(it);
   leveldb_release_snapshot(_db, snapshot);
   leveldb_readoptions_destroy(readopts);
 
@@ -141,26 +498,81 @@ deque<string> LevelDB::GetAllEvents() {
 }
 
 /**
- Get number of events currently stored in the cache.
+ Get a list of the events that arrived at or after a point in time.
+ Binary searches the sequence numbers, the arrival times never decrease.
+ @param time Milliseconds since the epoch.
 **/
-size_t LevelDB::GetSizeOfCachedEvents() {
-  leveldb_iterator_t* it;
+SSEBufferList LevelDB::GetEventsSinceTime(uint64_t time) {
+  SSEBufferList events;
   leveldb_readoptions_t* readopts;
   const leveldb_snapshot_t* snapshot;
-  size_t n_keys;
+
+  // Read the range before taking the snapshot, the counters are only moved
+  // after a write, so every event in range is in the snapshot unless it was
+  // evicted since. Evicted events are the oldest ones and sort before the time.
+  uint64_t seq = _first_seq;
+  uint64_t end = _next_seq;
 
   snapshot = leveldb_create_snapshot(_db);
   readopts = leveldb_readoptions_create();
-  it = leveldb_create_iterator(_db, readopts);
- 
-  leveldb_iter_seek_to_first(it);
-  for(n_keys = 0; leveldb_iter_valid(it); leveldb_iter_next(it)) {
-    n_keys++;
+  leveldb_readoptions_set_snapshot(readopts, snapshot);
+
+  while (seq < end) {
+    uint64_t mid = seq + (end - seq) / 2;
+    string id;
+    size_t length;
+    uint64_t eventTime;
+
+    if (!ReadEvent(readopts, mid, id, length, eventTime) || eventTime < time) {
+      seq = mid + 1;
+    } else {
+      end = mid;
+    }
+  }
+
+  events = ReadEvents(readopts, seq);
+
+  while (!events.empty() && events.front()->GetTime() < time) {
+    events.pop_front();
   }
 
-  leveldb_iter_destroy(it);
   leveldb_release_snapshot(_db, snapshot);
   leveldb_readoptions_destroy(readopts);
 
-  return n_keys;
+  return events;
+}
+
+/**
+ Get number of events currently stored in the cache.
+**/
+size_t LevelDB::GetSizeOfCachedEvents() {
+  return _next_seq - _first_seq;
+}
+
+/**
+ Get size of the event data currently stored in the cache.
+**/
+size_t LevelDB::GetCachedBytes() {
+  return _bytes;
+}
+
+/**
+ Delete the storage file and start over with an empty one.
+**/
+void LevelDB::Purge() {
+  char* err = NULL;
+
+  leveldb_close(_db);
+  _db = NULL;
+
+  leveldb_destroy_db(_options, _dbfile.c_str(), &err);
+
+  if (err != NULL) {
+    LOG(ERROR) << "Failed to delete leveldb storage file " << _dbfile << ": " << err;
+    leveldb_free(err);
+  } else {
+    LOG(INFO) << "Deleted leveldb storage file " << _dbfile;
+  }
+
+  Open();
 }
@@ -5,196 +5,514 @@
 #include <string>
 #include <vector>
 #include <iostream>
-#include <boost/asio/io_service.hpp>
-#include <boost/asio/ip/address.hpp>
+#include <set>
+#include <cstdlib>
+#include <boost/lexical_cast.hpp>
 #include <boost/foreach.hpp>
 
 using namespace std;
 extern int stop;
 
+/**
+  Adds events and trims each cache to its cache length, byte and age limit.
+  Takes the keys of each cache as KEYS, in the order of CacheKeys(), and
+  (id, data, cacheLength, cacheBytes, time, maxAge) tuples as ARGV, with
+  times in milliseconds. A negative cache length deletes the cache.
+  Returns the number of events and the size of the event data in each cache.
+
+  Both layouts keep the events in a hash, and index the ids in the sorted
+  set <key>:seq scored by a sequence number from <key>:next, so an update
+  keeps its place and evicting the oldest event does not scan the hash.
+  The size of the event data is kept in <key>:bytes and the arrival times
+  in the sorted set <key>:time. Caches written without them are indexed,
+  counted and given the time of the new event once, and ids missing from
+  the index are evicted in hash order once it runs empty.
+*/
+static const string WRITE_SCRIPT =
+  "local function store(key, index, nextSeq, size, times, id, data, time) "
+  "  local indexed, counted, timed = redis.call('EXISTS', index) == 1, redis.call('EXISTS', size) == 1, redis.call('EXISTS', times) == 1 "
+  "  if not (indexed and counted and timed) then "
+  "    local bytes = 0 "
+  "    for _, old in ipairs(redis.call('HKEYS', key)) do "
+  "      if not indexed then redis.call('ZADD', index, redis.call('INCR', nextSeq), old) end "
+  "      if not timed then redis.call('ZADD', times, time, old) end "
+  "      bytes = bytes + redis.call('HSTRLEN', key, old) "
+  "    end "
+  "    if not counted then redis.call('SET', size, bytes) end "
+  "  end "
+  "  if not redis.call('ZSCORE', index, id) then "
+  "    redis.call('ZADD', index, redis.call('INCR', nextSeq), id) "
+  "  end "
+  "  if not redis.call('ZSCORE', times, id) then "
+  "    local last = redis.call('ZRANGE', times, -1, -1, 'WITHSCORES')[2] "
+  "    redis.call('ZADD', times, math.max(time, tonumber(last) or 0), id) "
+  "  end "
+  "  redis.call('DECRBY', size, redis.call('HSTRLEN', key, id)) "
+  "  redis.call('HSET', key, id, data) "
+  "  redis.call('INCRBY', size, string.len(data)) "
+  "end "
+  "local function remove(key, index, size, times, id) "
+  "  redis.call('DECRBY', size, redis.call('HSTRLEN', key, id)) "
+  "  redis.call('HDEL', key, id) "
+  "  redis.call('ZREM', index, id) "
+  "  redis.call('ZREM', times, id) "
+  "end "
+  "local function oldest(key, index) "
+  "  return redis.call('ZRANGE', index, 0, 0)[1] or redis.call('HKEYS', key)[1] "
+  "end "
+  "local function overBytes(key, size, limit) "
+  "  return limit > 0 and tonumber(redis.call('GET', size)) > limit and redis.call('HLEN', key) > 1 "
+  "end "
+  "local function expired(key, times, maxAge) "
+  "  if maxAge <= 0 or redis.call('HLEN', key) <= 1 then return nil end "
+  "  local newest = redis.call('ZRANGE', times, -1, -1, 'WITHSCORES') "
+  "  local oldest = redis.call('ZRANGE', times, 0, 0, 'WITHSCORES') "
+  "  if tonumber(oldest[2]) + maxAge < tonumber(newest[2]) then return oldest[1] end "
+  "  return nil "
+  "end "
+  "local lens = {} "
+  "for i = 1, #KEYS / 5 do "
+  "  local key, index, nextSeq, size, times = KEYS[i*5-4], KEYS[i*5-3], KEYS[i*5-2], KEYS[i*5-1], KEYS[i*5] "
+  "  local limit, maxBytes, maxAge = tonumber(ARGV[i*6-3]), tonumber(ARGV[i*6-2]), tonumber(ARGV[i*6]) "
+  "  if limit < 0 then "
+  "    redis.call('DEL', key, index, nextSeq, size, times) "
+  "  else "
+  "    store(key, index, nextSeq, size, times, ARGV[i*6-5], ARGV[i*6-4], tonumber(ARGV[i*6-1])) "
+  "    while redis.call('HLEN', key) > limit or overBytes(key, size, maxBytes) do "
+  "      remove(key, index, size, times, oldest(key, index)) "
+  "    end "
+  "    local old = expired(key, times, maxAge) "
+  "    while old do "
+  "      remove(key, index, size, times, old) "
+  "      old = expired(key, times, maxAge) "
+  "    end "
+  "  end "
+  "  lens[#lens + 1] = redis.call('HLEN', key) "
+  "  lens[#lens + 1] = tonumber(redis.call('GET', size)) or 0 "
+  "end "
+  "return lens";
+
+/**
+  Returns the events with the ids in ids as a flat list of ids, arrival
+  times and data. The times are strings, integer replies are 32 bits.
+*/
+static const string READ_SCRIPT_EVENTS =
+  "local events = {} "
+  "for i = 1, #ids, 1000 do "
+  "  local chunk = {unpack(ids, i, math.min(i + 999, #ids))} "
+  "  local data = redis.call('HMGET', KEYS[1], unpack(chunk)) "
+  "  for j, id in ipairs(chunk) do "
+  "    if data[j] then "
+  "      events[#events + 1] = id "
+  "      events[#events + 1] = redis.call('ZSCORE', times, id) or '0' "
+  "      events[#events + 1] = data[j] "
+  "    end "
+  "  end "
+  "end "
+  "return events";
+
+/**
+  Returns the events from the id in ARGV[1], or that arrived at or after
+  the time in ARGV[2], or all events if neither is set.
+  Takes the cache key, <key>:seq and <key>:time as KEYS.
+  With equal arrival times the event with the lowest sequence number is first.
+*/
+static const string READ_SCRIPT_SORTED =
+  "local index, times, ids = KEYS[2], KEYS[3] "
+  "if ARGV[1] ~= '' then "
+  "  local seq = redis.call('ZSCORE', index, ARGV[1]) "
+  "  if not seq then return {} end "
+  "  ids = redis.call('ZRANGEBYSCORE', index, seq, '+inf') "
+  "elseif tonumber(ARGV[2]) > 0 then "
+  "  local first = redis.call('ZRANGEBYSCORE', times, ARGV[2], '+inf', 'WITHSCORES', 'LIMIT', 0, 1) "
+  "  local seq "
+  "  if #first == 0 then return {} end "
+  "  for _, id in ipairs(redis.call('ZRANGEBYSCORE', times, first[2], first[2])) do "
+  "    local s = tonumber(redis.call('ZSCORE', index, id)) "
+  "    if s and (not seq or s < seq) then seq = s end "
+  "  end "
+  "  if not seq then return {} end "
+  "  ids = redis.call('ZRANGEBYSCORE', index, seq, '+inf') "
+  "else "
+  "  ids = redis.call('ZRANGE', index, 0, -1) "
+  "end " + READ_SCRIPT_EVENTS;
+
+/**
+  Returns the events that arrived at or after the time in ARGV[2] in
+  arrival order, or all events in hash order if it is not set.
+  Takes the same KEYS as the sorted read script.
+*/
+static const string READ_SCRIPT_HASH =
+  "local times, ids = KEYS[3] "
+  "if tonumber(ARGV[2]) > 0 then "
+  "  ids = redis.call('ZRANGEBYSCORE', times, ARGV[2], '+inf') "
+  "else "
+  "  ids = redis.call('HKEYS', KEYS[1]) "
+  "end " + READ_SCRIPT_EVENTS;
 
 Redis::Redis(const string key, const ChannelConfig& config) : _config(config) {
-  _host = Lookup(_config.server->GetValue("redis.host"));
-  _port = _config.server->GetValueInt("redis.port");
+  _pool = RedisPool::GetInstance(_config.server);
+  _writer = NULL;
+  _sorted = IsSortedLayout(_config.server);
   _key = _config.server->GetValue("redis.prefix") + "_" + key;
+  _size = -1;
+  _bytes = -1;
+
+  if (_config.server->GetValueBool("redis.writeBehind")) {
+    _writer = RedisWriter::GetInstance(_config.server);
+    _window = RedisWriteWindowPtr(new RedisWriteWindow());
+    _window->size = 0;
+    _window->bytes = 0;
+  }
+}
+
+void Redis::CacheEvent(SSEEvent& event) {
+  const RedisWrite write = MakeWrite(event.GetBuffer());
+
+  if (_writer) {
+    {
+      std::lock_guard<std::mutex> lock(_window->lock);
+      _window->events.push_back(write.buf);
+    }
+
+    // Not going to be written, stop serving it from memory.
+    if (!_writer->Push(write)) {
+      std::lock_guard<std::mutex> lock(_window->lock);
+      if (!_window->events.empty() && _window->events.back() == write.buf) _window->events.pop_back();
+    }
+
+    return;
+  }
 
+  vector<long> lens;
+  vector<long> bytes;
 
-  if (_host.empty()) {
-    LOG(ERROR) << "Failed to look up host for redis adapter " << _config.server->GetValue("redis.host") << " Retrying in 5 seconds.";
+  if (Write(_pool, vector<RedisWrite>(1, write), lens, bytes) == REDIS_WRITE_OK) {
+    _size = lens.front();
+    _bytes = bytes.front();
+  } else {
+    _size = -1;
+    _bytes = -1;
   }
 }
 
-bool Redis::InitClient(RedisSyncClient& client)  {
-  boost::asio::ip::address address;
-  string errmsg;
+/**
+  Add several events to cache.
+  Without the background writer they are written in one round trip.
+  @param events Rendered events.
+*/
+void Redis::CacheEvents(const SSEBufferList& events) {
+  vector<RedisWrite> batch;
+  vector<long> lens;
+  vector<long> bytes;
+
+  if (_writer) {
+    CacheInterface::CacheEvents(events);
+    return;
+  }
+
+  if (events.empty()) return;
 
-  try {
-    address = boost::asio::ip::address::from_string(_host);
-  } catch(const runtime_error& error) {
-    LOG(ERROR) << "Boost address lookup error: " << error.what();
+  BOOST_FOREACH(const SSEBufferPtr& buf, events) {
+    batch.push_back(MakeWrite(buf));
   }
 
-  if(!client.connect(address, _port, errmsg)) {
-    LOG(ERROR) << "Failed to connect to redis: " << errmsg << ". Host: " << _host << " Port: " << _port;
-    return false;
+  if (Write(_pool, batch, lens, bytes) == REDIS_WRITE_OK) {
+    _size = lens.back();
+    _bytes = bytes.back();
+  } else {
+    _size = -1;
+    _bytes = -1;
   }
+}
 
-  return true;
+/**
+  Returns a write storing an event in the cache of this channel.
+  @param buf Rendered event.
+*/
+RedisWrite Redis::MakeWrite(const SSEBufferPtr& buf) {
+  RedisWrite write;
+  write.key = _key;
+  write.buf = buf;
+  write.cacheLength = _config.cacheLength;
+  write.cacheBytes = _config.cacheBytes;
+  write.cacheMaxAge = _config.cacheMaxAge;
+  write.window = _window;
+  return write;
 }
 
-void Redis::CacheEvent(SSEEvent& event) {
-  RedisValue result;
-  boost::asio::io_service ioService;
-  RedisSyncClient client(ioService);
+/**
+  Get all cached events since a given id, including the event with that id.
+  @param lastId Id of the first event.
+*/
+SSEBufferList Redis::GetEventsSinceId(string lastId) {
+  SSEBufferList events = ReadEvents(lastId, 0);
+  SSEBufferList::iterator it = events.begin();
 
-  if (!InitClient(client)) {
-    return;
+  while (it != events.end() && (*it)->GetId() != lastId) it++;
+
+  return SSEBufferList(it, events.end());
+}
+
+/**
+  Get all cached events.
+*/
+SSEBufferList Redis::GetAllEvents() {
+  return ReadEvents("", 0);
+}
+
+/**
+  Get the cached events that arrived at or after a point in time.
+  @param time Milliseconds since the epoch.
+*/
+SSEBufferList Redis::GetEventsSinceTime(uint64_t time) {
+  return ReadEvents("", time);
+}
+
+/**
+  Read events from redis.
+  With write-behind, events not yet written to redis are served from the
+  window, those that arrived before the time are left out.
+  @param since Read from this id with the sorted layout, empty to read all events.
+  @param time Read the events that arrived at or after this time, 0 to read all events.
+*/
+SSEBufferList Redis::ReadEvents(const string& since, uint64_t time) {
+  SSEBufferList pending;
+
+  if (_writer) {
+    // Copy the window before fetching, so an event written meanwhile shows up in either.
+    std::lock_guard<std::mutex> lock(_window->lock);
+    pending = _window->events;
   }
 
-  try {
-    result = client.command("HSET", _key, event.getid(), event.get());
-    if (result.isError()) {
-      LOG(ERROR) << "SET error: " << result.toString();
-    }
+  SSEBufferList events = FetchEvents(since, time);
+  SSEBufferList::iterator it = pending.begin();
 
-    result = client.command("HLEN", _key);
-    if (result.isError()) {
-      LOG(ERROR) << "HLEN error" << result.toString();
+  while (it != pending.end()) {
+    if ((*it)->GetTime() < time) {
+      it = pending.erase(it);
+    } else {
+      it++;
     }
-    if (result.isOk()) {
-      if ((size_t)result.toInt() > _config.cacheLength) {
-        result = client.command("HKEYS", _key);
-        if (result.isError()) {
-          LOG(ERROR) << "HKEYS error: " << result.toString();
-        }
-        if (result.isOk()) {
-          client.command("HDEL", _key, result.toArray().front().toString());
-        }
-      }
+  }
+
+  if (pending.empty()) return events;
+
+  set<string> pendingIds;
+  BOOST_FOREACH(const SSEBufferPtr& event, pending) {
+    pendingIds.insert(event->GetId());
+  }
+
+  it = events.begin();
+  while (it != events.end()) {
+    if (pendingIds.count((*it)->GetId())) {
+      it = events.erase(it);
+    } else {
+      it++;
     }
-  } catch (const runtime_error& error) {
-    LOG(ERROR) << "Redis::CacheEvent: " << error.what();
   }
-}
 
-deque<string> Redis::GetEventsSinceId(string lastId) {
-  deque<string> events;
-  RedisValue result;
-  boost::asio::io_service ioService;
-  RedisSyncClient client(ioService);
+  events.insert(events.end(), pending.begin(), pending.end());
 
-  if (!InitClient(client)) {
-    return events;
+  size_t bytes = 0;
+  BOOST_FOREACH(const SSEBufferPtr& event, events) {
+    bytes += event->GetLength();
   }
 
-  try {
-    result = client.command("HGETALL", _key);
-  } catch (const runtime_error& error) {
-    LOG(ERROR) << "Redis::GetEventsSinceId: " << error.what();
+  while (events.size() > _config.cacheLength ||
+      (_config.cacheBytes > 0 && bytes > _config.cacheBytes && events.size() > 1)) {
+    bytes -= events.front()->GetLength();
+    events.pop_front();
   }
 
-  if (result.isError()) {
-    LOG(ERROR) << "GET error: " << result.toString();
+  return events;
+}
+
+/**
+  Fetch the events stored in redis.
+  The hash layout returns all events when reading from an id.
+  @param since Fetch from this id with the sorted layout, empty to fetch all events.
+  @param time Fetch the events that arrived at or after this time, 0 to fetch all events.
+*/
+SSEBufferList Redis::FetchEvents(const string& since, uint64_t time) {
+  RedisValue result;
+  SSEBufferList events;
+  list<string> args;
+
+  args.push_back(_sorted ? READ_SCRIPT_SORTED : READ_SCRIPT_HASH);
+  args.push_back("3");
+  args.push_back(_key);
+  args.push_back(_key + ":seq");
+  args.push_back(_key + ":time");
+  args.push_back(since);
+  args.push_back(boost::lexical_cast<string>(time));
+
+  if (!_pool->Command("EVAL", args, result)) {
+    return events;
   }
 
   if (result.isOk() && result.isArray()) {
-    std::vector<RedisValue> resultArray = result.toArray();
-
-    bool isId = true;
-    bool ignoreEvent = true;
-    BOOST_FOREACH(const RedisValue& value, resultArray) {
-      if (value.isString() && value.toString().length() > 0) {
-        if (isId) {
-          if (value.toString().compare(lastId) == 0) {
-            ignoreEvent = false;
-          }
-        } else if (!ignoreEvent){
-          events.push_back(value.toString());
-        }
-
-        isId = !isId;
-      }
+    std::vector<RedisValue> values = result.toArray();
+
+    for (size_t i = 0; i + 2 < values.size(); i += 3) {
+      if (!values[i].isString() || !values[i + 2].isString()) continue;
+
+      uint64_t eventTime = strtoull(values[i + 1].toString().c_str(), NULL, 10);
+      events.push_back(SSEBufferPtr(new SSEBuffer(values[i + 2].toString(), values[i].toString(), eventTime)));
     }
   }
 
   return events;
 }
 
-deque<string> Redis::GetAllEvents() {
+/**
+  Returns the number of cached events.
+  Uses the count returned when the last event was written, so only the
+  first call (or the first after an error) asks redis.
+*/
+size_t Redis::GetSizeOfCachedEvents() {
   RedisValue result;
-  deque<string> events;
-  boost::asio::io_service ioService;
-  RedisSyncClient client(ioService);
 
-  if (!InitClient(client)) {
-    return events;
+  if (_size < 0 && _pool->Command("HLEN", list<string>(1, _key), result) && result.isOk() && result.isInt()) {
+    _size = result.toInt();
+
+    if (_writer) {
+      std::lock_guard<std::mutex> lock(_window->lock);
+      _window->size = _size;
+    }
   }
 
-  try {
-    result = client.command("HGETALL", _key);
-  } catch (const runtime_error& error) {
-    LOG(ERROR) << "Redis::GetEventsSinceId: " << error.what();
+  if (_size < 0) return 0;
+  if (!_writer) return _size;
+
+  // Events in the window may replace events in redis, so this is an upper bound.
+  std::lock_guard<std::mutex> lock(_window->lock);
+  return std::min<size_t>(_window->size + _window->events.size(), _config.cacheLength);
+}
+
+/**
+  Returns the size of the cached event data.
+  Like the number of events, it is only asked from redis when not known.
+*/
+size_t Redis::GetCachedBytes() {
+  RedisValue result;
+
+  if (_bytes < 0 && _pool->Command("GET", list<string>(1, _key + ":bytes"), result) && result.isOk()) {
+    _bytes = result.isString() ? strtol(result.toString().c_str(), NULL, 10) : 0;
+
+    if (_writer) {
+      std::lock_guard<std::mutex> lock(_window->lock);
+      _window->bytes = _bytes;
+    }
   }
 
-  if (result.isError()) {
-    LOG(ERROR) << "GET error: " << result.toString();
+  if (_bytes < 0) return 0;
+  if (!_writer) return _bytes;
+
+  // Upper bound, like the number of events.
+  std::lock_guard<std::mutex> lock(_window->lock);
+  size_t bytes = _window->bytes;
+
+  BOOST_FOREACH(const SSEBufferPtr& event, _window->events) {
+    bytes += event->GetLength();
   }
 
-  if (result.isOk() && result.isArray()) {
-    std::vector<RedisValue> resultArray = result.toArray();
-
-    bool isId = true;
-    BOOST_FOREACH(const RedisValue& value, resultArray) {
-      if (value.isString() && value.toString().length() > 0) {
-        if (!isId) {
-          string data = value.toString();
-          events.push_back(data);
-        }
-
-        isId = !isId;
-      }
+  return bytes;
+}
+
+void Redis::Purge() {
+  RedisWrite write;
+  write.key = _key;
+  write.window = _window;
+
+  if (_writer) {
+    {
+      std::lock_guard<std::mutex> lock(_window->lock);
+      _window->events.clear();
     }
+
+    // Queued behind the pending writes so they can not recreate the key.
+    _writer->Push(write);
+    return;
   }
 
-  return events;
+  vector<long> lens;
+  vector<long> bytes;
+  Write(_pool, vector<RedisWrite>(1, write), lens, bytes);
+  _size = -1;
+  _bytes = -1;
 }
 
-size_t Redis::GetSizeOfCachedEvents() {
-  size_t size = 0;
+/**
+  Write a batch of events to redis in one round trip.
+  @param pool Connection pool to use.
+  @param batch Writes to send, a NULL buffer deletes the cache.
+  @param lens Set to the number of events in the cache of each write.
+  @param bytes Set to the size of the event data in the cache of each write.
+  @returns REDIS_WRITE_RETRY if redis could not be reached, REDIS_WRITE_FAILED if it replied with an error.
+*/
+RedisWriteStatus Redis::Write(RedisPool* pool, const vector<RedisWrite>& batch, vector<long>& lens, vector<long>& bytes) {
+  list<string> args;
   RedisValue result;
-  boost::asio::io_service ioService;
-  RedisSyncClient client(ioService);
 
-  if (!InitClient(client)) {
-    return size;
-  }
+  args.push_back(WRITE_SCRIPT);
+  args.push_back(boost::lexical_cast<string>(batch.size() * 5));
 
-  try {
-    result = client.command("HLEN", _key);
-  } catch (const runtime_error& error) {
-    LOG(ERROR) << "Redis::GetEventsSinceId: " << error.what();
+  BOOST_FOREACH(const RedisWrite& write, batch) {
+    args.push_back(write.key);
+    args.push_back(write.key + ":seq");
+    args.push_back(write.key + ":next");
+    args.push_back(write.key + ":bytes");
+    args.push_back(write.key + ":time");
   }
 
-  if (result.isError()) {
-    LOG(ERROR) << "GET error: " << result.toString();
+  BOOST_FOREACH(const RedisWrite& write, batch) {
+    if (write.buf) {
+      args.push_back(write.buf->GetId());
+      args.push_back(write.buf->GetData());
+      args.push_back(boost::lexical_cast<string>(write.cacheLength));
+      args.push_back(boost::lexical_cast<string>(write.cacheBytes));
+      args.push_back(boost::lexical_cast<string>(write.buf->GetTime()));
+      args.push_back(boost::lexical_cast<string>(write.cacheMaxAge * 1000));
+    } else {
+      args.push_back("");
+      args.push_back("");
+      args.push_back("-1");
+      args.push_back("0");
+      args.push_back("0");
+      args.push_back("0");
+    }
   }
 
-  if (result.isOk()) {
-    size = result.toInt();
+  if (!pool->Command("EVAL", args, result)) {
+    return REDIS_WRITE_RETRY;
   }
 
-  return size;
-}
+  if (!result.isOk() || !result.isArray()) {
+    return REDIS_WRITE_FAILED;
+  }
 
-string Redis::Lookup(string hostname) {
-  hostent * record = gethostbyname(hostname.c_str());
+  lens.clear();
+  bytes.clear();
 
-  if(record == NULL) {
-    return "";
+  std::vector<RedisValue> values = result.toArray();
+  for (size_t i = 0; i + 1 < values.size(); i += 2) {
+    lens.push_back(values[i].toInt());
+    bytes.push_back(values[i + 1].toInt());
   }
 
-  in_addr * address = (in_addr * )record->h_addr;
-  string ip_address = inet_ntoa(* address);
+  return (lens.size() == batch.size()) ? REDIS_WRITE_OK : REDIS_WRITE_FAILED;
+}
+
+/**
+  Returns true if redis.layout selects the sorted layout.
+  @param config Server configuration.
+*/
+bool Redis::IsSortedLayout(SSEConfig* config) {
+  const string layout = config->GetValue("redis.layout");
+
+  if (layout == "sorted") return true;
+  if (layout != "hash") LOG(FATAL) << "Invalid redis.layout " << layout << ", must be hash or sorted.";
 
-  return ip_address;
+  return false;
 }
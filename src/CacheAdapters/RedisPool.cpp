@@ -0,0 +1,125 @@
+#include "Common.h"
+#include "CacheAdapters/RedisPool.h"
+#include "SSEConfig.h"
+#include <netdb.h>
+#include <arpa/inet.h>
+#include <boost/asio/ip/address.hpp>
+
+using namespace std;
+
+/**
+  Returns the pool, creating it on the first call.
+  @param config Server configuration.
+*/
+RedisPool* RedisPool::GetInstance(SSEConfig* config) {
+  static std::mutex instanceLock;
+  static RedisPool* instance = NULL;
+
+  std::lock_guard<std::mutex> lock(instanceLock);
+  if (!instance) instance = new RedisPool(config);
+
+  return instance;
+}
+
+RedisPool::RedisPool(SSEConfig* config) {
+  _host     = config->GetValue("redis.host");
+  _port     = config->GetValueInt("redis.port");
+  _max_idle = config->GetValueInt("redis.poolSize");
+}
+
+/**
+  Run a command on a pooled connection.
+  Returns false if the command could not be sent or the connection failed.
+  @param cmd Redis command.
+  @param args Command arguments.
+  @param result Reply from redis.
+*/
+bool RedisPool::Command(const string& cmd, const list<string>& args, RedisValue& result) {
+  RedisConnectionPtr conn = Acquire();
+
+  if (!conn) return false;
+
+  try {
+    result = conn->client.command(cmd, args);
+  } catch (const runtime_error& error) {
+    // The connection is in an unknown state, let it go.
+    LOG(ERROR) << "Redis " << cmd << " failed: " << error.what();
+    return false;
+  }
+
+  Release(conn);
+
+  if (result.isError()) {
+    LOG(ERROR) << "Redis " << cmd << " error: " << result.toString();
+  }
+
+  return true;
+}
+
+/**
+  Returns an idle connection, or a new one if there are none.
+*/
+RedisConnectionPtr RedisPool::Acquire() {
+  boost::asio::ip::address address;
+  string errmsg;
+  string ip;
+
+  {
+    std::lock_guard<std::mutex> lock(_lock);
+
+    if (!_idle.empty()) {
+      RedisConnectionPtr conn = _idle.front();
+      _idle.pop_front();
+      return conn;
+    }
+
+    // gethostbyname is not reentrant.
+    ip = Lookup(_host);
+  }
+
+  if (ip.empty()) {
+    LOG(ERROR) << "Failed to look up host for redis adapter " << _host;
+    return RedisConnectionPtr();
+  }
+
+  try {
+    address = boost::asio::ip::address::from_string(ip);
+  } catch(const runtime_error& error) {
+    LOG(ERROR) << "Boost address lookup error: " << error.what();
+    return RedisConnectionPtr();
+  }
+
+  RedisConnectionPtr conn(new RedisConnection());
+
+  if (!conn->client.connect(address, _port, errmsg)) {
+    LOG(ERROR) << "Failed to connect to redis: " << errmsg << ". Host: " << _host << " Port: " << _port;
+    return RedisConnectionPtr();
+  }
+
+  return conn;
+}
+
+/**
+  Return a healthy connection to the pool, or close it if enough are idle.
+  @param conn Connection to return.
+*/
+void RedisPool::Release(const RedisConnectionPtr& conn) {
+  std::lock_guard<std::mutex> lock(_lock);
+
+  if (_idle.size() < _max_idle) {
+    _idle.push_back(conn);
+  }
+}
+
+string RedisPool::Lookup(const string& hostname) {
+  hostent * record = gethostbyname(hostname.c_str());
+
+  if(record == NULL) {
+    return "";
+  }
+
+  in_addr * address = (in_addr * )record->h_addr;
+  string ip_address = inet_ntoa(* address);
+
+  return ip_address;
+}
@@ -0,0 +1,109 @@
+#include "Common.h"
+#include "CacheAdapters/RedisWriter.h"
+#include "CacheAdapters/RedisPool.h"
+#include "CacheAdapters/Redis.h"
+#include "SSEConfig.h"
+#include <boost/foreach.hpp>
+
+#define REDIS_WRITE_BATCH 64
+#define REDIS_RETRY_INTERVAL 1
+#define REDIS_PUSH_TIMEOUT 5
+
+using namespace std;
+
+/**
+  Returns the writer, starting it on the first call.
+  @param config Server configuration.
+*/
+RedisWriter* RedisWriter::GetInstance(SSEConfig* config) {
+  static std::mutex instanceLock;
+  static RedisWriter* instance = NULL;
+
+  std::lock_guard<std::mutex> lock(instanceLock);
+  if (!instance) instance = new RedisWriter(config);
+
+  return instance;
+}
+
+RedisWriter::RedisWriter(SSEConfig* config) : WriteBehind<RedisWrite>(config->GetValueInt("redis.writeQueueSize"), REDIS_WRITE_BATCH) {
+  _pool = RedisPool::GetInstance(config);
+  Start();
+}
+
+/**
+  Queue a write, waiting for room if the queue is full.
+  @param write Write to queue.
+  @returns false if the queue stayed full for REDIS_PUSH_TIMEOUT seconds and the write was dropped.
+*/
+bool RedisWriter::Push(const RedisWrite& write) {
+  if (Enqueue(write, REDIS_PUSH_TIMEOUT)) return true;
+
+  LOG(ERROR) << "Redis write queue full, dropping write for " << write.key;
+  return false;
+}
+
+/**
+  Write a batch to redis and remove its events from the windows.
+  @param batch Writes to send.
+*/
+void RedisWriter::Write(const vector<RedisWrite>& batch) {
+  Send(batch);
+
+  // The events are in redis now, or dropped, remove them from the windows.
+  BOOST_FOREACH(const RedisWrite& write, batch) {
+    if (!write.buf) continue;
+
+    std::lock_guard<std::mutex> lock(write.window->lock);
+    if (!write.window->events.empty() && write.window->events.front() == write.buf) {
+      write.window->events.pop_front();
+    }
+  }
+}
+
+/**
+  Write a batch to redis, retrying until redis is reachable.
+  If redis replies with an error the writes are retried one by one, and
+  the writes redis refuses are dropped, so they can not hold up the queue.
+  @param batch Writes to send.
+*/
+void RedisWriter::Send(const vector<RedisWrite>& batch) {
+  RedisWriteStatus status;
+
+  while ((status = Flush(batch)) == REDIS_WRITE_RETRY) {
+    boost::this_thread::sleep(boost::posix_time::seconds(REDIS_RETRY_INTERVAL));
+  }
+
+  if (status == REDIS_WRITE_OK) return;
+
+  if (batch.size() == 1) {
+    LOG(ERROR) << "Redis refused write for " << batch.front().key << ", dropping it.";
+    return;
+  }
+
+  BOOST_FOREACH(const RedisWrite& write, batch) {
+    Send(vector<RedisWrite>(1, write));
+  }
+}
+
+/**
+  Write a batch to redis in one round trip.
+  Also updates the number and size of events stored in redis for each window.
+  @param batch Writes to send.
+*/
+RedisWriteStatus RedisWriter::Flush(const vector<RedisWrite>& batch) {
+  vector<long> lens;
+  vector<long> bytes;
+  RedisWriteStatus status = Redis::Write(_pool, batch, lens, bytes);
+
+  if (status != REDIS_WRITE_OK) {
+    return status;
+  }
+
+  for (size_t i = 0; i < batch.size(); i++) {
+    std::lock_guard<std::mutex> lock(batch[i].window->lock);
+    batch[i].window->size = lens[i];
+    batch[i].window->bytes = bytes[i];
+  }
+
+  return REDIS_WRITE_OK;
+}
@@ -0,0 +1,263 @@
+#include "Common.h"
+#include "CacheAdapters/Ring.h"
+#include "SSEConfig.h"
+#include "SSEEvent.h"
+#include <functional>
+#include <boost/make_shared.hpp>
+
+#define RING_INDEX_EMPTY UINT64_MAX
+
+using namespace std;
+
+static size_t HashId(const string& id) {
+  return std::hash<string>()(id);
+}
+
+Ring::Ring(const ChannelConfig& config) : _config(config) {
+  Purge();
+}
+
+/**
+  Add a event to the cache.
+  An update to an event already in the cache replaces it in place so the
+  order is kept, otherwise the oldest event is evicted when the ring is full.
+  @param event Event to cache.
+*/
+void Ring::CacheEvent(SSEEvent& event) {
+  if (_ring.empty()) return;
+
+  const string& id = event.getid();
+  SSEBufferPtr buf = event.GetBuffer();
+  std::lock_guard<std::mutex> lock(_index_lock);
+  size_t bucket = FindBucket(id);
+
+  if (_index[bucket] != RING_INDEX_EMPTY) {
+    uint64_t seq = _index[bucket];
+    RingEntryPtr& slot = _ring[seq % _ring.size()];
+    _bytes = _bytes - slot->buf->GetLength() + buf->GetLength();
+    boost::atomic_store(&slot, boost::make_shared<const RingEntry>(seq, WithTime(buf, slot->buf->GetTime())));
+    Evict();
+    return;
+  }
+
+  uint64_t seq = _tail;
+  RingEntryPtr& slot = _ring[seq % _ring.size()];
+
+  if (_tail > _head) {
+    buf = WithTime(buf, std::max(buf->GetTime(), GetNewestTime()));
+  }
+
+  // Slots of events evicted by size are already empty.
+  if (slot) {
+    EraseIndex(slot->buf->GetId());
+    _bytes -= slot->buf->GetLength();
+    _head = seq - _ring.size() + 1;
+  }
+
+  boost::atomic_store(&slot, boost::make_shared<const RingEntry>(seq, buf));
+  _index[FindBucket(id)] = seq;
+  _bytes += buf->GetLength();
+  _tail = seq + 1;
+  Evict();
+}
+
+/**
+  Evict the oldest events while cacheBytes is exceeded or they are past
+  cacheMaxAge, keeping the newest one.
+  Must be called with the index lock held.
+*/
+void Ring::Evict() {
+  if (_config.cacheBytes == 0 && _config.cacheMaxAge == 0) return;
+
+  uint64_t now = GetNewestTime();
+
+  while (_tail - _head > 1) {
+    RingEntryPtr& slot = _ring[_head % _ring.size()];
+
+    if (!(_config.cacheBytes > 0 && _bytes > _config.cacheBytes) &&
+        !IsExpired(slot->buf->GetTime(), now, _config.cacheMaxAge)) break;
+
+    EraseIndex(slot->buf->GetId());
+    _bytes -= slot->buf->GetLength();
+    boost::atomic_store(&slot, RingEntryPtr());
+    _head++;
+  }
+}
+
+SSEBufferList Ring::GetEventsSinceId(string lastId) {
+  uint64_t seq;
+
+  if (_ring.empty()) return SSEBufferList();
+
+  {
+    std::lock_guard<std::mutex> lock(_index_lock);
+    seq = _index[FindBucket(lastId)];
+  }
+
+  if (seq == RING_INDEX_EMPTY) return SSEBufferList();
+
+  return GetEventsFrom(seq, false);
+}
+
+SSEBufferList Ring::GetAllEvents() {
+  return GetEventsFrom(_head, true);
+}
+
+/**
+  Binary searches the arrival times, they never decrease from head to tail.
+*/
+SSEBufferList Ring::GetEventsSinceTime(uint64_t time) {
+  uint64_t seq;
+
+  if (_ring.empty()) return SSEBufferList();
+
+  {
+    std::lock_guard<std::mutex> lock(_index_lock);
+    uint64_t end = _tail;
+    seq = _head;
+
+    while (seq < end) {
+      uint64_t mid = seq + (end - seq) / 2;
+
+      if (_ring[mid % _ring.size()]->buf->GetTime() < time) {
+        seq = mid + 1;
+      } else {
+        end = mid;
+      }
+    }
+  }
+
+  return GetEventsFrom(seq, true);
+}
+
+size_t Ring::GetSizeOfCachedEvents() {
+  uint64_t head = _head;
+  return _tail - head;
+}
+
+size_t Ring::GetCachedBytes() {
+  return _bytes;
+}
+
+/**
+  All events are held in memory.
+*/
+size_t Ring::GetMemoryBytes() {
+  return _bytes;
+}
+
+/**
+  All events are held in memory, so they are all dropped.
+*/
+void Ring::ReleaseMemory() {
+  Purge();
+}
+
+/**
+  Allocates the ring and an index twice its size, so the index never needs to grow.
+*/
+void Ring::Purge() {
+  size_t indexSize = 16;
+  while (indexSize < _config.cacheLength * 2) indexSize *= 2;
+
+  _ring.assign(_config.cacheLength, RingEntryPtr());
+  _index.assign(indexSize, RING_INDEX_EMPTY);
+  _head = 0;
+  _tail = 0;
+  _bytes = 0;
+}
+
+/**
+  Returns the cached events from a sequence number up to the newest one.
+  Events are evicted from the head, so when the publisher evicts an event
+  while we read, the events read before it are gone as well.
+  @param seq Sequence number of the first event.
+  @param restart Continue from the oldest cached event when that happens,
+    otherwise return nothing, as if the first event was evicted before the call.
+*/
+SSEBufferList Ring::GetEventsFrom(uint64_t seq, bool restart) {
+  SSEBufferList events;
+  uint64_t tail = _tail;
+
+  while (seq < tail) {
+    RingEntryPtr entry = GetEntry(seq);
+
+    if (entry) {
+      events.push_back(entry->buf);
+      seq++;
+      continue;
+    }
+
+    if (!restart) return SSEBufferList();
+
+    events.clear();
+    seq = std::max(seq + 1, (uint64_t)_head);
+    tail = _tail;
+  }
+
+  return events;
+}
+
+/**
+  Returns the arrival time of the newest event.
+  Must be called with the index lock held and the ring not empty.
+*/
+uint64_t Ring::GetNewestTime() {
+  return _ring[(_tail - 1) % _ring.size()]->buf->GetTime();
+}
+
+/**
+  Returns the entry with a sequence number, or NULL if it has been evicted.
+  @param seq Sequence number.
+*/
+RingEntryPtr Ring::GetEntry(uint64_t seq) {
+  RingEntryPtr entry = boost::atomic_load(&_ring[seq % _ring.size()]);
+
+  if (!entry || entry->seq != seq) return RingEntryPtr();
+
+  return entry;
+}
+
+/**
+  Returns the index bucket holding the id, or the empty bucket where it would be inserted.
+  Must be called with the index lock held.
+  @param id Event id.
+*/
+size_t Ring::FindBucket(const string& id) {
+  size_t mask = _index.size() - 1;
+  size_t i = HashId(id) & mask;
+
+  while (_index[i] != RING_INDEX_EMPTY && _ring[_index[i] % _ring.size()]->buf->GetId() != id) {
+    i = (i + 1) & mask;
+  }
+
+  return i;
+}
+
+/**
+  Remove an id from the index.
+  Uses backward shift deletion so lookups never need tombstones.
+  Must be called with the index lock held.
+  @param id Event id.
+*/
+void Ring::EraseIndex(const string& id) {
+  size_t mask = _index.size() - 1;
+  size_t i = FindBucket(id);
+  size_t j = i;
+
+  if (_index[i] == RING_INDEX_EMPTY) return;
+
+  for (;;) {
+    j = (j + 1) & mask;
+    if (_index[j] == RING_INDEX_EMPTY) break;
+
+    // Move the entry at j into the hole at i unless its home bucket lies cyclically in (i, j].
+    size_t k = HashId(_ring[_index[j] % _ring.size()]->buf->GetId()) & mask;
+    if ((i < j) ? (k <= i || k > j) : (k <= i && k > j)) {
+      _index[i] = _index[j];
+      i = j;
+    }
+  }
+
+  _index[i] = RING_INDEX_EMPTY;
+}
@@ -0,0 +1,673 @@
+#include "Common.h"
+#include "CacheAdapters/SegmentLog.h"
+#include "SSEConfig.h"
+#include "SSEEvent.h"
+#include <algorithm>
+#include <fstream>
+#include <cstring>
+#include <cstdio>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <boost/foreach.hpp>
+
+using namespace std;
+
+/**
+  Constructor.
+  @param path Path of the segment without extension.
+  @param firstSeq Sequence number of the first event in the segment.
+*/
+LogSegment::LogSegment(const string& path, uint64_t firstSeq) :
+  _path(path), _fd(-1), _write_fd(-1), _time_fd(-1), _map(NULL), _mapped(0), _capacity(0), _size(0), _first_seq(firstSeq) {}
+
+LogSegment::~LogSegment() {
+  if (_map) munmap(_map, _mapped);
+  if (_fd != -1) close(_fd);
+  if (_write_fd != -1) close(_write_fd);
+  if (_time_fd != -1) close(_time_fd);
+}
+
+/**
+  Open the segment file and map it.
+  A writable segment is created if missing, its time file is opened and
+  the mapping reserves the whole capacity, the file grows into it.
+  @param capacity Bytes to reserve for a writable segment.
+  @param writable Open the segment for appending.
+*/
+bool LogSegment::Open(size_t capacity, bool writable) {
+  struct stat st;
+
+  if (writable) {
+    _write_fd = open((_path + ".seg").c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+
+    if (_write_fd == -1) {
+      LOG(ERROR) << "Failed to open segment " << _path << ".seg: " << strerror(errno);
+      return false;
+    }
+
+    _time_fd = open((_path + ".tim").c_str(), O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+
+    if (_time_fd == -1) {
+      LOG(ERROR) << "Failed to open segment " << _path << ".tim: " << strerror(errno);
+      return false;
+    }
+  }
+
+  _fd = open((_path + ".seg").c_str(), O_RDONLY | O_CLOEXEC);
+
+  if (_fd == -1 || fstat(_fd, &st) == -1) {
+    LOG(ERROR) << "Failed to open segment " << _path << ".seg: " << strerror(errno);
+    return false;
+  }
+
+  _size = st.st_size;
+  _capacity = writable ? std::max<size_t>(capacity, _size) : _size;
+
+  // An empty sealed segment has nothing to map.
+  if (_capacity == 0) return true;
+
+  _map = (char*)mmap(NULL, _capacity, PROT_READ, MAP_SHARED, _fd, 0);
+
+  if (_map == MAP_FAILED) {
+    LOG(ERROR) << "Failed to map segment " << _path << ".seg: " << strerror(errno);
+    _map = NULL;
+    return false;
+  }
+
+  _mapped = _capacity;
+
+  return true;
+}
+
+/**
+  Truncate the segment file, dropping a partially written frame.
+  @param size New size of the segment.
+*/
+bool LogSegment::Truncate(uint64_t size) {
+  int ret = (_write_fd != -1) ? ftruncate(_write_fd, size) : truncate((_path + ".seg").c_str(), size);
+
+  if (ret == -1) {
+    LOG(ERROR) << "Failed to truncate segment " << _path << ".seg: " << strerror(errno);
+    return false;
+  }
+
+  return true;
+}
+
+/**
+  Append a frame to the segment file, and its arrival time to the time file.
+  The caller adds it to the events once written.
+  @param buf Frame to append.
+  @param time Arrival time of the event.
+*/
+bool LogSegment::Append(const SSEBufferPtr& buf, uint64_t time) {
+  size_t written = 0;
+
+  if (_write_fd == -1 || _size + buf->GetLength() > _capacity) return false;
+
+  while (written < buf->GetLength()) {
+    ssize_t ret = write(_write_fd, buf->GetPtr() + written, buf->GetLength() - written);
+
+    if (ret == -1 && errno == EINTR) continue;
+
+    if (ret <= 0) {
+      LOG(ERROR) << "Failed to write to segment " << _path << ".seg: " << strerror(errno);
+      Truncate(_size);
+      return false;
+    }
+
+    written += ret;
+  }
+
+  if (write(_time_fd, &time, sizeof(time)) != sizeof(time)) {
+    LOG(ERROR) << "Failed to write to segment " << _path << ".tim: " << strerror(errno);
+    Truncate(_size);
+    if (ftruncate(_time_fd, events.size() * sizeof(time)) == -1) LOG(ERROR) << "Failed to truncate segment " << _path << ".tim";
+    return false;
+  }
+
+  _size += written;
+
+  return true;
+}
+
+/**
+  Rebuild the events by scanning the frames in the segment.
+  A partially written frame at the end is truncated away.
+*/
+bool LogSegment::Recover() {
+  uint64_t pos = 0;
+
+  events.clear();
+
+  while (pos < _size) {
+    const char* frame = _map + pos;
+    const char* end = (const char*)memmem(frame, _size - pos, "\n\n", 2);
+
+    if (!end) break;
+
+    SegmentEvent event;
+    event.offset = pos;
+    event.length = end + 2 - frame;
+
+    if (event.length > 4 && memcmp(frame, "id: ", 4) == 0) {
+      const char* eol = (const char*)memchr(frame + 4, '\n', event.length - 4);
+      event.id.assign(frame + 4, eol - frame - 4);
+    }
+
+    events.push_back(event);
+    pos += event.length;
+  }
+
+  if (pos < _size) {
+    LOG(WARNING) << "Truncating " << (_size - pos) << " bytes of partial event from segment " << _path << ".seg";
+    if (!Truncate(pos)) return false;
+    _size = pos;
+  }
+
+  return true;
+}
+
+/**
+  Load the events from the index file written when the segment was sealed.
+*/
+bool LogSegment::LoadIndex() {
+  ifstream idx((_path + ".idx").c_str(), ios::binary);
+  uint64_t end = 0;
+
+  if (!idx) return false;
+
+  events.clear();
+
+  for (;;) {
+    SegmentEvent event;
+    uint32_t idlen;
+
+    if (!idx.read((char*)&event.offset, sizeof(event.offset))) break;
+    if (!idx.read((char*)&event.length, sizeof(event.length))) return false;
+    if (!idx.read((char*)&idlen, sizeof(idlen))) return false;
+
+    event.id.resize(idlen);
+    if (idlen > 0 && !idx.read(&event.id[0], idlen)) return false;
+
+    end = event.offset + event.length;
+    if (end > _size) return false;
+
+    events.push_back(event);
+  }
+
+  return end == _size;
+}
+
+/**
+  Load the arrival times of the events from the time file.
+  Events without one, e.g. when the write was interrupted, get the time
+  the segment was last written, and the time file is made to match the events.
+  The time file of a sealed segment is only open while loading.
+*/
+void LogSegment::LoadTimes() {
+  struct stat st;
+  size_t count = 0;
+  uint64_t fallback = 0;
+  int fd = _time_fd;
+
+  if (fd == -1) fd = open((_path + ".tim").c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+
+  if (fd != -1 && fstat(fd, &st) == 0) count = std::min<size_t>(st.st_size / sizeof(uint64_t), events.size());
+  if (fstat(_fd, &st) == 0) fallback = (uint64_t)st.st_mtime * 1000;
+
+  for (size_t i = 0; i < events.size(); i++) {
+    if (i >= count || pread(fd, &events[i].time, sizeof(uint64_t), i * sizeof(uint64_t)) != sizeof(uint64_t)) {
+      events[i].time = fallback;
+    }
+  }
+
+  if (fd == -1 || ftruncate(fd, count * sizeof(uint64_t)) == -1) {
+    LOG(ERROR) << "Failed to truncate segment " << _path << ".tim: " << strerror(errno);
+  } else if (count < events.size()) {
+    for (size_t i = count; i < events.size(); i++) {
+      if (pwrite(fd, &events[i].time, sizeof(uint64_t), i * sizeof(uint64_t)) != sizeof(uint64_t)) {
+        LOG(ERROR) << "Failed to write to segment " << _path << ".tim: " << strerror(errno);
+        break;
+      }
+    }
+  }
+
+  if (fd != -1 && fd != _time_fd) close(fd);
+}
+
+/**
+  Write the index file, the segment is not appended to afterwards.
+  Closes the files only needed for appending, and unmaps the reserved
+  capacity beyond the last whole page in use.
+*/
+void LogSegment::Seal() {
+  const string tmp = _path + ".idx.tmp";
+  ofstream idx(tmp.c_str(), ios::binary | ios::trunc);
+
+  BOOST_FOREACH(const SegmentEvent& event, events) {
+    uint32_t idlen = event.id.length();
+    idx.write((const char*)&event.offset, sizeof(event.offset));
+    idx.write((const char*)&event.length, sizeof(event.length));
+    idx.write((const char*)&idlen, sizeof(idlen));
+    idx.write(event.id.data(), idlen);
+  }
+
+  idx.close();
+
+  if (!idx || rename(tmp.c_str(), (_path + ".idx").c_str()) == -1) {
+    LOG(ERROR) << "Failed to write segment index " << _path << ".idx";
+    unlink(tmp.c_str());
+  }
+
+  if (_write_fd != -1) close(_write_fd);
+  if (_time_fd != -1) close(_time_fd);
+  _write_fd = -1;
+  _time_fd = -1;
+
+  // Readers never look past the size, so the unused pages can go.
+  size_t page = sysconf(_SC_PAGESIZE);
+  size_t used = (_size + page - 1) / page * page;
+
+  if (_map && used < _mapped && munmap(_map + used, _mapped - used) == 0) {
+    _mapped = used;
+  }
+
+  _capacity = _size;
+}
+
+/**
+  Delete the segment files. Readers still holding the segment keep the file open.
+*/
+void LogSegment::Remove() {
+  unlink((_path + ".seg").c_str());
+  unlink((_path + ".idx").c_str());
+  unlink((_path + ".tim").c_str());
+}
+
+/**
+  Constructor.
+  @param config SSEChannelConfig.
+*/
+SegmentLog::SegmentLog(const ChannelConfig& config) : _config(config) {
+  _dir = _config.server->GetValue("segmentlog.storageDir") + "/" + config.id + ".log";
+  _segment_size = _config.server->GetValueSize("segmentlog.segmentSize");
+  _segment_events = std::max<size_t>(_config.cacheLength / SEGMENT_SPLIT, 1);
+  _first_seq = 0;
+  _next_seq = 0;
+  _size = 0;
+  _bytes = 0;
+  _last_time = 0;
+
+  if (mkdir(_dir.c_str(), 0755) == -1 && errno != EEXIST) {
+    LOG(ERROR) << "Failed to create segment log directory " << _dir << ": " << strerror(errno);
+  }
+
+  LOG(INFO) << "Segment log directory: " << _dir;
+  Recover();
+}
+
+/**
+  Load the segments on disk.
+  Only the newest segment is scanned, the others have an index file.
+*/
+void SegmentLog::Recover() {
+  vector<uint64_t> seqs;
+  DIR* dir = opendir(_dir.c_str());
+  struct dirent* entry;
+
+  if (!dir) return;
+
+  while ((entry = readdir(dir)) != NULL) {
+    const string name = entry->d_name;
+    if (name.length() == 20 && name.compare(16, 4, ".seg") == 0) {
+      seqs.push_back(strtoull(name.substr(0, 16).c_str(), NULL, 16));
+    }
+  }
+
+  closedir(dir);
+  std::sort(seqs.begin(), seqs.end());
+
+  for (size_t i = 0; i < seqs.size(); i++) {
+    LogSegmentPtr segment(new LogSegment(GetSegmentPath(seqs[i]), seqs[i]));
+
+    if (!segment->Open(_segment_size, i + 1 == seqs.size())) continue;
+
+    if ((i + 1 < seqs.size() && segment->LoadIndex()) || segment->Recover()) {
+      segment->LoadTimes();
+      _segments.push_back(segment);
+    }
+  }
+
+  if (!_segments.empty()) _first_seq = _segments.front()->GetFirstSeq();
+
+  BOOST_FOREACH(const LogSegmentPtr& segment, _segments) {
+    for (size_t i = 0; i < segment->events.size(); i++) {
+      SegmentEvent& event = segment->events[i];
+      _index[event.id] = segment->GetFirstSeq() + i;
+      event.time = _last_time = std::max(event.time, _last_time);
+    }
+
+    _next_seq = segment->GetFirstSeq() + segment->events.size();
+  }
+
+  // Only the latest copy of an event counts.
+  BOOST_FOREACH(const LogSegmentPtr& segment, _segments) {
+    for (size_t i = 0; i < segment->events.size(); i++) {
+      if (!IsCurrent(segment->events[i], segment->GetFirstSeq() + i)) continue;
+
+      _size++;
+      _bytes += segment->events[i].length;
+    }
+  }
+
+  Evict();
+  Trim();
+
+  LOG(INFO) << "Recovered " << GetSizeOfCachedEvents() << " events from " << _segments.size() << " segments in " << _dir;
+}
+
+/**
+  Add event to cache.
+  An event with an id already in the cache is appended again, the log
+  is never rewritten. The older copy is skipped from then on.
+  @param event Event to cache.
+*/
+void SegmentLog::CacheEvent(SSEEvent& event) {
+  const SSEBufferPtr& buf = event.GetBuffer();
+
+  if (_config.cacheLength == 0 || buf->GetLength() == 0) return;
+  if (!Rotate(buf->GetLength())) return;
+
+  // Only this thread changes the segments, so the tail can be read without the lock.
+  const LogSegmentPtr& tail = _segments.back();
+
+  SegmentEvent segmentEvent;
+  segmentEvent.offset = tail->GetSize();
+  segmentEvent.length = buf->GetLength();
+  segmentEvent.id = buf->GetId();
+  segmentEvent.time = std::max(buf->GetTime(), _last_time);
+
+  if (!tail->Append(buf, segmentEvent.time)) return;
+
+  boost::unique_lock<boost::shared_mutex> lock(_lock);
+  boost::unordered_map<string, uint64_t>::iterator it = _index.find(segmentEvent.id);
+
+  if (it != _index.end() && it->second >= _first_seq) {
+    const SegmentEvent* previous = GetEvent(it->second);
+
+    if (previous) {
+      _size--;
+      _bytes -= previous->length;
+    }
+  }
+
+  tail->events.push_back(segmentEvent);
+  _index[segmentEvent.id] = _next_seq;
+  _next_seq++;
+  _size++;
+  _bytes += segmentEvent.length;
+  _last_time = segmentEvent.time;
+
+  Evict();
+  Trim();
+}
+
+/**
+  Start a new segment if the current one is full.
+  @param length Length of the frame that is going to be appended.
+*/
+bool SegmentLog::Rotate(size_t length) {
+  if (!_segments.empty()) {
+    const LogSegmentPtr& tail = _segments.back();
+
+    if (tail->events.size() < _segment_events && tail->GetSize() + length <= tail->GetCapacity()) {
+      return true;
+    }
+
+    if (tail->events.empty()) {
+      // Too small for this frame, replace it with a larger one.
+      boost::unique_lock<boost::shared_mutex> lock(_lock);
+      tail->Remove();
+      _segments.pop_back();
+    } else {
+      tail->Seal();
+    }
+  }
+
+  LogSegmentPtr segment(new LogSegment(GetSegmentPath(_next_seq), _next_seq));
+
+  if (!segment->Open(std::max(_segment_size, length), true)) {
+    return false;
+  }
+
+  boost::unique_lock<boost::shared_mutex> lock(_lock);
+  _segments.push_back(segment);
+
+  return true;
+}
+
+/**
+  Evict the oldest events beyond cacheLength, cacheBytes and cacheMaxAge, keeping the newest one.
+  Evicted and superseded events stay on disk until their segment is deleted.
+  Must be called with the lock held exclusively.
+*/
+void SegmentLog::Evict() {
+  while (_first_seq < _next_seq) {
+    const SegmentEvent* event = GetEvent(_first_seq);
+
+    // Superseded or lost events are not counted, just skip them.
+    if (!event || !IsCurrent(*event, _first_seq)) {
+      _first_seq++;
+      continue;
+    }
+
+    if (!(_size > _config.cacheLength || (_size > 1 &&
+        ((_config.cacheBytes > 0 && _bytes > _config.cacheBytes) || IsExpired(event->time, _last_time, _config.cacheMaxAge))))) break;
+
+    _size--;
+    _bytes -= event->length;
+    _first_seq++;
+  }
+}
+
+/**
+  Delete the oldest segment while all its events are evicted.
+  Must be called with the lock held exclusively.
+*/
+void SegmentLog::Trim() {
+  while (_segments.size() > 1 && _segments[1]->GetFirstSeq() <= _first_seq) {
+    const LogSegmentPtr& segment = _segments.front();
+
+    for (size_t i = 0; i < segment->events.size(); i++) {
+      boost::unordered_map<string, uint64_t>::iterator it = _index.find(segment->events[i].id);
+      if (it != _index.end() && it->second == segment->GetFirstSeq() + i) _index.erase(it);
+    }
+
+    segment->Remove();
+    _segments.pop_front();
+  }
+}
+
+/**
+  Returns a cached event, or NULL if it is in none of the segments.
+  Must be called with the lock held.
+  @param seq Sequence number of the event.
+*/
+const SegmentEvent* SegmentLog::GetEvent(uint64_t seq) {
+  BOOST_FOREACH(const LogSegmentPtr& segment, _segments) {
+    if (seq < segment->GetFirstSeq()) break;
+    if (seq < segment->GetFirstSeq() + segment->events.size()) return &segment->events[seq - segment->GetFirstSeq()];
+  }
+
+  return NULL;
+}
+
+/**
+  Returns true if an event is the latest copy of its id.
+  Must be called with the lock held.
+  @param event The event.
+  @param seq Sequence number of the event.
+*/
+bool SegmentLog::IsCurrent(const SegmentEvent& event, uint64_t seq) {
+  boost::unordered_map<string, uint64_t>::const_iterator it = _index.find(event.id);
+  return it != _index.end() && it->second == seq;
+}
+
+static bool ArrivedBefore(const SegmentEvent& event, uint64_t time) {
+  return event.time < time;
+}
+
+/**
+  Returns the sequence number of the first event that arrived at or after
+  a point in time. Binary searches the segment holding it.
+  Must be called with the lock held.
+  @param time Milliseconds since the epoch.
+*/
+uint64_t SegmentLog::FindTime(uint64_t time) {
+  BOOST_FOREACH(const LogSegmentPtr& segment, _segments) {
+    const vector<SegmentEvent>& events = segment->events;
+
+    if (events.empty() || events.back().time < time) continue;
+
+    return segment->GetFirstSeq() + (std::lower_bound(events.begin(), events.end(), time, ArrivedBefore) - events.begin());
+  }
+
+  return _next_seq;
+}
+
+/**
+  Read the events since an id or a point in time out of the segments.
+  Only the latest copy of each event is read.
+  The lock is only held while collecting the offsets.
+  @param lastId Read events since this id, or all events if NULL.
+  @param time Read events that arrived at or after this time, 0 for all.
+  @param file Return file backed buffers instead of copying the events.
+*/
+SSEBufferList SegmentLog::ReadEvents(const string* lastId, uint64_t time, bool file) {
+  vector<pair<LogSegmentPtr, SegmentEvent> > ranges;
+  SSEBufferList events;
+
+  {
+    boost::shared_lock<boost::shared_mutex> lock(_lock);
+    uint64_t seq = _first_seq;
+
+    if (lastId) {
+      boost::unordered_map<string, uint64_t>::const_iterator it = _index.find(*lastId);
+      if (it == _index.end() || it->second < seq) return events;
+      seq = it->second;
+    }
+
+    if (time > 0) seq = std::max(seq, FindTime(time));
+
+    BOOST_FOREACH(const LogSegmentPtr& segment, _segments) {
+      uint64_t first = segment->GetFirstSeq();
+
+      if (first + segment->events.size() <= seq) continue;
+
+      for (size_t i = (seq > first) ? seq - first : 0; i < segment->events.size(); i++) {
+        if (IsCurrent(segment->events[i], first + i)) ranges.push_back(make_pair(segment, segment->events[i]));
+      }
+    }
+  }
+
+  for (size_t i = 0; i < ranges.size(); i++) {
+    const LogSegmentPtr& segment = ranges[i].first;
+    const SegmentEvent& event = ranges[i].second;
+
+    if (file) {
+      events.push_back(SSEBufferPtr(new SSEBuffer(segment->GetFd(), event.offset, event.length, segment, event.id, event.time)));
+    } else {
+      events.push_back(SSEBufferPtr(new SSEBuffer(string(segment->GetPtr() + event.offset, event.length), event.id, event.time)));
+    }
+  }
+
+  return events;
+}
+
+SSEBufferList SegmentLog::GetEventsSinceId(string lastId) {
+  return ReadEvents(&lastId, 0, false);
+}
+
+SSEBufferList SegmentLog::GetAllEvents() {
+  return ReadEvents(NULL, 0, false);
+}
+
+SSEBufferList SegmentLog::GetEventsSinceTime(uint64_t time) {
+  return ReadEvents(NULL, time, false);
+}
+
+/**
+  Get cached events as ranges of the segment files.
+  The segments are kept open as long as the buffers are referenced.
+  @param lastId Get events since this id.
+  @param all Get all events, ignoring lastId.
+  @param events Set to the events.
+*/
+bool SegmentLog::GetFileEvents(const string& lastId, bool all, SSEBufferList& events) {
+  events = ReadEvents(all ? NULL : &lastId, 0, true);
+  return true;
+}
+
+/**
+  Get the events that arrived at or after a point in time as ranges of the segment files.
+  @param time Milliseconds since the epoch.
+  @param events Set to the events.
+*/
+bool SegmentLog::GetFileEventsSinceTime(uint64_t time, SSEBufferList& events) {
+  events = ReadEvents(NULL, time, true);
+  return true;
+}
+
+size_t SegmentLog::GetSizeOfCachedEvents() {
+  boost::shared_lock<boost::shared_mutex> lock(_lock);
+  return _size;
+}
+
+size_t SegmentLog::GetCachedBytes() {
+  return _bytes;
+}
+
+/**
+ Delete all segments, the segment log directory is kept for new events.
+**/
+void SegmentLog::Purge() {
+  boost::unique_lock<boost::shared_mutex> lock(_lock);
+  DIR* dir = opendir(_dir.c_str());
+  struct dirent* entry;
+  size_t removed = 0;
+
+  // Also removes segments that failed to load, they would be recovered on restart.
+  while (dir && (entry = readdir(dir)) != NULL) {
+    const string name = entry->d_name;
+
+    if (name.length() > 17 && name[16] == '.' && name.find_first_not_of("0123456789abcdef") == 16) {
+      if (unlink((_dir + "/" + name).c_str()) == 0) removed++;
+    }
+  }
+
+  if (dir) closedir(dir);
+
+  _segments.clear();
+  _index.clear();
+  _first_seq = 0;
+  _next_seq = 0;
+  _size = 0;
+  _bytes = 0;
+  _last_time = 0;
+
+  LOG(INFO) << "Deleted " << removed << " segment files in " << _dir;
+}
+
+/**
+  Returns the path of a segment without extension.
+  @param firstSeq Sequence number of the first event in the segment.
+*/
+string SegmentLog::GetSegmentPath(uint64_t firstSeq) {
+  char name[17];
+  snprintf(name, sizeof(name), "%016llx", (unsigned long long)firstSeq);
+  return _dir + "/" + name;
+}
@@ -0,0 +1,402 @@
+#include "Common.h"
+#include "CacheAdapters/Tiered.h"
+#include "SSEConfig.h"
+#include "SSEEvent.h"
+#include <boost/foreach.hpp>
+#include <boost/bind.hpp>
+
+#define TIERED_READ_RETRIES 3
+
+using namespace std;
+
+/**
+  Constructor.
+  @param config SSEChannelConfig.
+  @param backend Persistent cache adapter, owned by the tiered cache.
+*/
+Tiered::Tiered(const ChannelConfig& config, CacheInterface* backend) : _config(config), _backend(new TieredBackend(backend)) {
+  _writer = TieredWriter::GetInstance(_config.server);
+  _hot_length = std::min<size_t>(_config.server->GetValueInt("tiered.hotLength"), _config.cacheLength);
+  _hot_max_bytes = _config.server->GetValueSize("tiered.hotBytes");
+  _first_seq = 0;
+  _hot_bytes = 0;
+  _cold_bytes = 0;
+  _writes = 0;
+  _dropped = 0;
+  _hits = 0;
+  _misses = 0;
+
+  Load();
+}
+
+/**
+  Destructor.
+  Writes still queued are discarded rather than waited for, the channel
+  may be locked. The backend is deleted here, it may refer to the channel config.
+*/
+Tiered::~Tiered() {
+  std::lock_guard<std::mutex> lock(_backend->lock);
+  _backend->generation++;
+  delete _backend->adapter;
+  _backend->adapter = NULL;
+}
+
+/**
+  Fill the hot window with the newest events in the backend.
+*/
+void Tiered::Load() {
+  SSEBufferList events = _backend->adapter->GetAllEvents();
+  boost::unique_lock<boost::shared_mutex> lock(_lock);
+
+  BOOST_FOREACH(const SSEBufferPtr& buf, events) {
+    Add(buf, 0);
+    Evict();
+  }
+
+  LOG(INFO) << "Loaded " << _hot.size() << " of " << (_cold.size() + _hot.size()) << " cached events for " << _config.id << " into memory";
+}
+
+/**
+  Add event to cache.
+  The event is queued for the backend, publishers do not wait for it.
+  @param event Event to cache.
+*/
+void Tiered::CacheEvent(SSEEvent& event) {
+  TieredWrite write;
+
+  if (_config.cacheLength == 0) return;
+
+  write.backend = _backend;
+  write.buf = event.GetBuffer();
+  write.generation = _backend->generation;
+
+  {
+    boost::unique_lock<boost::shared_mutex> lock(_lock);
+    write.number = ++_writes;
+    Add(write.buf, write.number);
+    Evict();
+  }
+
+  _writer->Push(write);
+}
+
+/**
+  Add an event to the hot window.
+  An update to an event already in the cache keeps its position and arrival
+  time, so an update to an older event is only kept until it is written to
+  the backend. The backend sets the same arrival times.
+  Must be called with the lock held exclusively.
+  @param buf Event to add.
+  @param write Number of the write queued for the event.
+*/
+void Tiered::Add(const SSEBufferPtr& buf, uint64_t write) {
+  const string& id = buf->GetId();
+  boost::unordered_map<string, uint64_t>::iterator it = _index.find(id);
+
+  if (it != _index.end()) {
+    TieredEntry& entry = _hot[it->second - _first_seq];
+    _hot_bytes = _hot_bytes - entry.buf->GetLength() + buf->GetLength();
+    entry.buf = WithTime(buf, entry.buf->GetTime());
+    entry.write = write;
+    return;
+  }
+
+  boost::unordered_map<string, TieredCold>::iterator cold = _cold_ids.find(id);
+
+  if (cold != _cold_ids.end()) {
+    _cold_bytes = _cold_bytes - cold->second.length + buf->GetLength();
+    cold->second.length = buf->GetLength();
+    _cold_updates.erase(id);
+    _cold_updates.insert(make_pair(id, TieredEntry(WithTime(buf, cold->second.time), write)));
+    _cold_update_order.push_back(make_pair(id, write));
+    return;
+  }
+
+  _hot.push_back(TieredEntry(WithTime(buf, std::max(buf->GetTime(), GetNewestTime())), write));
+  _index[id] = _first_seq + _hot.size() - 1;
+  _hot_bytes += buf->GetLength();
+}
+
+/**
+  Returns the arrival time of the newest event, 0 if the cache is empty.
+  Must be called with the lock held.
+*/
+uint64_t Tiered::GetNewestTime() {
+  if (!_hot.empty()) return _hot.back().buf->GetTime();
+  if (!_cold.empty()) return _cold_ids.at(_cold.back()).time;
+  return 0;
+}
+
+/**
+  Returns the arrival time of the oldest event.
+  Must be called with the lock held and the cache not empty.
+*/
+uint64_t Tiered::GetOldestTime() {
+  if (!_cold.empty()) return _cold_ids.at(_cold.front()).time;
+  return _hot.front().buf->GetTime();
+}
+
+/**
+  Evict the oldest events beyond cacheLength, cacheBytes and cacheMaxAge,
+  and move written events beyond the hot window limits to the backend.
+  Must be called with the lock held exclusively.
+*/
+void Tiered::Evict() {
+  while (!_cold_update_order.empty() && _cold_update_order.front().second <= _backend->written) {
+    boost::unordered_map<string, TieredEntry>::iterator it = _cold_updates.find(_cold_update_order.front().first);
+
+    if (it != _cold_updates.end() && it->second.write == _cold_update_order.front().second) {
+      _cold_updates.erase(it);
+      _dropped++;
+    }
+
+    _cold_update_order.pop_front();
+  }
+
+  while (_cold.size() + _hot.size() > _config.cacheLength || (_cold.size() + _hot.size() > 1 &&
+      ((_config.cacheBytes > 0 && _cold_bytes + _hot_bytes > _config.cacheBytes) ||
+       IsExpired(GetOldestTime(), GetNewestTime(), _config.cacheMaxAge)))) {
+    if (_cold.empty()) {
+      PopHot();
+      continue;
+    }
+
+    _cold_bytes -= _cold_ids[_cold.front()].length;
+    _cold_ids.erase(_cold.front());
+    _cold_updates.erase(_cold.front());
+    _cold.pop_front();
+  }
+
+  Cool(_hot_length, _hot_max_bytes);
+}
+
+/**
+  Move written events from the hot window to the backend, oldest first,
+  while the hot window holds more than length events or bytes.
+  Must be called with the lock held exclusively.
+  @param length Number of events to keep in memory.
+  @param bytes Size of the event data to keep in memory, 0 for unlimited.
+*/
+void Tiered::Cool(size_t length, size_t bytes) {
+  while (!_hot.empty() && (_hot.size() > length || (bytes > 0 && _hot_bytes > bytes))) {
+    const string id = _hot.front().buf->GetId();
+    const TieredCold cold = { _hot.front().buf->GetLength(), _hot.front().buf->GetTime() };
+
+    if (_hot.front().write > _backend->written) break;
+
+    PopHot();
+    _cold.push_back(id);
+    _cold_ids[id] = cold;
+    _cold_bytes += cold.length;
+  }
+}
+
+/**
+  Drop the oldest event from the hot window.
+  Must be called with the lock held exclusively.
+*/
+void Tiered::PopHot() {
+  _index.erase(_hot.front().buf->GetId());
+  _hot_bytes -= _hot.front().buf->GetLength();
+  _hot.pop_front();
+  _first_seq++;
+  _dropped++;
+}
+
+SSEBufferList Tiered::GetEventsSinceId(string lastId) {
+  SSEBufferList events;
+
+  {
+    boost::shared_lock<boost::shared_mutex> lock(_lock);
+    boost::unordered_map<string, uint64_t>::const_iterator it = _index.find(lastId);
+
+    // Events not in the hot window or the backend are not cached at all.
+    if (it != _index.end() || _cold_ids.find(lastId) == _cold_ids.end()) {
+      _hits++;
+
+      for (size_t i = (it != _index.end()) ? it->second - _first_seq : _hot.size(); i < _hot.size(); i++) {
+        events.push_back(_hot[i].buf);
+      }
+
+      return events;
+    }
+  }
+
+  _misses++;
+
+  return ReadBackend(boost::bind(&CacheInterface::GetEventsSinceId, _backend->adapter, lastId), true);
+}
+
+SSEBufferList Tiered::GetAllEvents() {
+  SSEBufferList events;
+
+  {
+    boost::shared_lock<boost::shared_mutex> lock(_lock);
+
+    if (_cold.empty()) {
+      _hits++;
+
+      BOOST_FOREACH(const TieredEntry& entry, _hot) {
+        events.push_back(entry.buf);
+      }
+
+      return events;
+    }
+  }
+
+  _misses++;
+
+  return ReadBackend(boost::bind(&CacheInterface::GetAllEvents, _backend->adapter), false);
+}
+
+/**
+  Binary searches the hot window when the backend holds no events that
+  arrived at or after the time.
+*/
+SSEBufferList Tiered::GetEventsSinceTime(uint64_t time) {
+  SSEBufferList events;
+
+  {
+    boost::shared_lock<boost::shared_mutex> lock(_lock);
+
+    if (_cold.empty() || _cold_ids.at(_cold.back()).time < time) {
+      _hits++;
+
+      size_t begin = 0, end = _hot.size();
+
+      while (begin < end) {
+        size_t mid = begin + (end - begin) / 2;
+
+        if (_hot[mid].buf->GetTime() < time) {
+          begin = mid + 1;
+        } else {
+          end = mid;
+        }
+      }
+
+      for (; begin < _hot.size(); begin++) {
+        events.push_back(_hot[begin].buf);
+      }
+
+      return events;
+    }
+  }
+
+  _misses++;
+
+  return ReadBackend(boost::bind(&CacheInterface::GetEventsSinceTime, _backend->adapter, time), false);
+}
+
+/**
+  Read events from the backend and combine them with the hot window.
+  An event dropped from memory while the backend is read may have been
+  written after it was read, so the read is retried, and the last attempt
+  holds the lock so no events are dropped meanwhile.
+  @param read Backend read.
+  @param since The first event read is the one the replay resumes from.
+*/
+SSEBufferList Tiered::ReadBackend(const boost::function<SSEBufferList ()>& read, bool since) {
+  for (int attempt = 0; attempt < TIERED_READ_RETRIES; attempt++) {
+    uint64_t dropped = _dropped;
+    SSEBufferList events = read();
+    boost::shared_lock<boost::shared_mutex> lock(_lock);
+
+    if (dropped == _dropped) return Merge(events, since);
+  }
+
+  boost::shared_lock<boost::shared_mutex> lock(_lock);
+  return Merge(read(), since);
+}
+
+/**
+  Combine events read from the backend with the hot window.
+  The backend may lag behind, so only the events known to be older than
+  the hot window are taken from it, updated if the update is not written yet.
+  Must be called with the lock held.
+  @param cold Events read from the backend.
+  @param since The first event in cold is the one the replay resumes from.
+*/
+SSEBufferList Tiered::Merge(const SSEBufferList& cold, bool since) {
+  SSEBufferList events;
+
+  if (since && (cold.empty() || _cold_ids.find(cold.front()->GetId()) == _cold_ids.end())) {
+    return events;
+  }
+
+  BOOST_FOREACH(const SSEBufferPtr& buf, cold) {
+    if (_cold_ids.find(buf->GetId()) == _cold_ids.end()) continue;
+
+    boost::unordered_map<string, TieredEntry>::const_iterator update = _cold_updates.find(buf->GetId());
+    events.push_back((update != _cold_updates.end()) ? update->second.buf : buf);
+  }
+
+  BOOST_FOREACH(const TieredEntry& entry, _hot) {
+    events.push_back(entry.buf);
+  }
+
+  return events;
+}
+
+/**
+  Returns the number of cached events, counting those not written to the backend yet.
+*/
+size_t Tiered::GetSizeOfCachedEvents() {
+  boost::shared_lock<boost::shared_mutex> lock(_lock);
+  return _cold.size() + _hot.size();
+}
+
+/**
+  Returns the size of the cached event data, counting events not written to the backend yet.
+*/
+size_t Tiered::GetCachedBytes() {
+  boost::shared_lock<boost::shared_mutex> lock(_lock);
+  return _cold_bytes + _hot_bytes;
+}
+
+/**
+  Purge the hot window and the backend. Queued writes are discarded.
+*/
+void Tiered::Purge() {
+  boost::unique_lock<boost::shared_mutex> lock(_lock);
+
+  {
+    std::lock_guard<std::mutex> backendLock(_backend->lock);
+    _backend->generation++;
+    _backend->adapter->Purge();
+  }
+
+  _hot.clear();
+  _index.clear();
+  _hot_bytes = 0;
+  _cold.clear();
+  _cold_ids.clear();
+  _cold_bytes = 0;
+  _cold_updates.clear();
+  _cold_update_order.clear();
+}
+
+/**
+  Returns the size of the event data in the hot window.
+*/
+size_t Tiered::GetMemoryBytes() {
+  boost::shared_lock<boost::shared_mutex> lock(_lock);
+  return _hot_bytes;
+}
+
+/**
+  Move the events written to the backend out of the hot window, they are
+  replayed from the backend from now on. Events not written yet stay.
+*/
+void Tiered::ReleaseMemory() {
+  boost::unique_lock<boost::shared_mutex> lock(_lock);
+  Cool(0, 0);
+}
+
+/**
+  Get number of reads served from the hot window and from the backend.
+*/
+bool Tiered::GetTierStats(ulong& hits, ulong& misses) {
+  hits = _hits;
+  misses = _misses;
+  return true;
+}
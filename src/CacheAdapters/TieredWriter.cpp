@@ -0,0 +1,66 @@
+#include "Common.h"
+#include "CacheAdapters/TieredWriter.h"
+#include "SSEConfig.h"
+
+#define TIERED_WRITE_BATCH 64
+
+using namespace std;
+
+/**
+  Returns the writer, starting it on the first call.
+  @param config Server configuration.
+*/
+TieredWriter* TieredWriter::GetInstance(SSEConfig* config) {
+  static std::mutex instanceLock;
+  static TieredWriter* instance = NULL;
+
+  std::lock_guard<std::mutex> lock(instanceLock);
+  if (!instance) instance = new TieredWriter(config);
+
+  return instance;
+}
+
+TieredWriter::TieredWriter(SSEConfig* config) : WriteBehind<TieredWrite>(config->GetValueInt("tiered.writeQueueSize"), TIERED_WRITE_BATCH) {
+  Start();
+}
+
+/**
+  Queue a write, waiting for room if the queue is full.
+  @param write Write to queue.
+*/
+void TieredWriter::Push(const TieredWrite& write) {
+  Enqueue(write, 0);
+}
+
+/**
+  Apply a batch of writes, passing the events of each backend to it at once.
+  Writes of a backend purged or released since they were queued are skipped.
+  @param batch Writes to apply.
+*/
+void TieredWriter::Write(const vector<TieredWrite>& batch) {
+  vector<bool> done(batch.size(), false);
+
+  for (size_t i = 0; i < batch.size(); i++) {
+    if (done[i]) continue;
+
+    TieredBackend* backend = batch[i].backend.get();
+    SSEBufferList events;
+    uint64_t number = 0;
+
+    std::lock_guard<std::mutex> lock(backend->lock);
+
+    for (size_t j = i; j < batch.size(); j++) {
+      if (batch[j].backend.get() != backend) continue;
+
+      done[j] = true;
+      number = batch[j].number;
+
+      if (backend->adapter && batch[j].generation == backend->generation) {
+        events.push_back(batch[j].buf);
+      }
+    }
+
+    if (!events.empty()) backend->adapter->CacheEvents(events);
+    backend->written = number;
+  }
+}
@@ -4,12 +4,14 @@
 #include "SSEClientHandler.h"
 #include "SSEEvent.h"
 #include "SSEConfig.h"
+#include "SSETimer.h"
 #include "HTTPRequest.h"
 #include "HTTPResponse.h"
 #include <mutex>
 #include <boost/foreach.hpp>
 #include <boost/bind.hpp>
 #include <boost/thread.hpp>
+#include <boost/functional/hash.hpp>
 
 using namespace std;
 extern int stop;
@@ -18,13 +20,15 @@ extern int stop;
   Constructor.
   @param conf Pointer to SSEConfig instance holding our configuration.
   @param id Unique identifier for this channel.
+  @param handlers Server wide client handler threads serving the channel clients.
 */
-SSEChannel::SSEChannel(ChannelConfig conf, string id) {
+SSEChannel::SSEChannel(ChannelConfig conf, string id, const ClientHandlerList& handlers) : _handlers(handlers) {
   _config = conf;
   _config.id = id;
-
-  _efd = epoll_create1(0);
-  LOG_IF(FATAL, _efd == -1) << "epoll_create1 failed.";
+  _cache_adapter = NULL;
+  _num_clients = 0;
+  _last_activity = time(NULL);
+  _closed = false;
 
   // Initialize counters.
   _stats.num_clients            = 0;
@@ -34,12 +38,24 @@ SSEChannel::SSEChannel(ChannelConfig conf, string id) {
   _stats.num_cached_events      = 0;
   _stats.num_broadcasted_events = 0;
   _stats.cache_size             = _config.cacheLength;
-
+  _stats.cache_bytes            = 0;
+  _stats.cache_memory_bytes     = 0;
+  _stats.backlog_bytes          = 0;
+  _stats.max_client_backlog_bytes = 0;
+  _stats.num_backlog_evictions  = 0;
+  _stats.num_backlog_dropped_events = 0;
+  _stats.num_replay_cache_hits  = 0;
+  _stats.num_replay_cache_misses = 0;
+  _stats.num_hot_cache_hits     = 0;
+  _stats.num_hot_cache_misses   = 0;
+  _cache_generation = 0;
+  _replay_cache_generation = 0;
 
   LOG(INFO) << "Initializing channel " << _config.id;
   LOG(INFO) << "Cache Adapter: " << _config.cacheAdapter;
   LOG(INFO) << "Cache length: " << _config.cacheLength;
-  LOG(INFO) << "Threads per channel: " << _config.server->GetValue("server.threadsPerChannel");
+  LOG(INFO) << "Cache bytes: " << _config.cacheBytes;
+  LOG(INFO) << "Client backlog limits: " << _config.maxBacklogBytes << " bytes, " << _config.maxBacklogEvents << " events";
 
   _allow_all_origins = (_config.allowedOrigins.size() < 1) ? true : false;
 
@@ -56,8 +72,14 @@ SSEChannel::SSEChannel(ChannelConfig conf, string id) {
   _evs_preamble_data[2050] = '\n';
   _evs_preamble_data[2051] = '\0';
 
+  // Keep track of which client handlers has clients for us, so we only queue broadcasts where needed.
+  _handler_clients = boost::shared_ptr<std::atomic<long>[]>(new std::atomic<long>[_handlers.size()]);
+  for (size_t i = 0; i < _handlers.size(); i++) _handler_clients[i] = 0;
+
+  // Start the round robin at different handlers so small channels are spread across all of them.
+  _next_handler = boost::hash<string>()(_config.id) % _handlers.size();
+
   InitializeCache();
-  InitializeThreads();
 }
 
 /**
@@ -65,51 +87,51 @@ SSEChannel::SSEChannel(ChannelConfig conf, string id) {
 */
 SSEChannel::~SSEChannel() {
   DLOG(INFO) << "SSEChannel destructor called.";
-  CleanupThreads();
+  delete _cache_adapter;
 }
 
 /*
   Initialize the configured cacheadapter for this channel
 */
 void SSEChannel::InitializeCache() {
-  const string adapter = _config.cacheAdapter;
-  if (adapter == "redis") {
-    _cache_adapter = new Redis(_config.id, _config);
-  } else if (adapter == "memory") {
-    _cache_adapter = new Memory(_config);
-  } else if (adapter == "leveldb") {
-    _cache_adapter = new LevelDB(_config);
+  if (_config.cacheAdapter == "tiered") {
+    const string& backend = _config.server->GetValue("tiered.backend");
+
+    if (backend != "redis" && backend != "leveldb") {
+      LOG(FATAL) << "Invalid tiered.backend: " << backend;
+    }
+
+    _cache_adapter = new Tiered(_config, CreateCacheAdapter(backend));
+  } else {
+    _cache_adapter = CreateCacheAdapter(_config.cacheAdapter);
   }
 
   if (_cache_adapter) {
     _stats.num_cached_events = _cache_adapter->GetSizeOfCachedEvents();
+    _stats.cache_bytes = _cache_adapter->GetCachedBytes();
+    _stats.cache_memory_bytes = _cache_adapter->GetMemoryBytes();
   }
 }
 
 /**
-  Initialize client handler threads and also the thread that
-  pings all connected clients on _config.red interval.
+  Create a cache adapter for this channel.
+  @param adapter Name of the adapter.
+  @returns NULL if there is no such adapter.
 */
-void SSEChannel::InitializeThreads() {
-  int i;
-
-  _cleanupthread = boost::thread(boost::bind(&SSEChannel::CleanupMain, this));
-
-  for (i = 0; i < _config.server->GetValueInt("server.threadsPerChannel"); i++) {
-    _clientpool.push_back(ClientHandlerPtr(new SSEClientHandler(i)));
+CacheInterface* SSEChannel::CreateCacheAdapter(const string& adapter) {
+  if (adapter == "redis") {
+    return new Redis(_config.id, _config);
+  } else if (adapter == "memory") {
+    return new Memory(_config);
+  } else if (adapter == "ring") {
+    return new Ring(_config);
+  } else if (adapter == "leveldb") {
+    return new LevelDB(_config);
+  } else if (adapter == "segmentlog") {
+    return new SegmentLog(_config);
   }
 
-  curthread = _clientpool.begin();
-  _pingthread = boost::thread(boost::bind(&SSEChannel::Ping, this));
-}
-
-/**
-  Stop and free up all running threads.
-  Called by destructor.
-*/
-void SSEChannel::CleanupThreads() {
-  pthread_cancel(_pingthread.native_handle());
-  pthread_cancel(_cleanupthread.native_handle());
+  return NULL;
 }
 
 /**
@@ -156,12 +178,16 @@ void SSEChannel::SetCorsHeaders(HTTPRequest* req, HTTPResponse& res) {
   Adds a client to one of the client handlers assigned to the channel.
   Clients is distributed evenly across the client handler threads.
   @param client SSEClient pointer.
+  @returns false if the channel has been closed, the caller still owns the client then.
 */
-void SSEChannel::AddClient(SSEClient* client, HTTPRequest* req) {
+bool SSEChannel::AddClient(SSEClient* client, HTTPRequest* req) {
   HTTPResponse res;
-  int ret;
+  boost::shared_lock<boost::shared_mutex> lock(_state_lock);
+
+  if (_closed) return false;
 
   DLOG(INFO) << "Adding client to channel " << GetId();
+  _last_activity = time(NULL);
 
   // Send CORS headers.
   SetCorsHeaders(req, res);
@@ -170,7 +196,7 @@ void SSEChannel::AddClient(SSEClient* client, HTTPRequest* req) {
   if (req->GetMethod().compare("OPTIONS") == 0) {
     client->Send(res.Get());
     client->Destroy();
-    return;
+    return true;
   }
 
   // Disallow every other method than GET.
@@ -179,7 +205,7 @@ void SSEChannel::AddClient(SSEClient* client, HTTPRequest* req) {
     res.SetStatus(405, "Method Not Allowed");
     client->Send(res.Get());
     client->Destroy();
-    return;
+    return true;
   }
 
   string lastEventId = req->GetHeader("Last-Event-ID");
@@ -203,163 +229,317 @@ void SSEChannel::AddClient(SSEClient* client, HTTPRequest* req) {
   if (!req->GetQueryString("filterid").empty()) client->Subscribe(req->GetQueryString("filterid"), SUBSCRIPTION_ID);
   if (!req->GetQueryString("filterevent").empty()) client->Subscribe(req->GetQueryString("filterevent"), SUBSCRIPTION_EVENT_TYPE);
 
-  // Send event history if requested.
+  // Resume from a point in time, in milliseconds since the epoch.
+  const string sinceTime = req->GetQueryString("since");
+  char* sinceEnd = NULL;
+  uint64_t since = strtoull(sinceTime.c_str(), &sinceEnd, 10);
+  if (sinceTime.empty() || *sinceEnd != '\0') since = 0;
+
+  // Event history is sent by the client handler, before any live events.
+  ReplayMode replay = REPLAY_NONE;
   if (!lastEventId.empty()) {
-    SendEventsSince(client, lastEventId);
-  } else if (!req->GetQueryString("getcache").empty()) {
-    SendCache(client);
+    replay = REPLAY_SINCE_ID;
+  } else if (since > 0) {
+    replay = REPLAY_SINCE_TIME;
+  } else if (!req->GetQueryString("getcache").empty() || sinceTime == "0") {
+    replay = REPLAY_ALL;
   }
 
   client->DeleteHttpReq();
+  client->SetBacklogLimits(_config.maxBacklogBytes, _config.maxBacklogEvents, _config.backlogPolicy);
+  client->SetChannel(this);
 
-  ret = client->AddToEpoll(_efd, EPOLLIN | EPOLLHUP | EPOLLRDHUP | EPOLLERR);
+  // Add client to handler thread in a round-robin fashion.
+  ClientHandlerPtr handler = _handlers[_next_handler++ % _handlers.size()];
+
+  _handler_clients[handler->GetId()]++;
+  _num_clients++;
 
-  if (ret == -1) {
+  if (!handler->AddClient(this, client, replay, lastEventId, since)) {
     DLOG(ERROR) << "Failed to add client " << client->GetIP() << " to epoll event list.";
+    _handler_clients[handler->GetId()]--;
+    _num_clients--;
     client->Destroy();
-    return;
+    return true;
   }
 
   INC_LONG(_stats.num_connects);
+  return true;
+}
 
-  // Add client to handler thread in a round-robin fashion.
-  (*curthread)->AddClient(client);
-  curthread++;
+/**
+  Called by a client handler when it has removed one of our clients.
+  @param handlerId Id of the client handler.
+  @param client The removed client.
+*/
+void SSEChannel::ClientRemoved(int handlerId, SSEClient* client) {
+  _handler_clients[handlerId]--;
+  _num_clients--;
+  _last_activity = time(NULL);
 
-  if (curthread == _clientpool.end()) curthread = _clientpool.begin();
+  if (client->IsEvicted()) INC_LONG(_stats.num_backlog_evictions);
+  _stats.num_backlog_dropped_events += client->GetNumDropped();
 }
 
 /**
-  Broadcasts string to all connected clients.
-  @param data String to broadcast.
+  Account for a client that disconnected.
+  @param error True if the client was dropped due to a socket error.
 */
-void SSEChannel::Broadcast(const string& data) {
-  ClientHandlerList::iterator it;
+void SSEChannel::CountDisconnect(bool error) {
+  if (error) {
+    INC_LONG(_stats.num_errors);
+  } else {
+    INC_LONG(_stats.num_disconnects);
+  }
+}
+
+/**
+  Broadcasts a shared buffer to all connected clients.
+  @param data Buffer to broadcast.
+*/
+void SSEChannel::Broadcast(const SSEBufferPtr& data) {
+  ClientHandlerList::const_iterator it;
   std::lock_guard<std::mutex> lck (_broadcast_mtx);
 
-  for (it = _clientpool.begin(); it != _clientpool.end(); it++) {
-    (*it)->Broadcast(data);
+  for (it = _handlers.begin(); it != _handlers.end(); it++) {
+    if (_handler_clients[(*it)->GetId()] > 0) {
+      (*it)->Broadcast(shared_from_this(), data);
+    }
   }
 }
 
 /**
   Broadcasts SSEvent to all connected clients.
   @param event Event to broadcast.
+  @returns false if the channel has been closed and the event was not broadcasted.
 */
-void SSEChannel::BroadcastEvent(SSEEvent& event) {
-  Broadcast(event.get());
+bool SSEChannel::BroadcastEvent(SSEEvent& event) {
+  boost::shared_lock<boost::shared_mutex> lock(_state_lock);
+
+  if (_closed) return false;
+
+  _last_activity = time(NULL);
+  Broadcast(event.GetBuffer());
   INC_LONG(_stats.num_broadcasted_events);
 
   // Add event to cache if it contains a id field.
   if (!event.getid().empty()) {
     CacheEvent(event);
   }
+
+  return true;
 }
 
 /**
   Add event to cache.
+  Publishers are serialized, but replays keep reading the cache meanwhile.
   @param event Event to cache.
 */
 void SSEChannel::CacheEvent(SSEEvent& event) {
   if (_cache_adapter) {
+    boost::shared_lock<boost::shared_mutex> lock(_cache_lock);
+    std::lock_guard<std::mutex> writeLock(_cache_write_lock);
     _cache_adapter->CacheEvent(event);
+    _cache_generation++;
     _stats.num_cached_events = _cache_adapter->GetSizeOfCachedEvents();
+    _stats.cache_bytes = _cache_adapter->GetCachedBytes();
+    _stats.cache_memory_bytes = _cache_adapter->GetMemoryBytes();
   }
 }
 
 /**
-  Send all events since a given event id to client.
-  @param lastId Send all events since this id.
+  Get cached events rendered for replay.
+  Clients replaying from the same event share the rendered chunks, as long
+  as no event has been cached since they were rendered. The cache is read
+  without holding the replay cache lock, clients asking for events that are
+  already being read wait for that read instead of reading them again.
+  Events past cacheMaxAge are left out even if the cache still holds them.
+  @param mode REPLAY_SINCE_ID, REPLAY_SINCE_TIME or REPLAY_ALL.
+  @param lastId Get events since this id when mode is REPLAY_SINCE_ID.
+  @param since Get events that arrived at or after this time when mode is
+               REPLAY_SINCE_TIME, or when lastId is no longer cached. 0 if not set.
 */
-void SSEChannel::SendEventsSince(SSEClient* client, string lastId) {
-  deque<string>::const_iterator it;
-  deque<string> events = _cache_adapter->GetEventsSinceId(lastId);
+SSEReplayBlobPtr SSEChannel::GetReplay(ReplayMode mode, const string& lastId, uint64_t since) {
+  SSEReplayKey key(mode, lastId, since);
+  uint64_t now = SSETimer::Now();
+  SSEReplayFetchPtr fetch;
+  bool reader = false;
+
+  {
+    std::lock_guard<std::mutex> lock(_replay_cache_lock);
+
+    // Everything rendered, or being rendered, before the cache changed is stale.
+    if (_replay_cache_generation != _cache_generation) {
+      _replay_cache.clear();
+      _replay_fetches.clear();
+      _replay_cache_generation = _cache_generation;
+    }
+
+    map<SSEReplayKey, SSEReplayBlobPtr>::const_iterator it = _replay_cache.find(key);
+    if (it != _replay_cache.end() && (it->second->expires == 0 || now <= it->second->expires)) {
+      _stats.num_replay_cache_hits++;
+      return it->second;
+    }
 
-  BOOST_FOREACH(const string& event, events) {
-    client->Send(event);
+    map<SSEReplayKey, SSEReplayFetchPtr>::const_iterator pending = _replay_fetches.find(key);
+    if (pending != _replay_fetches.end()) {
+      _stats.num_replay_cache_hits++;
+      fetch = pending->second;
+    } else {
+      _stats.num_replay_cache_misses++;
+      fetch = SSEReplayFetchPtr(new SSEReplayFetch());
+      fetch->result = fetch->promise.get_future().share();
+      _replay_fetches[key] = fetch;
+      reader = true;
+    }
   }
+
+  // Another client is reading the same events.
+  if (!reader) return fetch->result.get();
+
+  ulong generation;
+  SSEReplayBlobPtr blob;
+
+  try {
+    blob = ReadReplay(mode, lastId, since, now, generation);
+  } catch (...) {
+    {
+      std::lock_guard<std::mutex> lock(_replay_cache_lock);
+      FinishFetch(key, fetch);
+    }
+
+    fetch->promise.set_exception(std::current_exception());
+    throw;
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(_replay_cache_lock);
+    FinishFetch(key, fetch);
+
+    // Only keep it if no events were cached while we read the cache.
+    if (generation == _replay_cache_generation) {
+      if (_replay_cache.size() >= REPLAY_CACHE_SIZE) _replay_cache.clear();
+      _replay_cache[key] = blob;
+    }
+  }
+
+  fetch->promise.set_value(blob);
+  return blob;
 }
 
 /**
-  Send all cached events to client.
-  @param client SSEClient.
+  Stop sending clients to a replay read that is done.
+  Must be called with _replay_cache_lock held.
+  @param key Events that were read.
+  @param fetch The read, a newer read of the same events is left alone.
 */
-void SSEChannel::SendCache(SSEClient* client) {
- deque<string>::const_iterator it;
- deque<string> events = _cache_adapter->GetAllEvents();
-
-  BOOST_FOREACH(const string& event, events) {
-    client->Send(event);
-  }
+void SSEChannel::FinishFetch(const SSEReplayKey& key, const SSEReplayFetchPtr& fetch) {
+  map<SSEReplayKey, SSEReplayFetchPtr>::iterator pending = _replay_fetches.find(key);
+  if (pending != _replay_fetches.end() && pending->second == fetch) _replay_fetches.erase(pending);
 }
 
 /**
- Handle client disconnects and errors.
+  Read cached events from the cache adapter and render them for replay.
+  @param mode REPLAY_SINCE_ID, REPLAY_SINCE_TIME or REPLAY_ALL.
+  @param lastId Get events since this id when mode is REPLAY_SINCE_ID.
+  @param since Get events that arrived at or after this time, see GetReplay().
+  @param now Current time in milliseconds, for leaving out expired events.
+  @param generation Set to the cache generation the events were read at.
 */
-void SSEChannel::CleanupMain() {
-  boost::shared_ptr<struct epoll_event[]> t_events(new struct epoll_event[1024]);
-
-  while(!stop) {
-    int n = epoll_wait(_efd, t_events.get(), 1024, -1);
-
-    for (int i = 0; i < n; i++) {
-      SSEClient* client;
-      client = static_cast<SSEClient*>(t_events[i].data.ptr);
-
-      if (t_events[i].events & EPOLLIN) {
-        char buf[512];
-        int rcv_len = client->Read(buf, 512);
-        if (rcv_len <= 0) {
-          client->MarkAsDead();
-          INC_LONG(_stats.num_disconnects);
-        }
-      } else if ((t_events[i].events & EPOLLHUP)  || (t_events[i].events & EPOLLRDHUP)) {
-        DLOG(INFO) << "Channel " << _config.id << ": Client disconnected.";
-        client->MarkAsDead();
-        INC_LONG(_stats.num_disconnects);
-      } else if (t_events[i].events & EPOLLERR) {
-        // If an error occurs on a client socket, just drop the connection.
-        DLOG(INFO) << "Channel " << _config.id << ": Error on client socket: " << strerror(errno);
-        client->MarkAsDead();
-        INC_LONG(_stats.num_errors);
-      } else if (t_events[i].events & EPOLLOUT) {
-        // Send data present in send buffer,
-        DLOG(INFO) << client->GetIP() << ": EPOLLOUT, flushing send buffer.";
-        client->Flush();
-      }
+SSEReplayBlobPtr SSEChannel::ReadReplay(ReplayMode mode, const string& lastId, uint64_t since, uint64_t now, ulong& generation) {
+  SSEBufferList events;
+
+  {
+    // Read the generation first, a blob that raced with a publish is dropped on the next call.
+    boost::shared_lock<boost::shared_mutex> cacheLock(_cache_lock);
+    generation = _cache_generation;
+
+    if (_cache_adapter && mode != REPLAY_SINCE_TIME && !_cache_adapter->GetFileEvents(lastId, mode == REPLAY_ALL, events)) {
+      events = (mode == REPLAY_ALL) ? _cache_adapter->GetAllEvents() : _cache_adapter->GetEventsSinceId(lastId);
     }
+
+    // A client whose last event is no longer cached resumes from the time instead.
+    if (_cache_adapter && since > 0 && events.empty() && !_cache_adapter->GetFileEventsSinceTime(since, events)) {
+      events = _cache_adapter->GetEventsSinceTime(since);
+    }
+  }
+
+  uint64_t expires = 0;
+
+  if (_config.cacheMaxAge > 0) {
+    const uint64_t maxAge = (uint64_t)_config.cacheMaxAge * 1000;
+    SSEBufferList fresh;
+
+    BOOST_FOREACH(const SSEBufferPtr& event, events) {
+      if (CacheInterface::IsExpired(event->GetTime(), now, _config.cacheMaxAge)) continue;
+
+      fresh.push_back(event);
+      if (expires == 0 || event->GetTime() + maxAge < expires) expires = event->GetTime() + maxAge;
+    }
+
+    events.swap(fresh);
   }
+
+  return RenderReplay(events, expires);
 }
 
 /**
-  Sends a ping to all clients connected to this channel.
+  Concatenate events into chunks of about REPLAY_CHUNK_SIZE bytes.
+  File backed events are not copied, adjacent ones are merged into file
+  backed chunks instead.
+  @param events Events to render.
+  @param expires When the oldest event expires, 0 if never.
 */
-void SSEChannel::Ping() {
-  string pingMsg;
-  if (_config.server->GetValueBool("server.pingEvent")) {
-    pingMsg = "event: ping\ndata:\n\n";
-  } else {
-    pingMsg = ":\n\n";
-  }
+SSEReplayBlobPtr SSEChannel::RenderReplay(const SSEBufferList& events, uint64_t expires) {
+  boost::shared_ptr<SSEReplayBlob> blob(new SSEReplayBlob());
+  SSEBufferPtr range;
+  string chunk;
+
+  blob->expires = expires;
 
-  while(!stop) {
-    Broadcast(pingMsg);
-    sleep(_config.server->GetValueInt("server.pingInterval"));
+  BOOST_FOREACH(const SSEBufferPtr& event, events) {
+    if (!event->GetId().empty()) blob->ids.insert(event->GetId());
+
+    if (event->IsFile()) {
+      if (!chunk.empty()) {
+        blob->chunks.push_back(SSEBufferPtr(new SSEBuffer(chunk)));
+        chunk.clear();
+      }
+
+      // The chunk holds on to the event, which keeps the file open.
+      if (range && range->GetFd() == event->GetFd() &&
+          range->GetOffset() + (off_t)range->GetLength() == event->GetOffset() &&
+          range->GetLength() < REPLAY_CHUNK_SIZE) {
+        range = SSEBufferPtr(new SSEBuffer(range->GetFd(), range->GetOffset(),
+          range->GetLength() + event->GetLength(), event));
+        blob->chunks.back() = range;
+      } else {
+        range = SSEBufferPtr(new SSEBuffer(event->GetFd(), event->GetOffset(), event->GetLength(), event));
+        blob->chunks.push_back(range);
+      }
+
+      continue;
+    }
+
+    range.reset();
+    chunk.append(event->GetData());
+
+    if (chunk.size() >= REPLAY_CHUNK_SIZE) {
+      blob->chunks.push_back(SSEBufferPtr(new SSEBuffer(chunk)));
+      chunk.clear();
+    }
   }
+
+  if (!chunk.empty()) blob->chunks.push_back(SSEBufferPtr(new SSEBuffer(chunk)));
+
+  return blob;
 }
 
 /**
   Returns number of clients connected to this channel.
 */
 ulong SSEChannel::GetNumClients() {
-  ClientHandlerList::iterator it;
-  ulong numclients = 0;
-
-  for (it = _clientpool.begin(); it != _clientpool.end(); it++) {
-    numclients += (*it)->GetNumClients();
-  }
-
-  return numclients;
+  return _num_clients;
 }
 
 /**
@@ -367,7 +547,28 @@ ulong SSEChannel::GetNumClients() {
  @param stats Pointer to SSEChannelStats struct which is to be filled with the statistics.
 **/
 const SSEChannelStats& SSEChannel::GetStats() {
+  ClientHandlerList::const_iterator it;
+
   _stats.num_clients = GetNumClients();
+  _stats.backlog_bytes = 0;
+  _stats.max_client_backlog_bytes = 0;
+
+  for (it = _handlers.begin(); it != _handlers.end(); it++) {
+    size_t total, max;
+
+    if (_handler_clients[(*it)->GetId()] < 1) continue;
+
+    (*it)->GetBacklogStats(this, total, max);
+    _stats.backlog_bytes += total;
+    if (max > _stats.max_client_backlog_bytes) _stats.max_client_backlog_bytes = max;
+  }
+
+  {
+    // Not while the cache is purged or its memory released.
+    boost::shared_lock<boost::shared_mutex> lock(_cache_lock);
+    if (_cache_adapter) _cache_adapter->GetTierStats(_stats.num_hot_cache_hits, _stats.num_hot_cache_misses);
+  }
+
   return _stats;
 }
 
@@ -377,3 +578,66 @@ const SSEChannelStats& SSEChannel::GetStats() {
 const ChannelConfig& SSEChannel::GetConfig() {
   return _config;
 }
+
+/**
+  Close the channel if it has had no clients and no events for a while.
+  A closed channel refuses new clients and events, so it can be dropped
+  once it is removed from the channel registry.
+  @param timeout Number of seconds the channel must have been idle.
+  @returns true if the channel was closed.
+*/
+bool SSEChannel::CloseIfIdle(int timeout) {
+  // Don't wait for clients being added or events being broadcasted, the channel is not idle then anyway.
+  boost::unique_lock<boost::shared_mutex> lock(_state_lock, boost::try_to_lock);
+  if (!lock.owns_lock()) return false;
+
+  if (_closed) return true;
+  if (_num_clients > 0) return false;
+  if (time(NULL) - _last_activity < timeout) return false;
+
+  _closed = true;
+  return true;
+}
+
+/**
+  Remove all cached events, including persisted ones.
+*/
+void SSEChannel::PurgeCache() {
+  if (_cache_adapter) {
+    boost::unique_lock<boost::shared_mutex> lock(_cache_lock);
+    _cache_adapter->Purge();
+    _cache_generation++;
+    _stats.num_cached_events = 0;
+    _stats.cache_bytes = 0;
+    _stats.cache_memory_bytes = 0;
+  }
+}
+
+/**
+  Drop the cached events held in memory to free it up.
+  Persisted events stay cached and are replayed from the adapter's store.
+*/
+void SSEChannel::ReleaseCacheMemory() {
+  if (_cache_adapter) {
+    boost::unique_lock<boost::shared_mutex> lock(_cache_lock);
+    _cache_adapter->ReleaseMemory();
+    _cache_generation++;
+    _stats.num_cached_events = _cache_adapter->GetSizeOfCachedEvents();
+    _stats.cache_bytes = _cache_adapter->GetCachedBytes();
+    _stats.cache_memory_bytes = _cache_adapter->GetMemoryBytes();
+  }
+}
+
+/**
+  Returns the size of the cached event data held in memory.
+*/
+ulong SSEChannel::GetCacheMemoryBytes() {
+  return _stats.cache_memory_bytes;
+}
+
+/**
+  Returns when a client was last added or removed, or an event last broadcasted.
+*/
+time_t SSEChannel::GetLastActivity() {
+  return _last_activity;
+}
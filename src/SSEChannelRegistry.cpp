@@ -0,0 +1,109 @@
+#include <functional>
+#include "Common.h"
+#include "SSEChannelRegistry.h"
+#include "SSEChannel.h"
+
+using namespace std;
+
+/**
+  Constructor.
+*/
+SSEChannelRegistry::SSEChannelRegistry() {
+}
+
+/**
+  Returns the shard a channel id belongs to.
+  @param id Channel id.
+*/
+SSEChannelRegistry::Shard& SSEChannelRegistry::GetShard(const string& id) {
+  return _shards[std::hash<string>()(id) % CHANNEL_REGISTRY_SHARDS];
+}
+
+/**
+  Look up a channel.
+  @param id Channel id.
+  @returns the channel, or a empty pointer if it does not exist.
+*/
+SSEChannelPtr SSEChannelRegistry::Get(const string& id) {
+  Shard& shard = GetShard(id);
+  boost::shared_lock<boost::shared_mutex> lock(shard.lock);
+  SSEChannelMap::const_iterator it = shard.channels.find(id);
+
+  if (it == shard.channels.end()) return SSEChannelPtr();
+
+  return it->second;
+}
+
+/**
+  Get a channel, creating it if it does not exist.
+  Creation only blocks other creations in the same shard, lookups only
+  wait for the channel to be inserted.
+  @param id Channel id.
+  @param conf Configuration to create the channel with.
+  @param handlers Client handlers the channel should use.
+*/
+SSEChannelPtr SSEChannelRegistry::Create(const string& id, const ChannelConfig& conf, const ClientHandlerList& handlers) {
+  Shard& shard = GetShard(id);
+  std::lock_guard<std::mutex> createLock(shard.create_lock);
+
+  // Someone else might have created it while we waited for the lock.
+  SSEChannelPtr ch = Get(id);
+  if (ch) return ch;
+
+  ch = SSEChannelPtr(new SSEChannel(conf, id, handlers));
+
+  boost::unique_lock<boost::shared_mutex> lock(shard.lock);
+  shard.channels[id] = ch;
+
+  return ch;
+}
+
+/**
+  Remove a channel from the registry.
+  Lookups already holding the channel keeps it alive until they are done with it.
+  @param ch Channel to remove.
+  @returns false if the channel was not registered.
+*/
+bool SSEChannelRegistry::Remove(const SSEChannelPtr& ch) {
+  const string id = ch->GetId();
+  Shard& shard = GetShard(id);
+  boost::unique_lock<boost::shared_mutex> lock(shard.lock);
+  SSEChannelMap::iterator it = shard.channels.find(id);
+
+  if (it == shard.channels.end() || it->second != ch) return false;
+
+  shard.channels.erase(it);
+
+  return true;
+}
+
+/**
+  Returns a snapshot of all registered channels.
+*/
+SSEChannelList SSEChannelRegistry::GetChannels() {
+  SSEChannelList list;
+
+  for (int i = 0; i < CHANNEL_REGISTRY_SHARDS; i++) {
+    boost::shared_lock<boost::shared_mutex> lock(_shards[i].lock);
+
+    for (SSEChannelMap::const_iterator it = _shards[i].channels.begin(); it != _shards[i].channels.end(); it++) {
+      list.push_back(it->second);
+    }
+  }
+
+  return list;
+}
+
+/**
+  Returns number of registered channels.
+*/
+size_t SSEChannelRegistry::Size() {
+  size_t size = 0;
+
+  for (int i = 0; i < CHANNEL_REGISTRY_SHARDS; i++) {
+    boost::shared_lock<boost::shared_mutex> lock(_shards[i].lock);
+    size += _shards[i].channels.size();
+  }
+
+  return size;
+}
@@ -1,5 +1,6 @@
 #include "Common.h"
 #include <sys/socket.h>
+#include <sys/sendfile.h>
 #include <arpa/inet.h>
 #include <netinet/tcp.h>
 #include <boost/shared_ptr.hpp>
@@ -16,7 +17,13 @@
 SSEClient::SSEClient(int fd, struct sockaddr_in* csin) {
   _fd = fd;
   _epoll_fd = -1;
+  _channel = NULL;
   _dead = false;
+  _evicted = false;
+  _max_backlog_bytes = 0;
+  _max_backlog_events = 0;
+  _backlog_policy = BACKLOG_DISCONNECT;
+  _num_dropped = 0;
  
    memcpy(&_csin, csin, sizeof(struct sockaddr_in));
   DLOG(INFO) << "Initialized client with IP: " << GetIP();
@@ -48,46 +55,180 @@ void SSEClient::Destroy() {
   delete(this);
 }
 
-size_t SSEClient::_prune_write_buffer(size_t bytes) {
-  if (_write_buffer.length() < 1) {
-    return 0;
-  }
+/**
+ Write as much as possible of the write buffer to the socket using writev(),
+ file backed buffers are sent with sendfile().
+ Must be called with _write_lock held.
+*/
+ssize_t SSEClient::_flush_write_buffer() {
+  struct iovec iov[IOVEC_SIZE];
+  ssize_t total = 0;
+
+  while (!_write_buffer.Empty()) {
+    size_t len;
+    ssize_t ret;
+    int fd;
+    off_t offset;
+
+    if (_write_buffer.GetFileRange(fd, offset, len)) {
+      ret = ::sendfile(_fd, fd, &offset, len);
+
+      // The file was truncated under us, the rest of the frame can never be sent.
+      if (ret == 0) {
+        LOG(ERROR) << GetIP() << ": Cached event file ended early, disconnecting client.";
+        _dead = true;
+        _write_buffer.Clear();
+        close(_fd);
+        return -1;
+      }
+    } else {
+      size_t iovcnt = _write_buffer.FillIovec(iov, IOVEC_SIZE, len);
+      ret = ::writev(_fd, iov, iovcnt);
+    }
+
+    if (ret <= 0) {
+      DLOG(INFO) << GetIP() << ": write error: " << strerror(errno);
+      _enable_epoll_out();
+      return (total > 0) ? total : ret;
+    }
+
+    total += ret;
+    _write_buffer.Consume(ret);
 
-  if (bytes >= _write_buffer.length()) {
-    _write_buffer.clear();
-    return 0;
+    if ((size_t)ret < len) {
+      DLOG(INFO) << GetIP() << ": Could not write entire buffer, wrote " << ret << " of " << len << " bytes.";
+      _enable_epoll_out();
+      return total;
+    }
   }
 
-  _write_buffer = _write_buffer.substr(bytes, string::npos);
-  return _write_buffer.length();
+  _disable_epoll_out();
+
+  return total;
 }
 
+/**
+ Send data to the client.
+ @param data String to send.
+*/
 ssize_t SSEClient::Send(const string &data) {
+  if (data.empty()) return Flush();
+  return Send(SSEBufferPtr(new SSEBuffer(data)));
+}
+
+/**
+ Queue a shared buffer for the client and flush the write queue.
+ The buffer is referenced by the write queue, not copied.
+ @param buf Buffer to send.
+*/
+ssize_t SSEClient::Send(const SSEBufferPtr& buf) {
   std::lock_guard<std::mutex> lock(_write_lock);
-  int ret = 0;
 
-  _write_buffer.append(data);
-  if (_write_buffer.empty()) return 0;
+  if (_dead) return -1;
 
-  ret = ::write(_fd, _write_buffer.c_str(), _write_buffer.length());
+  _enqueue(buf);
+  if (_dead) return -1;
 
-  if (ret <= 0) {
-    DLOG(INFO) << GetIP() << ": write error: " << strerror(errno);
-    _enable_epoll_out();
-  } else if ((unsigned int)ret < _write_buffer.length()) {
-    DLOG(INFO) << GetIP() << ": Could not write() entire buffer, wrote " << ret << " of " << _write_buffer.length() << " bytes.";
-    _prune_write_buffer(ret);
-    _enable_epoll_out();
-  } else {
-    _disable_epoll_out();
-    _write_buffer.clear();
+  return _flush_write_buffer();
+}
+
+/**
+ Queue a batch of shared buffers for the client and flush them with
+ as few writes as possible.
+ @param batch Buffers to send, in order.
+*/
+ssize_t SSEClient::Send(const vector<SSEBufferPtr>& batch) {
+  std::lock_guard<std::mutex> lock(_write_lock);
+
+  for (vector<SSEBufferPtr>::const_iterator it = batch.begin(); it != batch.end(); it++) {
+    if (_dead) return -1;
+    _enqueue(*it);
   }
 
-  return ret;
+  if (_dead) return -1;
+
+  return _flush_write_buffer();
+}
+
+/**
+ Add buffer to the write buffer, applying the backlog policy.
+ Must be called with _write_lock held.
+ @param buf Buffer to queue.
+*/
+void SSEClient::_enqueue(const SSEBufferPtr& buf) {
+  if (_backlog_policy == BACKLOG_CONFLATE && !_write_buffer.Empty()) {
+    _num_dropped += _write_buffer.Conflate(buf->GetId());
+  }
+
+  _write_buffer.Append(buf);
+  _enforce_backlog_limits();
 }
 
+/**
+ Apply the backlog policy if the write buffer exceeds the configured limits.
+ Must be called with _write_lock held.
+*/
+void SSEClient::_enforce_backlog_limits() {
+  bool exceeded = (_max_backlog_bytes > 0 && _write_buffer.GetSize() > _max_backlog_bytes) ||
+    (_max_backlog_events > 0 && _write_buffer.GetNumSegments() > _max_backlog_events);
+
+  if (!exceeded) return;
+
+  if (_backlog_policy == BACKLOG_DISCONNECT) {
+    DLOG(INFO) << GetIP() << ": Backlog limit exceeded, disconnecting client.";
+    _evicted = true;
+    _dead = true;
+    _write_buffer.Clear();
+    close(_fd);
+    return;
+  }
+
+  _num_dropped += _write_buffer.DropOldest(_max_backlog_bytes, _max_backlog_events);
+}
+
+/**
+ Set limits for how much data can be queued for the client.
+ Data already queued, e.g. response headers, is never dropped.
+ @param maxBytes Max number of queued bytes, 0 for unlimited.
+ @param maxEvents Max number of queued events, 0 for unlimited.
+ @param policy What to do when a limit is exceeded.
+*/
+void SSEClient::SetBacklogLimits(size_t maxBytes, size_t maxEvents, BacklogPolicy policy) {
+  std::lock_guard<std::mutex> lock(_write_lock);
+
+  _max_backlog_bytes = maxBytes;
+  _max_backlog_events = maxEvents;
+  _backlog_policy = policy;
+  _write_buffer.Pin();
+}
+
+/**
+ Returns true if the client was disconnected because it exceeded its backlog limits.
+*/
+bool SSEClient::IsEvicted() {
+  return _evicted;
+}
+
+/**
+ Returns number of queued events dropped due to backlog limits.
+*/
+size_t SSEClient::GetNumDropped() {
+  return _num_dropped;
+}
+
+/**
+ Flush pending data in the write queue.
+*/
 ssize_t SSEClient::Flush() {
-  return Send("");
+  std::lock_guard<std::mutex> lock(_write_lock);
+  return _flush_write_buffer();
+}
+
+/**
+ Returns number of bytes queued for the client but not yet written.
+*/
+size_t SSEClient::GetBacklogSize() {
+  return _write_buffer.GetSize();
 }
 
 /**
@@ -121,20 +262,56 @@ void SSEClient::_disable_epoll_out() {
   }
 }
 
+/**
+ Add the client socket to an epoll set.
+ Data still queued, e.g. headers written while the client was handed over,
+ gets flushed on EPOLLOUT as well.
+ @param epoll_fd Epoll set to add the socket to.
+ @param events Epoll event mask.
+*/
 int SSEClient::AddToEpoll(int epoll_fd, uint32_t events) {
+  std::lock_guard<std::mutex> lock(_write_lock);
+
+  if (!_write_buffer.Empty()) events |= EPOLLOUT;
+
   _epoll_event.events = events;
   _epoll_event.data.fd = _fd;
   _epoll_event.data.ptr = static_cast<SSEClient*>(this);
 
+  // The client may be handled, and even destroyed, by another thread as soon as it is added.
+  _epoll_fd = epoll_fd;
   int ret = epoll_ctl(epoll_fd, EPOLL_CTL_ADD, _fd, &_epoll_event);
 
-  if (ret == 0) {
-    _epoll_fd = epoll_fd;
+  if (ret == -1) {
+    _epoll_fd = -1;
   }
 
   return ret;
 }
 
+int SSEClient::RemoveFromEpoll() {
+  if (_epoll_fd == -1) return 0;
+
+  int ret = epoll_ctl(_epoll_fd, EPOLL_CTL_DEL, _fd, NULL);
+  _epoll_fd = -1;
+
+  return ret;
+}
+
+/*
+  Set the channel the client is subscribed to.
+*/
+void SSEClient::SetChannel(SSEChannel* channel) {
+  _channel = channel;
+}
+
+/*
+  Get the channel the client is subscribed to.
+*/
+SSEChannel* SSEClient::GetChannel() {
+  return _channel;
+}
+
 /**
   Destructor.
 */
@@ -185,7 +362,10 @@ void SSEClient::DeleteHttpReq() {
  Mark client as dead and ready for removal.
 */
 void SSEClient::MarkAsDead() {
+  std::lock_guard<std::mutex> lock(_write_lock);
+  if (_dead) return;
   _dead = true;
+  _write_buffer.Clear();
   close(_fd);
 }
 
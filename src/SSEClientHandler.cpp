@@ -6,9 +6,12 @@
 #include <boost/shared_ptr.hpp>
 #include <boost/thread.hpp>
 #include <boost/bind.hpp>
+#include <boost/foreach.hpp>
 #include "Common.h"
 #include "SSEClientHandler.h"
 #include "SSEClient.h"
+#include "SSEChannel.h"
+#include "SSEConfig.h"
 
 extern int stop;
 
@@ -17,66 +20,471 @@ using namespace std;
 /**
   Constructor.
   @param tid unique ID to identify thread.
+  @param config Pointer to SSEConfig instance holding our configuration.
+  @param shutdownfd File descriptor that becomes readable when the server shuts down.
 */
-SSEClientHandler::SSEClientHandler(int tid) {
+SSEClientHandler::SSEClientHandler(int tid, SSEConfig* config, int shutdownfd) : _msgqueue(HANDLER_QUEUE_SIZE) {
   DLOG(INFO) << "SSEClientHandler constructor called " << "id: " << tid;
   _id = tid;
+  _shutdown_fd = shutdownfd;
   _connected_clients = 0;
+  _coalesce_window = config->GetValueInt("server.coalesceWindowUsec");
+  for (int i = 0; i < BATCH_HIST_BUCKETS; i++) _batch_hist[i] = 0;
 
-  _processorthread = boost::thread(boost::bind(&SSEClientHandler::ProcessQueue, this));
+  _efd = epoll_create1(0);
+  LOG_IF(FATAL, _efd == -1) << "epoll_create1 failed.";
+
+  // Wake up when messages are queued for us.
+  struct epoll_event event;
+  event.events = EPOLLIN;
+  event.data.ptr = NULL;
+  LOG_IF(FATAL, epoll_ctl(_efd, EPOLL_CTL_ADD, _msgqueue.GetEventFd(), &event) == -1) << "Failed to add message queue to epoll.";
+
+  event.data.ptr = &_shutdown_fd;
+  LOG_IF(FATAL, epoll_ctl(_efd, EPOLL_CTL_ADD, _shutdown_fd, &event) == -1) << "Failed to add shutdown notification to epoll.";
+
+  // Ping our clients on server.pingInterval.
+  if (config->GetValueBool("server.pingEvent")) {
+    _ping_msg = SSEBufferPtr(new SSEBuffer("event: ping\ndata:\n\n"));
+  } else {
+    _ping_msg = SSEBufferPtr(new SSEBuffer(":\n\n"));
+  }
+
+  event.data.ptr = &_ping_timer;
+  LOG_IF(FATAL, epoll_ctl(_efd, EPOLL_CTL_ADD, _ping_timer.GetFd(), &event) == -1) << "Failed to add ping timer to epoll.";
+  _ping_timer.SetInterval(config->GetValueInt("server.pingInterval") * 1000);
+
+  _fetch_stop = false;
+  _processorthread = boost::thread(boost::bind(&SSEClientHandler::Run, this));
+  _fetcherthread = boost::thread(boost::bind(&SSEClientHandler::RunFetcher, this));
 }
 
 /**
   Destructor.
+  Waits for the event loop to exit, the shutdown notification must have been sent.
 */
 SSEClientHandler::~SSEClientHandler() {
   DLOG(INFO) << "SSEClientHandler destructor called for " << "id: " << _id;
-  pthread_cancel(_processorthread.native_handle());
+  _processorthread.join();
+
+  {
+    boost::mutex::scoped_lock lock(_fetch_lock);
+    _fetch_stop = true;
+    _fetch_cond.notify_one();
+  }
+
+  _fetcherthread.join();
+  close(_efd);
+}
+
+/**
+  Returns the id of this clienthandler.
+*/
+int SSEClientHandler::GetId() {
+  return _id;
 }
 
 /**
   Add client to pool.
+  @param channel Channel the client is subscribed to.
   @param client SSEClient pointer.
+  @param replay Which cached events to send the client before live events.
+  @param lastId Send cached events since this id when replay is REPLAY_SINCE_ID.
+  @param since Send cached events that arrived at or after this time in milliseconds
+               when replay is REPLAY_SINCE_TIME, or when the id is no longer cached.
+  @returns false if the client could not be added, the caller still owns the client then.
 */
-void SSEClientHandler::AddClient(SSEClient* client) {
-  _clientlist.push_back(SSEClientPtr(client));
+bool SSEClientHandler::AddClient(SSEChannel* channel, SSEClient* client, ReplayMode replay, const string& lastId, uint64_t since) {
+  boost::mutex::scoped_lock lock(_clientlist_lock);
+
+  if (client->AddToEpoll(_efd, EPOLLIN | EPOLLHUP | EPOLLRDHUP | EPOLLERR) == -1) {
+    return false;
+  }
+
+  SSEClientPtr clientPtr(client);
+  _clients[channel].push_back(clientPtr);
   _connected_clients++;
   DLOG(INFO) << "Client added to thread id: " << _id;
+
+  if (replay != REPLAY_NONE) {
+    SSEReplay r;
+    r.client = clientPtr;
+    r.channel = channel->shared_from_this();
+    r.mode = replay;
+    r.lastId = lastId;
+    r.since = since;
+    r.fetching = false;
+    r.next_chunk = 0;
+    _new_replays.push_back(r);
+
+    // Wake up the event loop so it starts the replay.
+    _msgqueue.Push(SSEHandlerMsg());
+  }
+
+  return true;
 }
 
 /**
-  Broadcast message to all clients connected to this clienthandler.
-  @param msg String to broadcast.
+  Broadcast message to all clients of a channel connected to this clienthandler.
+  The queued message holds a reference to the channel, so it can not go away before it is processed.
+  @param channel Channel to broadcast to.
+  @param msg Shared buffer to broadcast.
 */
-void SSEClientHandler::Broadcast(const string msg) {
-  _msgqueue.Push(msg);
+void SSEClientHandler::Broadcast(const SSEChannelPtr& channel, const SSEBufferPtr& msg) {
+  SSEHandlerMsg hmsg;
+  hmsg.channel = channel;
+  hmsg.buf = msg;
+  _msgqueue.Push(hmsg);
 }
 
-void SSEClientHandler::ProcessQueue() {
+/**
+  Send message to all clients connected to this clienthandler regardless of channel.
+  @param msg Shared buffer to send.
+*/
+void SSEClientHandler::Ping(const SSEBufferPtr& msg) {
+  Broadcast(SSEChannelPtr(), msg);
+}
+
+/**
+  Event loop, waits for client socket events, queued messages, pings and shutdown.
+*/
+void SSEClientHandler::Run() {
+  boost::shared_ptr<struct epoll_event[]> t_events(new struct epoll_event[HANDLER_MAXEVENTS]);
+
   while(!stop) {
-    std::string msg;
-    _msgqueue.WaitPop(msg);
+    int timeout = (_msgqueue.PrepareWait() && !HasReplayWork()) ? -1 : 0;
+    int n = epoll_wait(_efd, t_events.get(), HANDLER_MAXEVENTS, timeout);
+    _msgqueue.FinishWait();
 
-    boost::mutex::scoped_lock lock(_clientlist_lock);
+    for (int i = 0; i < n; i++) {
+      // Message queue wakeup, handled below.
+      if (t_events[i].data.ptr == NULL) continue;
 
-    unsigned int i = 0;
-    for (SSEClientPtrList::iterator it = _clientlist.begin(); it != _clientlist.end();) {
-      SSEClientPtr client = static_cast<SSEClientPtr&>(*it);
+      if (t_events[i].data.ptr == &_shutdown_fd) return;
 
-      if (client->IsDead()) {
-        DLOG(INFO) << "Removing disconnected client from clienthandler.";
-        it = _clientlist.erase(it);
-        _connected_clients--;
+      if (t_events[i].data.ptr == &_ping_timer) {
+        if (_ping_timer.Read() > 0) Ping(_ping_msg);
         continue;
       }
 
-      client->Send(msg);
+      HandleClientEvent(static_cast<SSEClient*>(t_events[i].data.ptr), t_events[i].events);
+    }
+
+    ProcessQueue();
+    ProcessReplays();
+  }
+}
+
+/**
+  Replay fetcher thread, reads the cached events for replays so a slow
+  cache backend does not stall the event loop. The events are passed back
+  to the event loop through the message queue.
+*/
+void SSEClientHandler::RunFetcher() {
+  for (;;) {
+    SSEReplay r;
+
+    {
+      boost::mutex::scoped_lock lock(_fetch_lock);
+
+      while (_fetch_queue.empty() && !_fetch_stop) {
+        _fetch_cond.wait(lock);
+      }
+
+      if (_fetch_stop) return;
+
+      r = _fetch_queue.front();
+      _fetch_queue.pop_front();
+    }
+
+    SSEHandlerMsg msg;
+    msg.client = r.client;
+    msg.blob = r.channel->GetReplay(r.mode, r.lastId, r.since);
+
+    while (!_msgqueue.TryPush(msg)) {
+      if (stop) return;
+      boost::this_thread::yield();
+    }
+  }
+}
+
+/**
+ Handle client disconnects, errors and writability.
+ Clients that hang up or fail are removed from the pool right away.
+ @param client Client the event occurred on.
+ @param events Epoll event mask.
+*/
+void SSEClientHandler::HandleClientEvent(SSEClient* client, uint32_t events) {
+  SSEChannel* channel = client->GetChannel();
+
+  if (events & EPOLLERR) {
+    // If an error occurs on a client socket, just drop the connection.
+    DLOG(INFO) << "Channel " << channel->GetId() << ": Error on client socket: " << strerror(errno);
+    RemoveDeadClient(client, true);
+    return;
+  }
+
+  if ((events & EPOLLHUP) || (events & EPOLLRDHUP)) {
+    DLOG(INFO) << "Channel " << channel->GetId() << ": Client disconnected.";
+    RemoveDeadClient(client, false);
+    return;
+  }
+
+  if (events & EPOLLIN) {
+    char buf[512];
+    int rcv_len = client->Read(buf, 511);
+    if (rcv_len <= 0) {
+      RemoveDeadClient(client, false);
+      return;
+    }
+  }
+
+  if (events & EPOLLOUT) {
+    // Send data present in send buffer,
+    DLOG(INFO) << client->GetIP() << ": EPOLLOUT, flushing send buffer.";
+    client->Flush();
+  }
+}
+
+/**
+  Close a client that went away and remove it from the pool, instead of
+  waiting for the next broadcast to its channel.
+  The client may be deleted when this returns.
+  @param client Client to remove.
+  @param error The connection failed rather than being closed.
+*/
+void SSEClientHandler::RemoveDeadClient(SSEClient* client, bool error) {
+  SSEChannel* channel = client->GetChannel();
+  boost::mutex::scoped_lock lock(_clientlist_lock);
+
+  client->MarkAsDead();
+  channel->CountDisconnect(error);
+
+  SSEChannelClientMap::iterator clients = _clients.find(channel);
+  if (clients == _clients.end()) return;
+
+  for (SSEClientPtrList::iterator it = clients->second.begin(); it != clients->second.end(); it++) {
+    if (it->get() != client) continue;
+
+    RemoveClient(channel, clients->second, it);
+    if (clients->second.empty()) _clients.erase(clients);
+    return;
+  }
+}
+
+/**
+  Drain all queued messages and send them to every client of the
+  channel they were broadcast to as one batch per client.
+*/
+void SSEClientHandler::ProcessQueue() {
+  vector<SSEHandlerMsg> msgs;
+  map<SSEChannel*, vector<SSEBufferPtr> > batches;
+
+  if (_msgqueue.PopAll(msgs) == 0) return;
+
+  // Give publishers a chance to queue up more messages so they can be written in one go.
+  if (_coalesce_window > 0) {
+    usleep(_coalesce_window);
+    _msgqueue.PopAll(msgs);
+  }
+
+  INC_LONG(_batch_hist[GetBatchBucket(msgs.size())]);
+
+  boost::mutex::scoped_lock lock(_clientlist_lock);
+
+  // Clients added since the last round must not get live events before their replay.
+  StartReplays();
+
+  BOOST_FOREACH(const SSEHandlerMsg& msg, msgs) {
+    // Events fetched for a replay, unless the client has gone away meanwhile.
+    if (msg.blob) {
+      SSEReplayMap::iterator replay = _replays.find(msg.client.get());
+      if (replay != _replays.end() && replay->second.client == msg.client) replay->second.blob = msg.blob;
+      continue;
+    }
+
+    // Wakeup only.
+    if (!msg.buf) continue;
+
+    if (msg.channel) {
+      batches[msg.channel.get()].push_back(msg.buf);
+      continue;
+    }
+
+    // Messages without a channel goes to everyone.
+    for (SSEChannelClientMap::iterator it = _clients.begin(); it != _clients.end(); it++) {
+      batches[it->first].push_back(msg.buf);
+    }
+  }
+
+  for (map<SSEChannel*, vector<SSEBufferPtr> >::iterator it = batches.begin(); it != batches.end(); it++) {
+    SSEChannelClientMap::iterator clients = _clients.find(it->first);
+    if (clients == _clients.end()) continue;
+
+    SendBatch(it->first, clients->second, it->second);
+
+    if (clients->second.empty()) _clients.erase(clients);
+  }
+}
+
+/**
+  Send cached events to newly added clients in chunks, once the fetcher has read them.
+  A client only gets the next chunk when it has written most of the previous
+  one, so a large replay neither floods slow clients nor stalls the event loop.
+  The chunks are shared with other clients replaying from the same event.
+  Live events that arrived meanwhile are sent when the replay is done,
+  except those that were already part of the replay.
+*/
+void SSEClientHandler::ProcessReplays() {
+  {
+    boost::mutex::scoped_lock lock(_clientlist_lock);
+    StartReplays();
+  }
+
+  for (SSEReplayMap::iterator it = _replays.begin(); it != _replays.end();) {
+    SSEReplay& r = it->second;
+
+    // Clients that died while writing are removed from the pool on the next broadcast.
+    if (r.client->IsDead()) {
+      _replays.erase(it++);
+      continue;
+    }
+
+    // Wait for the fetcher to read the cached events.
+    if (!r.blob) {
+      if (!r.fetching) {
+        boost::mutex::scoped_lock lock(_fetch_lock);
+        _fetch_queue.push_back(r);
+        _fetch_cond.notify_one();
+        r.fetching = true;
+      }
+
+      it++;
+      continue;
+    }
+
+    if (r.client->GetBacklogSize() >= REPLAY_MAX_BACKLOG) {
+      it++;
+      continue;
+    }
+
+    if (r.next_chunk < r.blob->chunks.size()) {
+      r.client->Send(r.blob->chunks[r.next_chunk++]);
+    }
 
+    if (r.next_chunk < r.blob->chunks.size()) {
       it++;
-      i++;
+      continue;
+    }
+
+    // Caught up, send the live events we held back.
+    vector<SSEBufferPtr> live;
+    BOOST_FOREACH(const SSEBufferPtr& event, r.live) {
+      if (event->GetId().empty() || r.blob->ids.find(event->GetId()) == r.blob->ids.end()) {
+        live.push_back(event);
+      }
     }
-    DLOG(INFO) << "Clienthandler " << _id << " broadcast to " << i << " clients.";
+
+    if (!live.empty()) r.client->Send(live);
+
+    _replays.erase(it++);
+  }
+}
+
+/**
+  Move replays of newly added clients to the running replays, so live
+  events for them are held back from now on.
+  Must be called with _clientlist_lock held.
+*/
+void SSEClientHandler::StartReplays() {
+  BOOST_FOREACH(const SSEReplay& r, _new_replays) {
+    _replays[r.client.get()] = r;
   }
+
+  _new_replays.clear();
+}
+
+/**
+  Returns true if there are replays that can make progress without waiting for client sockets.
+*/
+bool SSEClientHandler::HasReplayWork() {
+  boost::mutex::scoped_lock lock(_clientlist_lock);
+
+  if (!_new_replays.empty()) return true;
+
+  for (SSEReplayMap::iterator it = _replays.begin(); it != _replays.end(); it++) {
+    if (it->second.client->IsDead()) return true;
+
+    // The fetcher wakes us up when it is done.
+    if (!it->second.blob) {
+      if (!it->second.fetching) return true;
+      continue;
+    }
+
+    if (it->second.client->GetBacklogSize() < REPLAY_MAX_BACKLOG) return true;
+  }
+
+  return false;
+}
+
+/**
+  Send a batch of messages to clients, removing dead clients on the way.
+  Must be called with _clientlist_lock held.
+  @param channel Channel the clients are subscribed to.
+  @param clients List of clients.
+  @param batch Messages to send.
+*/
+void SSEClientHandler::SendBatch(SSEChannel* channel, SSEClientPtrList& clients, const vector<SSEBufferPtr>& batch) {
+  unsigned int i = 0;
+
+  for (SSEClientPtrList::iterator it = clients.begin(); it != clients.end();) {
+    SSEClientPtr client = static_cast<SSEClientPtr&>(*it);
+
+    if (client->IsDead()) {
+      DLOG(INFO) << "Removing disconnected client from clienthandler.";
+      RemoveClient(channel, clients, it);
+      continue;
+    }
+
+    // Hold back live events until the client has been sent the cached ones.
+    if (!_replays.empty()) {
+      SSEReplayMap::iterator replay = _replays.find(client.get());
+
+      if (replay != _replays.end()) {
+        replay->second.live.insert(replay->second.live.end(), batch.begin(), batch.end());
+        it++;
+        i++;
+        continue;
+      }
+    }
+
+    client->Send(batch);
+
+    if (client->IsEvicted()) {
+      DLOG(INFO) << "Removing client exceeding its backlog limits from clienthandler.";
+      RemoveClient(channel, clients, it);
+      continue;
+    }
+
+    it++;
+    i++;
+  }
+
+  DLOG(INFO) << "Clienthandler " << _id << " broadcast " << batch.size() << " messages to " << i << " clients.";
+}
+
+/**
+  Remove client from the pool and let the channel account for it.
+  Must be called with _clientlist_lock held.
+  @param channel Channel the client is subscribed to.
+  @param clients List the client is in.
+  @param it Iterator pointing to the client, advanced to the next client.
+*/
+void SSEClientHandler::RemoveClient(SSEChannel* channel, SSEClientPtrList& clients, SSEClientPtrList::iterator& it) {
+  _replays.erase(it->get());
+  channel->ClientRemoved(_id, it->get());
+  it = clients.erase(it);
+  _connected_clients--;
 }
 
 /**
@@ -85,3 +493,55 @@ void SSEClientHandler::ProcessQueue() {
 size_t SSEClientHandler::GetNumClients() {
   return _connected_clients;
 }
+
+/**
+  Get number of bytes queued but not yet written to clients of a channel.
+  @param channel Channel to get statistics for.
+  @param total Set to the sum of all client backlogs.
+  @param max Set to the largest client backlog.
+*/
+void SSEClientHandler::GetBacklogStats(SSEChannel* channel, size_t& total, size_t& max) {
+  boost::mutex::scoped_lock lock(_clientlist_lock);
+  total = 0;
+  max = 0;
+
+  SSEChannelClientMap::iterator clients = _clients.find(channel);
+  if (clients == _clients.end()) return;
+
+  for (SSEClientPtrList::iterator it = clients->second.begin(); it != clients->second.end(); it++) {
+    size_t backlog = (*it)->GetBacklogSize();
+    total += backlog;
+    if (backlog > max) max = backlog;
+  }
+}
+
+/**
+  Get distribution of number of messages sent per batch.
+  @param hist Array of BATCH_HIST_BUCKETS elements to add the counters to.
+*/
+void SSEClientHandler::GetBatchStats(ulong* hist) {
+  for (int i = 0; i < BATCH_HIST_BUCKETS; i++) {
+    hist[i] += _batch_hist[i];
+  }
+}
+
+/**
+  Returns the histogram bucket a batch size belongs to.
+  @param size Number of messages in batch.
+*/
+int SSEClientHandler::GetBatchBucket(size_t size) {
+  if (size <= 1) return 0;
+  if (size <= 4) return 1;
+  if (size <= 16) return 2;
+  if (size <= 64) return 3;
+  return 4;
+}
+
+/**
+  Returns a printable name for a batch size histogram bucket.
+  @param bucket Bucket index.
+*/
+const char* SSEClientHandler::GetBatchBucketName(int bucket) {
+  static const char* names[BATCH_HIST_BUCKETS] = { "1", "2-4", "5-16", "17-64", "65+" };
+  return names[bucket];
+}
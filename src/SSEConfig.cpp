@@ -33,9 +33,16 @@ void SSEConfig::InitDefaults() {
  ConfigMap["server.logdir"]                   = "./";
  ConfigMap["server.pingInterval"]             = "5";
  ConfigMap["server.pingEvent"]                = "false";
- ConfigMap["server.threadsPerChannel"]        = "5";
+ ConfigMap["server.reactorThreads"]           = "0";
+ ConfigMap["server.acceptThreads"]            = "1";
+ ConfigMap["server.routerThreads"]            = "1";
+ ConfigMap["server.listenBacklog"]            = "1024";
  ConfigMap["server.allowUndefinedChannels"]   = "true";
  ConfigMap["server.enablePost"]               = "false";
+ ConfigMap["server.coalesceWindowUsec"]       = "0";
+ ConfigMap["server.channelIdleTimeout"]       = "0";
+ ConfigMap["server.purgeReapedCache"]         = "false";
+ ConfigMap["server.cacheBytes"]               = "0";
 
  ConfigMap["amqp.enabled"]                    = "false";
  ConfigMap["amqp.heartbeatInterval"]          = "30";
@@ -48,12 +55,30 @@ void SSEConfig::InitDefaults() {
  ConfigMap["redis.host"]                      = "127.0.0.1";
  ConfigMap["redis.port"]                      = "6379";
  ConfigMap["redis.prefix"]                    = "ssehub";
+ ConfigMap["redis.poolSize"]                  = "8";
+ ConfigMap["redis.layout"]                    = "hash";
+ ConfigMap["redis.writeBehind"]               = "false";
+ ConfigMap["redis.writeQueueSize"]            = "10000";
 
  ConfigMap["leveldb.storageDir"]              = ".";
+ ConfigMap["leveldb.compression"]             = "true";
+
+ ConfigMap["segmentlog.storageDir"]           = ".";
+ ConfigMap["segmentlog.segmentSize"]          = "16777216";
+
+ ConfigMap["tiered.backend"]                  = "redis";
+ ConfigMap["tiered.hotLength"]                = "100";
+ ConfigMap["tiered.hotBytes"]                 = "1048576";
+ ConfigMap["tiered.writeQueueSize"]           = "10000";
 
  ConfigMap["default.cacheAdapter"]            = "redis";
  ConfigMap["default.cacheLength"]             = "500";
+ ConfigMap["default.cacheBytes"]              = "0";
+ ConfigMap["default.cacheMaxAge"]             = "0";
  ConfigMap["default.allowedOrigins"]          = "*";
+ ConfigMap["default.maxBacklogBytes"]         = "16777216";
+ ConfigMap["default.maxBacklogEvents"]        = "0";
+ ConfigMap["default.backlogPolicy"]           = "disconnect";
 }
 
 /**
@@ -135,6 +160,11 @@ void SSEConfig::LoadChannels(boost::property_tree::ptree& pt) {
   DefaultChannelConfig.server = this;
   DefaultChannelConfig.cacheAdapter = GetValue("default.cacheAdapter");
   DefaultChannelConfig.cacheLength = GetValueInt("default.cacheLength");
+  DefaultChannelConfig.cacheBytes = GetValueSize("default.cacheBytes");
+  DefaultChannelConfig.cacheMaxAge = GetValueSize("default.cacheMaxAge");
+  DefaultChannelConfig.maxBacklogBytes = GetValueSize("default.maxBacklogBytes");
+  DefaultChannelConfig.maxBacklogEvents = GetValueSize("default.maxBacklogEvents");
+  DefaultChannelConfig.backlogPolicy = GetBacklogPolicy(GetValue("default.backlogPolicy"));
 
   // Get default publish restrictions.
   try {
@@ -182,6 +212,11 @@ void SSEConfig::LoadChannels(boost::property_tree::ptree& pt) {
     // Optional channel parameters.
     ChannelMap[chName].cacheAdapter = child.second.get<std::string>("cacheAdapter", DefaultChannelConfig.cacheAdapter);
     ChannelMap[chName].cacheLength = child.second.get<int>("cacheLength", DefaultChannelConfig.cacheLength);
+    ChannelMap[chName].cacheBytes = child.second.get<size_t>("cacheBytes", DefaultChannelConfig.cacheBytes);
+    ChannelMap[chName].cacheMaxAge = child.second.get<size_t>("cacheMaxAge", DefaultChannelConfig.cacheMaxAge);
+    ChannelMap[chName].maxBacklogBytes = child.second.get<size_t>("maxBacklogBytes", DefaultChannelConfig.maxBacklogBytes);
+    ChannelMap[chName].maxBacklogEvents = child.second.get<size_t>("maxBacklogEvents", DefaultChannelConfig.maxBacklogEvents);
+    ChannelMap[chName].backlogPolicy = GetBacklogPolicy(child.second.get<std::string>("backlogPolicy", GetValue("default.backlogPolicy")));
    }
   } catch(...) {
     if (!GetValueBool("server.allowUndefinedChannels")) {
@@ -190,6 +225,19 @@ void SSEConfig::LoadChannels(boost::property_tree::ptree& pt) {
   }
 }
 
+/**
+ Translate a backlogPolicy config value.
+ @param policy One of disconnect, drop-oldest or conflate.
+**/
+BacklogPolicy SSEConfig::GetBacklogPolicy(const string& policy) {
+  if (policy == "disconnect") return BACKLOG_DISCONNECT;
+  if (policy == "drop-oldest") return BACKLOG_DROP_OLDEST;
+  if (policy == "conflate") return BACKLOG_CONFLATE;
+
+  LOG(FATAL) << "Invalid backlogPolicy in config: " << policy;
+  return BACKLOG_DISCONNECT;
+}
+
 /**
  Get an array from a config item.
  @param target Reference to array to populate with the result.
@@ -221,6 +269,18 @@ int SSEConfig::GetValueInt(const string& key) {
   }
 }
 
+/**
+  Fetch a config attribute and return as a size, for byte counts too large for a int.
+  @param key Config attribute to fetch.
+*/
+size_t SSEConfig::GetValueSize(const string& key) {
+  try  {
+    return boost::lexical_cast<size_t>(ConfigMap[key]);
+  } catch(...) {
+    return 0;
+  }
+}
+
 /**
  *  Fetch a config attribute and return as a boolean.
  *  @param key Config attribute to fetch.
@@ -2,12 +2,21 @@
 #include <boost/algorithm/string.hpp>
 #include "Common.h"
 #include "SSEEvent.h"
+#include "SSETimer.h"
 
 using namespace std;
 
 SSEEvent::SSEEvent(const string& jsondata) {
   _json_ss << jsondata;
   _retry = 0;
+  _time = SSETimer::Now();
+}
+
+/**
+  Wrap an already rendered event, e.g. to cache it again later.
+  @param buf Rendered event.
+*/
+SSEEvent::SSEEvent(const SSEBufferPtr& buf) : _id(buf->GetId()), _retry(0), _time(buf->GetTime()), _buffer(buf) {
 }
 
 SSEEvent::~SSEEvent() {
@@ -43,27 +52,50 @@ bool SSEEvent::compile() {
  return true;
 }
 
-const string SSEEvent::get() {
+/**
+  Returns the rendered SSE frame for this event.
+*/
+const string& SSEEvent::get() {
+  return GetBuffer()->GetData();
+}
+
+/**
+  Returns a shared buffer holding the rendered SSE frame.
+  The event is rendered on the first call only.
+*/
+const SSEBufferPtr& SSEEvent::GetBuffer() {
+  if (_buffer) return _buffer;
+
   stringstream ss;
 
-  if (_data.empty() || _path.empty()) return "";
+  if (!_data.empty() && !_path.empty()) {
+    if (!_id.empty()) ss << "id: " << _id << endl;
+    if (!_event.empty()) ss << "event: " << _event << endl;
+    if (_retry > 0) ss << "retry: " << _retry << endl;
 
-  if (!_id.empty()) ss << "id: " << _id << endl;
-  if (!_event.empty()) ss << "event: " << _event << endl;
-  if (_retry > 0) ss << "retry: " << _retry << endl;
+    vector<string>::iterator it;
+    for (it = _data.begin(); it != _data.end(); it++) {
+      ss << "data: " << *it << endl;
+    }
 
-  vector<string>::iterator it;
-  for (it = _data.begin(); it != _data.end(); it++) {
-    ss << "data: " << *it << endl;
+    ss << "\n";
   }
 
-  ss << "\n";
+  _buffer = SSEBufferPtr(new SSEBuffer(ss.str(), _id, _time));
 
-  return ss.str();
+  return _buffer;
 }
 
 void SSEEvent::setpath(const string path) {
   _path = path;
+  _buffer.reset();
+}
+
+/**
+  Returns when the event arrived, in milliseconds since the epoch.
+*/
+uint64_t SSEEvent::GetTime() {
+  return _time;
 }
 
 const string SSEEvent::getpath() {
@@ -1,4 +1,7 @@
 #include <stdlib.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <algorithm>
 #include <boost/foreach.hpp>
 #include <boost/bind.hpp>
 #include "Common.h"
@@ -19,7 +22,13 @@ using namespace std;
 */
 SSEServer::SSEServer(SSEConfig *config) {
   _config = config;
+  _num_reaped_channels = 0;
+  _num_cache_evictions = 0;
   stats.Init(_config, this);
+
+  // Becomes readable when we shut down, waking up every event loop waiting on it.
+  _shutdown_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  LOG_IF(FATAL, _shutdown_fd == -1) << "Failed to create shutdown eventfd.";
 }
 
 /**
@@ -28,9 +37,56 @@ SSEServer::SSEServer(SSEConfig *config) {
 SSEServer::~SSEServer() {
   DLOG(INFO) << "SSEServer destructor called.";
 
-  pthread_cancel(_routerthread.native_handle());
-  close(_serversocket);
-  close(_efd);
+  Stop();
+  _datasource.reset();
+
+  BOOST_FOREACH(boost::shared_ptr<boost::thread>& thread, _acceptthreads) {
+    thread->join();
+  }
+
+  BOOST_FOREACH(boost::shared_ptr<boost::thread>& thread, _routerthreads) {
+    thread->join();
+  }
+
+  if (_reaperthread.joinable()) _reaperthread.join();
+
+  // Client handlers waits for their event loops to exit.
+  _clienthandlers.clear();
+
+  BOOST_FOREACH(int fd, _serversockets) {
+    close(fd);
+  }
+
+  BOOST_FOREACH(int fd, _router_efds) {
+    close(fd);
+  }
+
+  close(_shutdown_fd);
+}
+
+/**
+  Make all threads exit their event loops.
+  Only does async-signal-safe calls, so it can be called from a signal handler.
+*/
+void SSEServer::Stop() {
+  uint64_t val = 1;
+
+  stop = 1;
+  ssize_t ret = write(_shutdown_fd, &val, sizeof(val));
+  (void)ret;
+}
+
+/**
+  Add the shutdown notification to a epoll set.
+  @param efd Epoll set to add it to.
+  @param ptr Pointer returned in the epoll event data when shutting down.
+*/
+void SSEServer::WatchShutdown(int efd, void* ptr) {
+  struct epoll_event event;
+
+  event.events = EPOLLIN;
+  event.data.ptr = ptr;
+  LOG_IF(FATAL, epoll_ctl(efd, EPOLL_CTL_ADD, _shutdown_fd, &event) == -1) << "Failed to add shutdown notification to epoll.";
 }
 
 /**
@@ -38,16 +94,18 @@ SSEServer::~SSEServer() {
   @param event Reference to SSEEvent to broadcast.
 **/
 bool SSEServer::Broadcast(SSEEvent& event) {
-  SSEChannel* ch;
   const string& chName = event.getpath();
 
-  ch = GetChannel(chName, _config->GetValueBool("server.allowUndefinedChannels"));
-  if (ch == NULL) {
-    LOG(ERROR) << "Discarding event recieved on invalid channel: " << chName;
-    return false;
-  }
+  // Retry if the channel was reaped while we broadcasted to it, it will be recreated if allowed.
+  do {
+    SSEChannelPtr ch = GetChannel(chName, _config->GetValueBool("server.allowUndefinedChannels"));
+    if (!ch) {
+      LOG(ERROR) << "Discarding event recieved on invalid channel: " << chName;
+      return false;
+    }
 
-  ch->BroadcastEvent(event);
+    if (ch->BroadcastEvent(event)) break;
+  } while(!stop);
 
   return true;
 }
@@ -88,9 +146,9 @@ void SSEServer::PostHandler(SSEClient* client, HTTPRequest* req) {
   validEvent = event.compile();
 
   // Check if channel exist.
-  SSEChannel* ch = GetChannel(chName);
+  SSEChannelPtr ch = GetChannel(chName);
 
-  if (ch == NULL) {
+  if (!ch) {
     // Handle creation of new channels.
     if (_config->GetValueBool("server.allowUndefinedChannels")) {
       if (!IsAllowedToPublish(client, _config->GetDefaultChannelConfig())) {
@@ -141,47 +199,125 @@ void SSEServer::PostHandler(SSEClient* client, HTTPRequest* req) {
 void SSEServer::Run() {
   InitSocket();
 
+  InitClientHandlers();
+  InitChannels();
+
   if (_config->GetValueBool("amqp.enabled")) {
       _datasource = boost::shared_ptr<SSEInputSource>(new AmqpInputSource());
       _datasource->Init(this);
       _datasource->Run();
   }
 
-  InitChannels();
+  InitRouters();
+
+  if (_config->GetValueInt("server.channelIdleTimeout") > 0 || _config->GetValueSize("server.cacheBytes") > 0) {
+    _reaperthread = boost::thread(&SSEServer::ReaperLoop, this);
+  }
+
+  // Accept on the first listening socket in this thread and start threads for the rest.
+  for (size_t i = 1; i < _serversockets.size(); i++) {
+    _acceptthreads.push_back(boost::shared_ptr<boost::thread>(
+      new boost::thread(&SSEServer::AcceptLoop, this, _serversockets[i])));
+  }
 
-  _routerthread = boost::thread(&SSEServer::ClientRouterLoop, this);
-  AcceptLoop();
+  AcceptLoop(_serversockets[0]);
 }
 
 /**
-  Initialize server socket.
+  Initialize server sockets.
+  When using multiple accept threads each thread gets its own listening socket
+  bound with SO_REUSEPORT, so the kernel spreads incoming connections across them.
 */
 void SSEServer::InitSocket() {
-  int on = 1;
+  int numSockets = _config->GetValueInt("server.acceptThreads");
+  if (numSockets < 1) numSockets = 1;
 
   /* Ignore SIGPIPE. */
   signal(SIGPIPE, SIG_IGN);
 
-  /* Set up listening socket. */
-  _serversocket = socket(AF_INET, SOCK_STREAM, 0);
-  LOG_IF(FATAL, _serversocket == -1) << "Error creating listening socket.";
-
-  /* Reuse port and address. */
-  setsockopt(_serversocket, SOL_SOCKET, SO_REUSEADDR, (const char*)&on, sizeof(on));
-
   memset((char*)&_sin, '\0', sizeof(_sin));
   _sin.sin_family  = AF_INET;
   _sin.sin_port  = htons(_config->GetValueInt("server.port"));
 
-  LOG_IF(FATAL, (bind(_serversocket, (struct sockaddr*)&_sin, sizeof(_sin))) == -1) <<
+  for (int i = 0; i < numSockets; i++) {
+    _serversockets.push_back(CreateListenSocket(numSockets > 1));
+  }
+
+  LOG(INFO) << "Listening on " << _config->GetValue("server.bindip")  << ":" << _config->GetValue("server.port") <<
+    " with " << numSockets << " accept thread(s).";
+}
+
+/**
+  Start the router threads parsing requests and routing new clients.
+  Each router has its own epoll set, new connections are spread across them.
+*/
+void SSEServer::InitRouters() {
+  int numThreads = _config->GetValueInt("server.routerThreads");
+  if (numThreads < 1) numThreads = 1;
+
+  _next_router = 0;
+
+  for (int i = 0; i < numThreads; i++) {
+    int efd = epoll_create1(0);
+    LOG_IF(FATAL, efd == -1) << "epoll_create1 failed.";
+    WatchShutdown(efd, NULL);
+    _router_efds.push_back(efd);
+  }
+
+  BOOST_FOREACH(int efd, _router_efds) {
+    _routerthreads.push_back(boost::shared_ptr<boost::thread>(
+      new boost::thread(&SSEServer::ClientRouterLoop, this, efd)));
+  }
+
+  LOG(INFO) << "Started " << numThreads << " client router thread(s).";
+}
+
+/**
+  Create a listening socket.
+  @param reusePort Set SO_REUSEPORT so multiple sockets can listen on the same port.
+  @returns the socket file descriptor.
+*/
+int SSEServer::CreateListenSocket(bool reusePort) {
+  int on = 1;
+  int backlog = _config->GetValueInt("server.listenBacklog");
+
+  /* Set up listening socket. */
+  int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  LOG_IF(FATAL, fd == -1) << "Error creating listening socket.";
+
+  /* Reuse port and address. */
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, (const char*)&on, sizeof(on));
+
+  if (reusePort) {
+    #ifdef SO_REUSEPORT
+    LOG_IF(FATAL, setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, (const char*)&on, sizeof(on)) == -1) <<
+      "Failed to set SO_REUSEPORT on listening socket: " << strerror(errno);
+    #else
+    LOG(FATAL) << "Multiple accept threads requires SO_REUSEPORT which is not supported on this platform.";
+    #endif
+  }
+
+  LOG_IF(FATAL, (bind(fd, (struct sockaddr*)&_sin, sizeof(_sin))) == -1) <<
     "Could not bind server socket to " << _config->GetValue("server.bindip") << ":" << _config->GetValue("server.port");
 
-  LOG_IF(FATAL, (listen(_serversocket, 0)) == -1) << "Call to listen() failed.";
+  LOG_IF(FATAL, (listen(fd, backlog)) == -1) << "Call to listen() failed.";
 
-  LOG(INFO) << "Listening on " << _config->GetValue("server.bindip")  << ":" << _config->GetValue("server.port");
+  return fd;
+}
+
+/**
+  Start the client handler threads shared by all channels.
+*/
+void SSEServer::InitClientHandlers() {
+  int numThreads = _config->GetValueInt("server.reactorThreads");
+  if (numThreads < 1) numThreads = boost::thread::hardware_concurrency();
+  if (numThreads < 1) numThreads = 1;
 
-  _efd = epoll_create1(0);
-  LOG_IF(FATAL, _efd == -1) << "epoll_create1 failed.";
+  LOG(INFO) << "Starting " << numThreads << " client handler threads.";
+
+  for (int i = 0; i < numThreads; i++) {
+    _clienthandlers.push_back(ClientHandlerPtr(new SSEClientHandler(i, _config, _shutdown_fd)));
+  }
 }
 
 /**
@@ -189,8 +325,7 @@ void SSEServer::InitSocket() {
 */
 void SSEServer::InitChannels() {
   BOOST_FOREACH(ChannelMap_t::value_type& chConf, _config->GetChannels()) {
-    SSEChannel* ch = new SSEChannel(chConf.second, chConf.first);
-    _channels.push_back(SSEChannelPtr(ch));
+    _channels.Create(chConf.first, chConf.second, _clienthandlers);
   }
 }
 
@@ -198,30 +333,130 @@ void SSEServer::InitChannels() {
   Get instance pointer to SSEChannel object from id if it exists.
   @param The id/path of the channel you want to get a instance pointer to.
 */
-SSEChannel* SSEServer::GetChannel(const string id, bool create) {
-  SSEChannelList::iterator it;
-  SSEChannel* ch = NULL;
-
-  for (it = _channels.begin(); it != _channels.end(); it++) {
-    SSEChannel* chan = static_cast<SSEChannel*>((*it).get());
-    if (chan->GetId().compare(id) == 0) {
-      return chan;
+SSEChannelPtr SSEServer::GetChannel(const string& id, bool create) {
+  SSEChannelPtr ch = _channels.Get(id);
+
+  if (!ch && create) {
+    ch = _channels.Create(id, _config->GetDefaultChannelConfig(), _clienthandlers);
+  }
+
+  return ch;
+}
+
+/**
+  Returns a snapshot of the channel list.
+*/
+SSEChannelList SSEServer::GetChannelList() {
+  return _channels.GetChannels();
+}
+
+/**
+  Returns a const reference to the client handler list.
+*/
+const ClientHandlerList& SSEServer::GetClientHandlers() {
+  return _clienthandlers;
+}
+
+/**
+  Periodically tear down dynamically created channels that has been idle
+  for longer than server.channelIdleTimeout seconds, and release channel
+  caches from memory while more than server.cacheBytes bytes are cached there.
+*/
+void SSEServer::ReaperLoop() {
+  int timeout = _config->GetValueInt("server.channelIdleTimeout");
+  bool purgeCache = _config->GetValueBool("server.purgeReapedCache");
+  size_t cacheBudget = _config->GetValueSize("server.cacheBytes");
+  ChannelMap_t& staticChannels = _config->GetChannels();
+
+  SSETimer timer;
+  struct epoll_event event;
+
+  int efd = epoll_create1(0);
+  LOG_IF(FATAL, efd == -1) << "epoll_create1 failed.";
+
+  WatchShutdown(efd, NULL);
+
+  event.events = EPOLLIN;
+  event.data.ptr = &timer;
+  LOG_IF(FATAL, epoll_ctl(efd, EPOLL_CTL_ADD, timer.GetFd(), &event) == -1) << "Failed to add reaper timer to epoll.";
+  timer.SetInterval((timeout < 4 || cacheBudget > 0) ? 1000 : timeout * 250);
+
+  LOG_IF(INFO, timeout > 0) << "Reaping dynamic channels idle for more than " << timeout << " seconds.";
+  LOG_IF(INFO, cacheBudget > 0) << "Releasing channel caches from memory beyond " << cacheBudget << " bytes.";
+
+  while(!stop) {
+    if (epoll_wait(efd, &event, 1, -1) < 1) continue;
+    if (event.data.ptr == NULL) break;
+    if (timer.Read() == 0) continue;
+
+    if (cacheBudget > 0) EnforceCacheBudget(cacheBudget);
+    if (timeout < 1) continue;
+
+    BOOST_FOREACH(const SSEChannelPtr& ch, GetChannelList()) {
+      // Statically configured channels lives forever.
+      if (staticChannels.find(ch->GetId()) != staticChannels.end()) continue;
+
+      if (!ch->CloseIfIdle(timeout)) continue;
+
+      _channels.Remove(ch);
+      if (purgeCache) ch->PurgeCache();
+      _num_reaped_channels++;
+
+      LOG(INFO) << "Reaped idle channel " << ch->GetId();
     }
   }
 
-  if (create) {
-    ch = new SSEChannel(_config->GetDefaultChannelConfig(), id);
-    _channels.push_back(SSEChannelPtr(ch));
+  close(efd);
+}
+
+/**
+  Release the memory of whole channel caches until the channels hold no
+  more cached event data in memory than the budget. Channels without
+  clients go first, then the least recently active ones.
+  @param budget Max bytes of cached event data in memory for all channels together.
+*/
+void SSEServer::EnforceCacheBudget(size_t budget) {
+  vector<pair<pair<bool, time_t>, SSEChannelPtr> > channels;
+  size_t total = 0;
+
+  BOOST_FOREACH(const SSEChannelPtr& ch, GetChannelList()) {
+    total += ch->GetCacheMemoryBytes();
+    channels.push_back(make_pair(make_pair(ch->GetNumClients() > 0, ch->GetLastActivity()), ch));
   }
 
-  return ch;
+  if (total <= budget) return;
+
+  std::sort(channels.begin(), channels.end());
+
+  for (size_t i = 0; i < channels.size() && total > budget; i++) {
+    const SSEChannelPtr& ch = channels[i].second;
+    size_t bytes = ch->GetCacheMemoryBytes();
+
+    if (bytes == 0) continue;
+
+    ch->ReleaseCacheMemory();
+
+    // Events not yet written to a backend stay in memory.
+    bytes -= std::min(bytes, (size_t)ch->GetCacheMemoryBytes());
+    total -= std::min(bytes, total);
+    _num_cache_evictions++;
+
+    LOG(INFO) << "Released " << bytes << " cached bytes of channel " << ch->GetId() << " from memory, " << total << " bytes cached in memory in total";
+  }
+}
+
+/**
+  Returns number of idle channels that has been reaped.
+*/
+ulong SSEServer::GetNumReapedChannels() {
+  return _num_reaped_channels;
 }
 
 /**
-  Returns a const reference to the channel list.
+  Returns number of channel caches released from memory to stay within server.cacheBytes.
 */
-const SSEChannelList& SSEServer::GetChannelList() {
-  return _channels;
+ulong SSEServer::GetNumCacheEvictions() {
+  return _num_cache_evictions;
 }
 
 /**
@@ -233,8 +468,35 @@ SSEConfig* SSEServer::GetConfig() {
 
 /**
   Accept new client connections.
+  @param serversocket Listening socket to accept connections on.
 */
-void SSEServer::AcceptLoop() {
+void SSEServer::AcceptLoop(int serversocket) {
+  struct epoll_event event;
+
+  int efd = epoll_create1(0);
+  LOG_IF(FATAL, efd == -1) << "epoll_create1 failed.";
+
+  WatchShutdown(efd, NULL);
+
+  event.events = EPOLLIN;
+  event.data.ptr = &serversocket;
+  LOG_IF(FATAL, epoll_ctl(efd, EPOLL_CTL_ADD, serversocket, &event) == -1) << "Failed to add listening socket to epoll.";
+
+  while(!stop) {
+    if (epoll_wait(efd, &event, 1, -1) < 1) continue;
+    if (event.data.ptr == NULL) break;
+
+    AcceptConnections(serversocket);
+  }
+
+  close(efd);
+}
+
+/**
+  Accept all pending connections on a listening socket.
+  @param serversocket Listening socket to accept connections on.
+*/
+void SSEServer::AcceptConnections(int serversocket) {
   while(!stop) {
     struct sockaddr_in csin;
     socklen_t clen;
@@ -243,30 +505,37 @@ void SSEServer::AcceptLoop() {
     memset((char*)&csin, '\0', sizeof(csin));
     clen = sizeof(csin);
 
-    // Accept the connection.
-    tmpfd = accept(_serversocket, (struct sockaddr*)&csin, &clen);
+    // Accept the connection as non-blocking right away.
+    tmpfd = accept4(serversocket, (struct sockaddr*)&csin, &clen, SOCK_NONBLOCK | SOCK_CLOEXEC);
 
     /* Got an error ? Handle it. */
     if (tmpfd == -1) {
       switch (errno) {
+        case EAGAIN:
+          return; /* No more pending connections. */
+
+        case EINTR:
+          continue; /* Try again. */
+
         case EMFILE:
+          stats.accept_errors++;
           LOG(ERROR) << "All connections available used. Cannot accept more connections.";
           usleep(100000);
-        break;
+          return;
 
         default:
-          LOG_IF(ERROR, !stop) << "Error in accept(): " << strerror(errno);
+          stats.accept_errors++;
+          LOG(ERROR) << "Error in accept(): " << strerror(errno);
+          return;
       }
-
-      continue; /* Try again. */
     }
 
-    // Set non-blocking on client socket.
-    fcntl(tmpfd, F_SETFL, O_NONBLOCK);
+    stats.accepted_connections++;
 
-    // Add it to our epoll eventlist.
+    // Add it to the epoll eventlist of one of the routers.
+    int efd = _router_efds[_next_router++ % _router_efds.size()];
     SSEClient* client = new SSEClient(tmpfd, &csin);
-    int ret = client->AddToEpoll(_efd, EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR);
+    int ret = client->AddToEpoll(efd, EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR);
 
     if (ret == -1) {
       LOG(ERROR) << "Could not add client to epoll eventlist: " << strerror(errno);
@@ -281,26 +550,28 @@ void SSEServer::AcceptLoop() {
  @param client SSEClient to remove.
 **/
 void SSEServer::RemoveClient(SSEClient* client) {
-  epoll_ctl(_efd, EPOLL_CTL_DEL, client->Getfd(), NULL);
+  client->RemoveFromEpoll();
   client->Destroy();
 }
 
 /**
   Read request and route client to the requested channel.
+  @param efd Epoll set of the clients handled by this router.
 */
-void SSEServer::ClientRouterLoop() {
+void SSEServer::ClientRouterLoop(int efd) {
   char buf[4096];
   boost::shared_ptr<struct epoll_event[]> eventList(new struct epoll_event[MAXEVENTS]);
 
-  LOG(INFO) << "Started client router thread.";
-
-  while(1) {
-    int n = epoll_wait(_efd, eventList.get(), MAXEVENTS, 5);
+  while(!stop) {
+    int n = epoll_wait(efd, eventList.get(), MAXEVENTS, -1);
 
     for (int i = 0; i < n; i++) {
       SSEClient* client;
       client = static_cast<SSEClient*>(eventList[i].data.ptr);
 
+      // Shutting down.
+      if (client == NULL) return;
+
       // Close socket if an error occurs.
       if (eventList[i].events & EPOLLERR) {
         DLOG(WARNING) << "Error occurred while reading data from client " << client->GetIP() << ".";
@@ -396,20 +667,21 @@ void SSEServer::ClientRouterLoop() {
         }
 
         string chName = req->GetPath().substr(1);
-        SSEChannel *ch = GetChannel(chName);
+        SSEChannelPtr ch = GetChannel(chName);
 
         DLOG(INFO) << "Channel: " << chName;
 
-        if (ch != NULL) {
-          epoll_ctl(_efd, EPOLL_CTL_DEL, client->Getfd(), NULL);
-          ch->AddClient(client, req);
-        } else {
-          HTTPResponse res;
-          res.SetStatus(404);
-          res.SetBody("Channel does not exist.\n");
-          client->Send(res.Get());
-          RemoveClient(client);
+        // The channel might have been reaped since we looked it up.
+        if (ch) {
+          client->RemoveFromEpoll();
+          if (ch->AddClient(client, req)) continue;
         }
+
+        HTTPResponse res;
+        res.SetStatus(404);
+        res.SetBody("Channel does not exist.\n");
+        client->Send(res.Get());
+        RemoveClient(client);
       }
     }
   }
@@ -11,6 +11,8 @@
 #include "SSEChannel.h"
 #include "SSEServer.h"
 #include "SSEClient.h"
+#include "SSEClientHandler.h"
+#include "SSEWriteBuffer.h"
 #include "SSEStatsHandler.h"
 #include "HTTPResponse.h"
 
@@ -26,6 +28,12 @@ SSEStatsHandler::SSEStatsHandler() {
   invalid_events_rcv  = 0;
   router_read_errors  = 0;
   totalClients = 0;
+  accepted_connections = 0;
+  accept_errors = 0;
+
+  _last_accepted = 0;
+  _last_accept_sample = time(NULL);
+  _accept_rate = 0;
 }
 
 /**
@@ -51,6 +59,12 @@ void SSEStatsHandler::Update() {
   ulong totalConnects    = 0;
   ulong totalDisconnects = 0;
   ulong totalErrors      = 0;
+  ulong totalReplayHits  = 0;
+  ulong totalReplayMiss  = 0;
+  ulong totalHotHits     = 0;
+  ulong totalHotMiss     = 0;
+  ulong totalCacheBytes  = 0;
+  ulong totalMemoryBytes = 0;
   uint  numChannels      = 0;
 
   boost::property_tree::ptree pt;
@@ -66,6 +80,12 @@ void SSEStatsHandler::Update() {
     totalConnects    += stat.num_connects;
     totalDisconnects += stat.num_disconnects;
     totalErrors      += stat.num_errors;
+    totalReplayHits  += stat.num_replay_cache_hits;
+    totalReplayMiss  += stat.num_replay_cache_misses;
+    totalHotHits     += stat.num_hot_cache_hits;
+    totalHotMiss     += stat.num_hot_cache_misses;
+    totalCacheBytes  += stat.cache_bytes;
+    totalMemoryBytes += stat.cache_memory_bytes;
     numChannels++;
 
     pt_element.put("id", chan->GetId());
@@ -73,9 +93,20 @@ void SSEStatsHandler::Update() {
     pt_element.put("broadcasted_events", stat.num_broadcasted_events);
     pt_element.put("cached_events", stat.num_cached_events);
     pt_element.put("cache_size", stat.cache_size);
+    pt_element.put("cache_bytes", stat.cache_bytes);
+    pt_element.put("cache_memory_bytes", stat.cache_memory_bytes);
     pt_element.put("total_connects", stat.num_connects);
     pt_element.put("total_disconnects", stat.num_disconnects);
     pt_element.put("client_errors", stat.num_errors);
+    pt_element.put("client_backlog_bytes", stat.backlog_bytes);
+    pt_element.put("max_client_backlog_bytes", stat.max_client_backlog_bytes);
+    pt_element.put("backlog_evictions", stat.num_backlog_evictions);
+    pt_element.put("backlog_dropped_events", stat.num_backlog_dropped_events);
+    pt_element.put("replay_cache_hits", stat.num_replay_cache_hits);
+    pt_element.put("replay_cache_misses", stat.num_replay_cache_misses);
+    pt_element.put("hot_cache_hits", stat.num_hot_cache_hits);
+    pt_element.put("hot_cache_misses", stat.num_hot_cache_misses);
+    pt_element.put("hot_cache_hit_ratio", GetHitRatio(stat.num_hot_cache_hits, stat.num_hot_cache_misses));
 
     channels.push_back(std::make_pair("", pt_element));
   }
@@ -89,11 +120,34 @@ void SSEStatsHandler::Update() {
   pt.put("global.channel_connects", totalConnects);
   pt.put("global.channel_disconnects", totalDisconnects);
   pt.put("global.channel_client_errors", totalErrors);
-  pt.put("global.router_read_errors", router_read_errors);
-  pt.put("global.invalid_http_req", invalid_http_req);
-  pt.put("global.oversized_http_req", oversized_http_req);
+  pt.put("global.replay_cache_hits", totalReplayHits);
+  pt.put("global.replay_cache_misses", totalReplayMiss);
+  pt.put("global.hot_cache_hits", totalHotHits);
+  pt.put("global.hot_cache_misses", totalHotMiss);
+  pt.put("global.hot_cache_hit_ratio", GetHitRatio(totalHotHits, totalHotMiss));
+  pt.put("global.router_read_errors", (ulong)router_read_errors);
+  pt.put("global.invalid_http_req", (ulong)invalid_http_req);
+  pt.put("global.oversized_http_req", (ulong)oversized_http_req);
+  pt.put("global.accepted_connections", (ulong)accepted_connections);
+  pt.put("global.accept_errors", (ulong)accept_errors);
+  pt.put("global.accepts_per_sec", GetAcceptRate());
+  pt.put("global.client_backlog_bytes", SSEWriteBuffer::GetGlobalSize());
+  pt.put("global.client_handler_threads", _server->GetClientHandlers().size());
+
+  ulong batchHist[BATCH_HIST_BUCKETS] = { 0 };
+  BOOST_FOREACH(const ClientHandlerPtr& handler, _server->GetClientHandlers()) {
+    handler->GetBatchStats(batchHist);
+  }
+
+  for (int i = 0; i < BATCH_HIST_BUCKETS; i++) {
+    pt.put(string("global.batch_sizes.") + SSEClientHandler::GetBatchBucketName(i), batchHist[i]);
+  }
 
   pt.put("global.channels", numChannels);
+  pt.put("global.reaped_channels", _server->GetNumReapedChannels());
+  pt.put("global.cache_bytes", totalCacheBytes);
+  pt.put("global.cache_memory_bytes", totalMemoryBytes);
+  pt.put("global.cache_evictions", _server->GetNumCacheEvictions());
 
   if (numChannels > 0) {
     pt.add_child("channels", channels);
@@ -105,6 +159,33 @@ void SSEStatsHandler::Update() {
   _jsonData = ss.str();
 }
 
+/**
+  Returns accepted connections per second since the previous sample.
+  A new sample is taken at most once per second.
+*/
+double SSEStatsHandler::GetAcceptRate() {
+  time_t now = time(NULL);
+  ulong accepted = accepted_connections;
+
+  if (now > _last_accept_sample) {
+    _accept_rate = (double)(accepted - _last_accepted) / (now - _last_accept_sample);
+    _last_accepted = accepted;
+    _last_accept_sample = now;
+  }
+
+  return _accept_rate;
+}
+
+/**
+  Returns the share of reads that were hits, 0 if there were no reads.
+  @param hits Number of hits.
+  @param misses Number of misses.
+*/
+double SSEStatsHandler::GetHitRatio(ulong hits, ulong misses) {
+  if (hits + misses == 0) return 0;
+  return (double)hits / (hits + misses);
+}
+
 /*
  Generate and return the statistics as JSON.
 */
@@ -122,7 +203,12 @@ void SSEStatsHandler::SendToClient(SSEClient* client) {
 
   res.SetHeader("Content-Type", "application/json");
   res.SetHeader("Cache-Control", "no-cache");
-  res.SetBody(GetJSON());
+
+  {
+    // Requests can be served by several router threads at once.
+    boost::mutex::scoped_lock lock(_update_lock);
+    res.SetBody(GetJSON());
+  }
 
   client->Send(res.Get());
   client->Destroy();
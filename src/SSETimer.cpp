@@ -0,0 +1,68 @@
+#include <sys/timerfd.h>
+#include <time.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include "Common.h"
+#include "SSETimer.h"
+
+/**
+  Constructor.
+  The timer is created disarmed.
+*/
+SSETimer::SSETimer() {
+  _fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  LOG_IF(FATAL, _fd == -1) << "timerfd_create failed: " << strerror(errno);
+}
+
+/**
+  Destructor.
+*/
+SSETimer::~SSETimer() {
+  close(_fd);
+}
+
+/**
+  Arm the timer to expire periodically.
+  @param msec Interval in milliseconds, 0 disarms the timer.
+*/
+void SSETimer::SetInterval(int msec) {
+  struct itimerspec spec;
+
+  spec.it_interval.tv_sec  = msec / 1000;
+  spec.it_interval.tv_nsec = (msec % 1000) * 1000000L;
+  spec.it_value = spec.it_interval;
+
+  LOG_IF(ERROR, timerfd_settime(_fd, 0, &spec, NULL) == -1) << "timerfd_settime failed: " << strerror(errno);
+}
+
+/**
+  Returns the file descriptor to wait on.
+*/
+int SSETimer::GetFd() {
+  return _fd;
+}
+
+/**
+  Acknowledge the timer.
+  @returns number of expirations since last call, 0 if the timer has not expired.
+*/
+uint64_t SSETimer::Read() {
+  uint64_t expirations = 0;
+
+  if (read(_fd, &expirations, sizeof(expirations)) != sizeof(expirations)) {
+    return 0;
+  }
+
+  return expirations;
+}
+
+/**
+  Returns the wall clock time in milliseconds since the epoch.
+*/
+uint64_t SSETimer::Now() {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
@@ -0,0 +1,194 @@
+#include "Common.h"
+#include "SSEWriteBuffer.h"
+#include <algorithm>
+
+using namespace std;
+
+std::atomic<size_t> SSEWriteBuffer::_global_size(0);
+
+/**
+  Constructor.
+*/
+SSEWriteBuffer::SSEWriteBuffer() : _offset(0), _pinned(0), _size(0) {
+}
+
+/**
+  Destructor.
+*/
+SSEWriteBuffer::~SSEWriteBuffer() {
+  Clear();
+}
+
+/**
+  Queue a buffer for writing.
+  @param buf Buffer to queue.
+*/
+void SSEWriteBuffer::Append(const SSEBufferPtr& buf) {
+  if (buf->GetLength() < 1) return;
+
+  _segments.push_back(buf);
+  _size += buf->GetLength();
+  _global_size += buf->GetLength();
+}
+
+/**
+  Fill a iovec array with the pending segments, up to the first file backed one.
+  @param iov Array to fill.
+  @param iovmax Max number of entries to fill.
+  @param len Set to total number of bytes referenced by the filled entries.
+  @returns number of entries filled.
+*/
+size_t SSEWriteBuffer::FillIovec(struct iovec* iov, size_t iovmax, size_t& len) {
+  size_t iovcnt = 0;
+  len = 0;
+
+  for (SSEBufferList::const_iterator it = _segments.begin();
+      it != _segments.end() && iovcnt < iovmax && !(*it)->IsFile(); it++) {
+    size_t offset = (iovcnt == 0) ? _offset : 0;
+    iov[iovcnt].iov_base = const_cast<char*>((*it)->GetPtr()) + offset;
+    iov[iovcnt].iov_len  = (*it)->GetLength() - offset;
+    len += iov[iovcnt].iov_len;
+    iovcnt++;
+  }
+
+  return iovcnt;
+}
+
+/**
+  Get the pending part of the first segment if it is file backed.
+  @param fd Set to the file descriptor.
+  @param offset Set to the file offset of the first pending byte.
+  @param len Set to number of pending bytes in the segment.
+  @returns false if the first segment is not file backed.
+*/
+bool SSEWriteBuffer::GetFileRange(int& fd, off_t& offset, size_t& len) {
+  if (_segments.empty() || !_segments.front()->IsFile()) return false;
+
+  fd = _segments.front()->GetFd();
+  offset = _segments.front()->GetOffset() + _offset;
+  len = _segments.front()->GetLength() - _offset;
+
+  return true;
+}
+
+/**
+  Drop bytes that has been written from the head of the queue.
+  Fully written segments are released, a partially written one only
+  advances the cursor.
+  @param bytes Number of bytes written.
+*/
+void SSEWriteBuffer::Consume(size_t bytes) {
+  if (bytes > _size) bytes = _size;
+
+  _size -= bytes;
+  _global_size -= bytes;
+
+  while (bytes > 0 && !_segments.empty()) {
+    size_t remaining = _segments.front()->GetLength() - _offset;
+
+    if (bytes < remaining) {
+      _offset += bytes;
+      break;
+    }
+
+    bytes -= remaining;
+    _segments.pop_front();
+    _offset = 0;
+    if (_pinned > 0) _pinned--;
+  }
+}
+
+/**
+  Drop all pending data.
+*/
+void SSEWriteBuffer::Clear() {
+  _global_size -= _size;
+  _size = 0;
+  _offset = 0;
+  _pinned = 0;
+  _segments.clear();
+}
+
+/**
+  Protect all currently queued segments from being dropped.
+  Used to make sure response headers is never discarded.
+*/
+void SSEWriteBuffer::Pin() {
+  _pinned = _segments.size();
+}
+
+/**
+  Drop the oldest droppable segments until the buffer is within limits.
+  The segment currently being written and pinned segments are never dropped.
+  @param maxBytes Max number of pending bytes, 0 for unlimited.
+  @param maxSegments Max number of pending segments, 0 for unlimited.
+  @returns number of segments dropped.
+*/
+size_t SSEWriteBuffer::DropOldest(size_t maxBytes, size_t maxSegments) {
+  size_t first = max(_pinned, (size_t)(_offset > 0 ? 1 : 0));
+  size_t dropped = 0;
+
+  while (first < _segments.size() &&
+      ((maxBytes > 0 && _size > maxBytes) || (maxSegments > 0 && _segments.size() > maxSegments))) {
+    SSEBufferList::iterator it = _segments.begin() + first;
+    _size -= (*it)->GetLength();
+    _global_size -= (*it)->GetLength();
+    _segments.erase(it);
+    dropped++;
+  }
+
+  return dropped;
+}
+
+/**
+  Drop droppable segments carrying the given event id.
+  @param id Event id.
+  @returns number of segments dropped.
+*/
+size_t SSEWriteBuffer::Conflate(const string& id) {
+  size_t first = max(_pinned, (size_t)(_offset > 0 ? 1 : 0));
+  size_t dropped = 0;
+
+  if (id.empty()) return 0;
+
+  for (SSEBufferList::iterator it = _segments.begin() + min(first, _segments.size()); it != _segments.end();) {
+    if ((*it)->GetId() == id) {
+      _size -= (*it)->GetLength();
+      _global_size -= (*it)->GetLength();
+      it = _segments.erase(it);
+      dropped++;
+    } else {
+      it++;
+    }
+  }
+
+  return dropped;
+}
+
+/**
+  Returns true if there is no pending data.
+*/
+bool SSEWriteBuffer::Empty() {
+  return _segments.empty();
+}
+
+/**
+  Returns number of pending bytes.
+*/
+size_t SSEWriteBuffer::GetSize() {
+  return _size;
+}
+
+/**
+  Returns number of pending segments.
+*/
+size_t SSEWriteBuffer::GetNumSegments() {
+  return _segments.size();
+}
+
+/**
+  Returns number of pending bytes across all write buffers.
+*/
+size_t SSEWriteBuffer::GetGlobalSize() {
+  return _global_size;
+}
@@ -11,10 +11,12 @@ using namespace std;
 namespace po = boost::program_options;
 
 int stop = 0;
+SSEServer* server = NULL;
 
 void shutdown(int sigid) {
   LOG(INFO) << "Exiting.";
   stop = 1;
+  if (server != NULL) server->Stop();
 }
 
 po::variables_map parse_options(po::options_description desc, int argc, char **argv) {
@@ -54,8 +56,10 @@ int main(int argc, char **argv) {
   sigemptyset(&(sa.sa_mask));
   sigaction(SIGINT, &sa, NULL);
 
-  SSEServer server(&conf);
-  server.Run();
+  SSEServer sseServer(&conf);
+  server = &sseServer;
+  sseServer.Run();
+  server = NULL;
 
   return 0;
 }
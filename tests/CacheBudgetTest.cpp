@@ -0,0 +1,145 @@
+#include <cstdio>
+#include <cstdlib>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <boost/foreach.hpp>
+#include <boost/lexical_cast.hpp>
+#include "Common.h"
+#include "SSEConfig.h"
+#include "SSEEvent.h"
+#include "SSEChannel.h"
+#include "SSEClientHandler.h"
+#include "TestUtil.h"
+
+#define TEST_EVENTS 300
+#define TEST_WRITE_TIMEOUT 5
+
+using namespace std;
+
+int stop = 0;
+
+/**
+  Returns the number of events replayed since the first one, including it.
+  @param channel Channel to replay from.
+*/
+static size_t CountReplay(const SSEChannelPtr& channel) {
+  SSEReplayBlobPtr replay = channel->GetReplay(REPLAY_SINCE_ID, "0", 0);
+  return replay ? replay->ids.size() : 0;
+}
+
+/**
+  Publish events to a channel, release its cache memory like the server does
+  when it is over server.cacheBytes, and check what is still replayed.
+  In-memory caches are emptied, the others must replay every event.
+  @param channel Channel to test.
+  @param name Name of the cache adapter.
+*/
+static bool Run(const SSEChannelPtr& channel, const string& name) {
+  const bool inMemory = (name == "memory" || name == "ring");
+  bool ok = true;
+
+  for (int i = 0; i < TEST_EVENTS; i++) {
+    SSEEvent event(MakeEvent(boost::lexical_cast<string>(i)));
+    channel->CacheEvent(event);
+  }
+
+  // Tiered caches keep the events their backend has not written yet.
+  for (int i = 0; i < TEST_WRITE_TIMEOUT * 100; i++) {
+    channel->ReleaseCacheMemory();
+    if (channel->GetCacheMemoryBytes() == 0) break;
+    usleep(10000);
+  }
+
+  if (channel->GetCacheMemoryBytes() != 0) {
+    fprintf(stderr, "%s: %lu bytes left in memory after releasing it\n", name.c_str(), channel->GetCacheMemoryBytes());
+    ok = false;
+  }
+
+  size_t expected = inMemory ? 0 : TEST_EVENTS;
+  size_t replayed = CountReplay(channel);
+
+  if (replayed != expected) {
+    fprintf(stderr, "%s: replayed %zu events after releasing memory where %zu were expected\n",
+      name.c_str(), replayed, expected);
+    ok = false;
+  }
+
+  // The channel keeps caching new events.
+  SSEEvent event(MakeEvent(boost::lexical_cast<string>(TEST_EVENTS)));
+  channel->CacheEvent(event);
+
+  expected = inMemory ? 1 : TEST_EVENTS + 1;
+  replayed = inMemory ? channel->GetStats().num_cached_events : CountReplay(channel);
+
+  if (replayed != expected) {
+    fprintf(stderr, "%s: %zu events cached after publishing again where %zu were expected\n",
+      name.c_str(), replayed, expected);
+    ok = false;
+  }
+
+  return ok;
+}
+
+int main(int argc, char **argv) {
+  char dirTemplate[] = "/tmp/ssehub-test-XXXXXX";
+  const char* dir = mkdtemp(dirTemplate);
+  SSEConfig config;
+  bool ok = true;
+
+  if (!dir) {
+    perror("mkdtemp");
+    return 1;
+  }
+
+  FLAGS_logtostderr = 1;
+  google::InitGoogleLogging(argv[0]);
+
+  const string configFile = WriteConfig(dir);
+  config.load(configFile.c_str());
+
+  // Test the adapters named on the command line, or all of them.
+  vector<string> adapters(argv + 1, argv + argc);
+
+  if (adapters.empty()) {
+    adapters.push_back("memory");
+    adapters.push_back("ring");
+    adapters.push_back("leveldb");
+    adapters.push_back("segmentlog");
+    adapters.push_back("tiered");
+
+    // Needs a redis server on redis.host.
+    if (getenv("SSEHUB_TEST_REDIS")) adapters.push_back("redis");
+  }
+
+  // The channels need a client handler to spread their clients on.
+  int shutdownfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  ClientHandlerList handlers;
+  handlers.push_back(ClientHandlerPtr(new SSEClientHandler(0, &config, shutdownfd)));
+
+  BOOST_FOREACH(const string& name, adapters) {
+    ChannelConfig conf = config.GetDefaultChannelConfig();
+    conf.cacheAdapter = name;
+    conf.cacheLength = 1000;
+
+    SSEChannelPtr channel(new SSEChannel(conf, "budget-" + name, handlers));
+
+    // Redis may hold events from an earlier run.
+    if (name == "redis") channel->PurgeCache();
+
+    bool passed = Run(channel, name);
+    printf("%-12s %s\n", name.c_str(), passed ? "ok" : "FAILED");
+    if (!passed) ok = false;
+
+    channel->PurgeCache();
+  }
+
+  // Let the handler exit so it can be joined.
+  uint64_t val = 1;
+  if (write(shutdownfd, &val, sizeof(val)) != sizeof(val)) return 1;
+  handlers.clear();
+  close(shutdownfd);
+
+  RemoveDir(dir);
+
+  return ok ? 0 : 1;
+}
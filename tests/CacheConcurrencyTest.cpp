@@ -0,0 +1,188 @@
+#include <cstdio>
+#include <cstdlib>
+#include <atomic>
+#include <unistd.h>
+#include <boost/thread.hpp>
+#include <boost/lexical_cast.hpp>
+#include <boost/foreach.hpp>
+#include <boost/bind.hpp>
+#include "Common.h"
+#include "SSEConfig.h"
+#include "SSEEvent.h"
+#include "TestUtil.h"
+
+#define TEST_EVENTS 20000
+#define TEST_READERS 4
+#define TEST_CACHE_LENGTH 500
+
+using namespace std;
+
+int stop = 0;
+
+/**
+  Replays the cache of one adapter while events are published to it.
+  Events are published with increasing ids, so every replay must be a
+  run of consecutive ids, starting at the requested one and reaching at
+  least the last event published before the replay started.
+*/
+class CacheConcurrencyTest {
+  public:
+    CacheConcurrencyTest(const string& name, CacheInterface* adapter);
+    bool Run();
+
+  private:
+    string _name;
+    CacheInterface* _adapter;
+    std::atomic<long> _published;
+    std::atomic<bool> _done;
+    std::atomic<bool> _failed;
+    std::atomic<long> _replays;
+
+    void Publish();
+    void Replay(unsigned int seed);
+    void Check(const SSEBufferList& events, long first, long published, const char* what);
+};
+
+/**
+  Constructor.
+  @param name Name of the adapter, for reporting.
+  @param adapter Adapter to test, owned by the caller.
+*/
+CacheConcurrencyTest::CacheConcurrencyTest(const string& name, CacheInterface* adapter) {
+  _name = name;
+  _adapter = adapter;
+  _published = -1;
+  _done = false;
+  _failed = false;
+  _replays = 0;
+}
+
+/**
+  Run one publisher and TEST_READERS replaying readers until all events are published.
+  @returns false if a replay was out of order, had duplicates or gaps.
+*/
+bool CacheConcurrencyTest::Run() {
+  boost::thread_group readers;
+
+  for (int i = 0; i < TEST_READERS; i++) {
+    readers.create_thread(boost::bind(&CacheConcurrencyTest::Replay, this, i + 1));
+  }
+
+  Publish();
+  _done = true;
+  readers.join_all();
+
+  printf("%-12s %s, %ld replays\n", _name.c_str(), _failed ? "FAILED" : "ok", (long)_replays);
+  return !_failed;
+}
+
+/**
+  Publish TEST_EVENTS events with increasing ids.
+*/
+void CacheConcurrencyTest::Publish() {
+  for (long i = 0; i < TEST_EVENTS && !_failed; i++) {
+    SSEEvent event(MakeEvent(boost::lexical_cast<string>(i)));
+
+    _adapter->CacheEvent(event);
+    _published = i;
+  }
+}
+
+/**
+  Replay from recently published events until the publisher is done.
+  @param seed Seed for picking the event to replay from.
+*/
+void CacheConcurrencyTest::Replay(unsigned int seed) {
+  while (!_done && !_failed) {
+    long published = _published;
+    if (published < 0) continue;
+
+    long first = std::max(0L, published - (long)(rand_r(&seed) % (TEST_CACHE_LENGTH / 2)));
+    Check(_adapter->GetEventsSinceId(boost::lexical_cast<string>(first)), first, published, "GetEventsSinceId");
+    Check(_adapter->GetAllEvents(), -1, published, "GetAllEvents");
+    _replays++;
+  }
+}
+
+/**
+  Check that replayed events are consecutive ids.
+  @param events Replayed events.
+  @param first Id the replay must start at, -1 for any.
+  @param published Id of the last event published before the replay started.
+  @param what Name of the replay call, for reporting.
+*/
+void CacheConcurrencyTest::Check(const SSEBufferList& events, long first, long published, const char* what) {
+  // The event may have been evicted meanwhile.
+  if (events.empty()) return;
+
+  long expected = (first < 0) ? boost::lexical_cast<long>(events.front()->GetId()) : first;
+
+  for (SSEBufferList::const_iterator it = events.begin(); it != events.end(); it++, expected++) {
+    if ((*it)->GetId() != boost::lexical_cast<string>(expected)) {
+      fprintf(stderr, "%s: %s since %ld returned id %s where %ld was expected\n",
+        _name.c_str(), what, first, (*it)->GetId().c_str(), expected);
+      _failed = true;
+      return;
+    }
+  }
+
+  if (expected <= published) {
+    fprintf(stderr, "%s: %s since %ld ended at %ld, but %ld was already published\n",
+      _name.c_str(), what, first, expected - 1, published);
+    _failed = true;
+  }
+}
+
+int main(int argc, char **argv) {
+  char dirTemplate[] = "/tmp/ssehub-test-XXXXXX";
+  const char* dir = mkdtemp(dirTemplate);
+  SSEConfig config;
+  bool ok = true;
+
+  if (!dir) {
+    perror("mkdtemp");
+    return 1;
+  }
+
+  FLAGS_logtostderr = 1;
+  google::InitGoogleLogging(argv[0]);
+
+  const string configFile = WriteConfig(dir);
+  config.load(configFile.c_str());
+
+  // Test the adapters named on the command line, or all of them.
+  vector<string> adapters(argv + 1, argv + argc);
+
+  if (adapters.empty()) {
+    adapters.push_back("memory");
+    adapters.push_back("ring");
+    adapters.push_back("leveldb");
+    adapters.push_back("segmentlog");
+    adapters.push_back("tiered");
+
+    // Needs a redis server on redis.host.
+    if (getenv("SSEHUB_TEST_REDIS")) adapters.push_back("redis");
+  }
+
+  BOOST_FOREACH(const string& name, adapters) {
+    ChannelConfig conf = config.GetDefaultChannelConfig();
+    conf.id = "test-" + name;
+    conf.cacheAdapter = name;
+    conf.cacheLength = TEST_CACHE_LENGTH;
+
+    CacheInterface* adapter = CreateAdapter(name, conf);
+
+    // Redis may hold events from an earlier run.
+    if (name == "redis") adapter->Purge();
+
+    CacheConcurrencyTest test(name, adapter);
+    if (!test.Run()) ok = false;
+
+    adapter->Purge();
+    delete adapter;
+  }
+
+  RemoveDir(dir);
+
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,148 @@
+#include <cstdio>
+#include <cstdlib>
+#include <boost/lexical_cast.hpp>
+#include <boost/foreach.hpp>
+#include "Common.h"
+#include "SSEConfig.h"
+#include "SSEEvent.h"
+#include "TestUtil.h"
+
+#define TEST_EVENTS 300
+#define TEST_NEW_EVENTS 10
+#define TEST_CACHE_LENGTH 500
+
+using namespace std;
+
+int stop = 0;
+
+/**
+  Publish events with a prefix and increasing numbers as ids.
+  @param adapter Adapter to publish to.
+  @param prefix Id prefix.
+  @param count Number of events.
+*/
+static void Publish(CacheInterface* adapter, const string& prefix, int count) {
+  for (int i = 0; i < count; i++) {
+    SSEEvent event(MakeEvent(prefix + boost::lexical_cast<string>(i)));
+    adapter->CacheEvent(event);
+  }
+}
+
+/**
+  Check that a replay holds exactly the new events from a number on.
+  @param name Name of the adapter, for reporting.
+  @param events Replayed events.
+  @param first Number of the first new event expected.
+  @param what Name of the replay call, for reporting.
+*/
+static bool Check(const string& name, const SSEBufferList& events, int first, const char* what) {
+  int expected = first;
+
+  BOOST_FOREACH(const SSEBufferPtr& event, events) {
+    if (event->GetId() != "new-" + boost::lexical_cast<string>(expected)) {
+      fprintf(stderr, "%s: %s returned id %s where new-%d was expected\n",
+        name.c_str(), what, event->GetId().c_str(), expected);
+      return false;
+    }
+
+    expected++;
+  }
+
+  if (expected != TEST_NEW_EVENTS) {
+    fprintf(stderr, "%s: %s returned %d events where %d were expected\n",
+      name.c_str(), what, expected - first, TEST_NEW_EVENTS - first);
+    return false;
+  }
+
+  return true;
+}
+
+/**
+  Fill a cache, purge it and check that it caches and replays new events.
+  Persistent adapters are reopened to check that only the new events were stored.
+  @param name Name of the adapter.
+  @param conf Channel config.
+*/
+static bool Run(const string& name, const ChannelConfig& conf) {
+  CacheInterface* adapter = CreateAdapter(name, conf);
+  bool ok = true;
+
+  // Redis may hold events from an earlier run.
+  if (name == "redis") adapter->Purge();
+
+  Publish(adapter, "old-", TEST_EVENTS);
+  adapter->Purge();
+
+  if (adapter->GetSizeOfCachedEvents() != 0 || !adapter->GetAllEvents().empty()) {
+    fprintf(stderr, "%s: events left after purge\n", name.c_str());
+    ok = false;
+  }
+
+  Publish(adapter, "new-", TEST_NEW_EVENTS);
+
+  ok = Check(name, adapter->GetAllEvents(), 0, "GetAllEvents") && ok;
+  ok = Check(name, adapter->GetEventsSinceId("new-3"), 3, "GetEventsSinceId") && ok;
+
+  if (!adapter->GetEventsSinceId("old-" + boost::lexical_cast<string>(TEST_EVENTS - 1)).empty()) {
+    fprintf(stderr, "%s: purged event replayed\n", name.c_str());
+    ok = false;
+  }
+
+  if (name == "leveldb" || name == "segmentlog" || name == "redis") {
+    delete adapter;
+    adapter = CreateAdapter(name, conf);
+    ok = Check(name, adapter->GetAllEvents(), 0, "GetAllEvents after reopening") && ok;
+  }
+
+  printf("%-12s %s\n", name.c_str(), ok ? "ok" : "FAILED");
+
+  adapter->Purge();
+  delete adapter;
+
+  return ok;
+}
+
+int main(int argc, char **argv) {
+  char dirTemplate[] = "/tmp/ssehub-test-XXXXXX";
+  const char* dir = mkdtemp(dirTemplate);
+  SSEConfig config;
+  bool ok = true;
+
+  if (!dir) {
+    perror("mkdtemp");
+    return 1;
+  }
+
+  FLAGS_logtostderr = 1;
+  google::InitGoogleLogging(argv[0]);
+
+  const string configFile = WriteConfig(dir);
+  config.load(configFile.c_str());
+
+  // Test the adapters named on the command line, or all of them.
+  vector<string> adapters(argv + 1, argv + argc);
+
+  if (adapters.empty()) {
+    adapters.push_back("memory");
+    adapters.push_back("ring");
+    adapters.push_back("leveldb");
+    adapters.push_back("segmentlog");
+    adapters.push_back("tiered");
+
+    // Needs a redis server on redis.host.
+    if (getenv("SSEHUB_TEST_REDIS")) adapters.push_back("redis");
+  }
+
+  BOOST_FOREACH(const string& name, adapters) {
+    ChannelConfig conf = config.GetDefaultChannelConfig();
+    conf.id = "purge-" + name;
+    conf.cacheAdapter = name;
+    conf.cacheLength = TEST_CACHE_LENGTH;
+
+    if (!Run(name, conf)) ok = false;
+  }
+
+  RemoveDir(dir);
+
+  return ok ? 0 : 1;
+}
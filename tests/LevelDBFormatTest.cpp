@@ -0,0 +1,132 @@
+#include <cstdio>
+#include <cstdlib>
+#include <boost/foreach.hpp>
+#include "Common.h"
+#include "SSEConfig.h"
+#include "SSEEvent.h"
+#include "TestUtil.h"
+
+using namespace std;
+
+int stop = 0;
+
+// Events cached by old versions, keyed by id, in the order they were replayed in.
+static const char* oldIds[] = { "event-1", "event-2", "event-3" };
+
+/**
+  Write a storage file the way old versions did, id and rendered event
+  with a terminating NUL, plus a record without an id.
+  @param path Path of the storage file.
+*/
+static bool WriteOldFormat(const string& path) {
+  char* err = NULL;
+  leveldb_options_t* options = leveldb_options_create();
+  leveldb_writeoptions_t* woptions = leveldb_writeoptions_create();
+  leveldb_options_set_create_if_missing(options, 1);
+  leveldb_t* db = leveldb_open(options, path.c_str(), &err);
+
+  if (err == NULL) {
+    BOOST_FOREACH(const char* id, oldIds) {
+      const string key(id);
+      const string value = "id: " + key + "\ndata: " + key + "\n\n";
+      leveldb_put(db, woptions, key.c_str(), key.length() + 1, value.c_str(), value.length() + 1, &err);
+      if (err != NULL) break;
+    }
+  }
+
+  if (err == NULL) {
+    leveldb_put(db, woptions, "", 1, "data: no id\n\n", 14, &err);
+  }
+
+  if (db) leveldb_close(db);
+  leveldb_writeoptions_destroy(woptions);
+  leveldb_options_destroy(options);
+
+  if (err != NULL) {
+    fprintf(stderr, "Failed to write %s: %s\n", path.c_str(), err);
+    leveldb_free(err);
+    return false;
+  }
+
+  return true;
+}
+
+/**
+  Check the ids and data of replayed events.
+  @param events Replayed events.
+  @param ids Expected ids.
+  @param what Name of the replay, for reporting.
+*/
+static bool Check(const SSEBufferList& events, const vector<string>& ids, const char* what) {
+  vector<string> got;
+
+  BOOST_FOREACH(const SSEBufferPtr& event, events) {
+    if (event->GetData() != "id: " + event->GetId() + "\ndata: " + event->GetId() + "\n\n") {
+      fprintf(stderr, "%s: event %s has data %s\n", what, event->GetId().c_str(), event->GetData().c_str());
+      return false;
+    }
+
+    got.push_back(event->GetId());
+  }
+
+  if (got != ids) {
+    fprintf(stderr, "%s: got %zu events where %zu were expected\n", what, got.size(), ids.size());
+    return false;
+  }
+
+  return true;
+}
+
+int main(int argc, char **argv) {
+  char dirTemplate[] = "/tmp/ssehub-test-XXXXXX";
+  const char* dir = mkdtemp(dirTemplate);
+  SSEConfig config;
+  bool ok = true;
+
+  if (!dir) {
+    perror("mkdtemp");
+    return 1;
+  }
+
+  FLAGS_logtostderr = 1;
+  google::InitGoogleLogging(argv[0]);
+
+  const string configFile = WriteConfig(dir);
+  config.load(configFile.c_str());
+
+  ChannelConfig conf = config.GetDefaultChannelConfig();
+  conf.id = "old-format";
+  conf.cacheAdapter = "leveldb";
+  conf.cacheLength = 100;
+
+  if (!WriteOldFormat(string(dir) + "/" + conf.id + ".db")) return 1;
+
+  vector<string> ids(oldIds, oldIds + sizeof(oldIds) / sizeof(oldIds[0]));
+  LevelDB* adapter = new LevelDB(conf);
+
+  ok = Check(adapter->GetAllEvents(), ids, "GetAllEvents after migrating") && ok;
+  ok = Check(adapter->GetEventsSinceId("event-2"), vector<string>(ids.begin() + 1, ids.end()), "GetEventsSinceId after migrating") && ok;
+
+  SSEEvent event(MakeEvent("event-0"));
+  adapter->CacheEvent(event);
+  ids.push_back("event-0");
+
+  // Reopening must not migrate again.
+  delete adapter;
+  adapter = new LevelDB(conf);
+
+  ok = Check(adapter->GetAllEvents(), ids, "GetAllEvents after reopening") && ok;
+
+  if (adapter->GetSizeOfCachedEvents() != ids.size()) {
+    fprintf(stderr, "%zu events counted where %zu were expected\n", adapter->GetSizeOfCachedEvents(), ids.size());
+    ok = false;
+  }
+
+  printf("leveldb format %s\n", ok ? "ok" : "FAILED");
+
+  adapter->Purge();
+  delete adapter;
+  RemoveDir(dir);
+
+  return ok ? 0 : 1;
+}
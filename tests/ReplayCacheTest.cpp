@@ -0,0 +1,121 @@
+#include <cstdio>
+#include <cstdlib>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <boost/lexical_cast.hpp>
+#include "Common.h"
+#include "SSEConfig.h"
+#include "SSEEvent.h"
+#include "SSEChannel.h"
+#include "SSEClientHandler.h"
+#include "TestUtil.h"
+
+#define TEST_EVENTS 20
+
+using namespace std;
+
+int stop = 0;
+
+/**
+  Check the replay cache counters of a channel.
+  @param channel Channel to check.
+  @param hits Expected number of hits.
+  @param misses Expected number of misses.
+  @param what What was done before the check, for reporting.
+*/
+static bool CheckCounters(const SSEChannelPtr& channel, ulong hits, ulong misses, const char* what) {
+  const SSEChannelStats& stats = channel->GetStats();
+
+  if (stats.num_replay_cache_hits != hits || stats.num_replay_cache_misses != misses) {
+    fprintf(stderr, "%s: %lu hits and %lu misses where %lu and %lu were expected\n",
+      what, (ulong)stats.num_replay_cache_hits, (ulong)stats.num_replay_cache_misses, hits, misses);
+    return false;
+  }
+
+  return true;
+}
+
+/**
+  Replay from the same event twice and check that the second replay is
+  served from the replay cache, and that caching an event invalidates it.
+  @param channel Channel to test.
+*/
+static bool Run(const SSEChannelPtr& channel) {
+  bool ok = true;
+
+  for (int i = 0; i < TEST_EVENTS; i++) {
+    SSEEvent event(MakeEvent(boost::lexical_cast<string>(i)));
+    channel->CacheEvent(event);
+  }
+
+  SSEReplayBlobPtr first = channel->GetReplay(REPLAY_SINCE_ID, "5", 0);
+  ok = CheckCounters(channel, 0, 1, "first replay") && ok;
+
+  SSEReplayBlobPtr second = channel->GetReplay(REPLAY_SINCE_ID, "5", 0);
+  ok = CheckCounters(channel, 1, 1, "second replay") && ok;
+
+  if (first != second) {
+    fprintf(stderr, "second replay was rendered again\n");
+    ok = false;
+  }
+
+  if (first->ids.size() != TEST_EVENTS - 5) {
+    fprintf(stderr, "replay holds %zu events where %d were expected\n", first->ids.size(), TEST_EVENTS - 5);
+    ok = false;
+  }
+
+  SSEEvent event(MakeEvent(boost::lexical_cast<string>(TEST_EVENTS)));
+  channel->CacheEvent(event);
+
+  SSEReplayBlobPtr third = channel->GetReplay(REPLAY_SINCE_ID, "5", 0);
+  ok = CheckCounters(channel, 1, 2, "replay after caching an event") && ok;
+
+  if (third->ids.size() != TEST_EVENTS - 4) {
+    fprintf(stderr, "replay after caching an event holds %zu events where %d were expected\n",
+      third->ids.size(), TEST_EVENTS - 4);
+    ok = false;
+  }
+
+  return ok;
+}
+
+int main(int argc, char **argv) {
+  char dirTemplate[] = "/tmp/ssehub-test-XXXXXX";
+  const char* dir = mkdtemp(dirTemplate);
+  SSEConfig config;
+
+  if (!dir) {
+    perror("mkdtemp");
+    return 1;
+  }
+
+  FLAGS_logtostderr = 1;
+  google::InitGoogleLogging(argv[0]);
+
+  const string configFile = WriteConfig(dir);
+  config.load(configFile.c_str());
+
+  ChannelConfig conf = config.GetDefaultChannelConfig();
+  conf.cacheAdapter = "ring";
+  conf.cacheLength = 100;
+
+  // The channel needs a client handler to spread its clients on.
+  int shutdownfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  ClientHandlerList handlers;
+  handlers.push_back(ClientHandlerPtr(new SSEClientHandler(0, &config, shutdownfd)));
+
+  SSEChannelPtr channel(new SSEChannel(conf, "replay-cache", handlers));
+  bool ok = Run(channel);
+  printf("replay cache %s\n", ok ? "ok" : "FAILED");
+  channel.reset();
+
+  // Let the handler exit so it can be joined.
+  uint64_t val = 1;
+  if (write(shutdownfd, &val, sizeof(val)) != sizeof(val)) return 1;
+  handlers.clear();
+  close(shutdownfd);
+
+  RemoveDir(dir);
+
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,68 @@
+#ifndef TESTUTIL_H
+#define TESTUTIL_H
+
+#include <cstdio>
+#include <fstream>
+#include <ftw.h>
+#include <boost/lexical_cast.hpp>
+#include "SSEConfig.h"
+#include "SSEEvent.h"
+#include "CacheAdapters/Memory.h"
+#include "CacheAdapters/Ring.h"
+#include "CacheAdapters/LevelDB.h"
+#include "CacheAdapters/SegmentLog.h"
+#include "CacheAdapters/Tiered.h"
+#include "CacheAdapters/Redis.h"
+
+/**
+  Write a config file pointing the persistent adapters at a scratch directory.
+  @param dir Scratch directory.
+  @returns path of the config file.
+*/
+static inline string WriteConfig(const string& dir) {
+  const string path = dir + "/config.json";
+  ofstream file(path.c_str());
+
+  file << "{ \"leveldb\": { \"storageDir\": \"" << dir << "\" },"
+       << " \"segmentlog\": { \"storageDir\": \"" << dir << "\" },"
+       << " \"tiered\": { \"backend\": \"leveldb\", \"hotLength\": 100 } }";
+
+  return path;
+}
+
+/**
+  Create a cache adapter.
+  @param name Name of the adapter, as in cacheAdapter.
+  @param conf Channel config, must outlive the adapter.
+*/
+static inline CacheInterface* CreateAdapter(const string& name, const ChannelConfig& conf) {
+  if (name == "memory") return new Memory(conf);
+  if (name == "ring") return new Ring(conf);
+  if (name == "leveldb") return new LevelDB(conf);
+  if (name == "segmentlog") return new SegmentLog(conf);
+  if (name == "tiered") return new Tiered(conf, new LevelDB(conf));
+
+  return new Redis(conf.id, conf);
+}
+
+/**
+  Returns an event with a rendered frame.
+  @param id Event id, also used as data.
+*/
+static inline SSEBufferPtr MakeEvent(const string& id) {
+  return SSEBufferPtr(new SSEBuffer("id: " + id + "\ndata: " + id + "\n\n", id));
+}
+
+static inline int RemoveEntry(const char* path, const struct stat*, int, struct FTW*) {
+  return remove(path);
+}
+
+/**
+  Remove a scratch directory and everything the adapters left in it.
+  @param dir Scratch directory.
+*/
+static inline void RemoveDir(const string& dir) {
+  nftw(dir.c_str(), RemoveEntry, 16, FTW_DEPTH | FTW_PHYS);
+}
+
+#endif